@@ -0,0 +1,106 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_ARENA_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_ARENA_H__
+
+#include <new>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+namespace assembly_sim {
+
+  // Storage for objects which are added one at a time and destroyed all at
+  // once
+  //
+  // Objects are constructed in place in large blocks, so they're mostly
+  // contiguous, never move once they're added, and don't each need their own
+  // heap allocation. The arena owns its objects, and pointers into it are
+  // valid until it's cleared.
+  template <class T>
+    class Arena : private boost::noncopyable
+  {
+  public:
+    explicit Arena(size_t block_size = 1024) :
+      block_size_(block_size),
+      size_(0)
+    { }
+
+    ~Arena()
+    {
+      this->clear();
+    }
+
+    // Get storage for the next object
+    // The object has to be constructed in it with placement new and then
+    // added with commit(). If its constructor throws, the storage is reused.
+    void *reserve()
+    {
+      if(size_ == blocks_.size() * block_size_) {
+        blocks_.push_back(static_cast<T*>(::operator new(block_size_ * sizeof(T))));
+      }
+      return blocks_[size_ / block_size_] + size_ % block_size_;
+    }
+
+    // Add the object constructed in the storage from reserve()
+    T *commit()
+    {
+      T *object = blocks_[size_ / block_size_] + size_ % block_size_;
+      size_++;
+      return object;
+    }
+
+    // Make room for n more objects without adding them
+    // Their storage from getStorage() can then be constructed in from any
+    // number of threads, and the objects added with commit(n).
+    void grow(size_t n)
+    {
+      while(blocks_.size() * block_size_ < size_ + n) {
+        blocks_.push_back(static_cast<T*>(::operator new(block_size_ * sizeof(T))));
+      }
+    }
+
+    // Get the storage for the object which will have the given index
+    void *getStorage(size_t i)
+    {
+      return blocks_[i / block_size_] + i % block_size_;
+    }
+
+    // Add the n objects constructed in the storage after the last object
+    void commit(size_t n)
+    {
+      size_ += n;
+    }
+
+    // Add a copy of an object
+    T *push_back(const T &value)
+    {
+      new (this->reserve()) T(value);
+      return this->commit();
+    }
+
+    size_t size() const { return size_; }
+
+    T &operator[](size_t i) { return blocks_[i / block_size_][i % block_size_]; }
+    const T &operator[](size_t i) const { return blocks_[i / block_size_][i % block_size_]; }
+
+    // Destroy all objects in the order they were added
+    void clear()
+    {
+      for(size_t i=0; i < size_; i++) {
+        (*this)[i].~T();
+      }
+      for(size_t i=0; i < blocks_.size(); i++) {
+        ::operator delete(blocks_[i]);
+      }
+      blocks_.clear();
+      size_ = 0;
+    }
+
+  private:
+    size_t block_size_;
+    size_t size_;
+    std::vector<T*> blocks_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_ARENA_H__
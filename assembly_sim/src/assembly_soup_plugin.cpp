@@ -3,6 +3,8 @@
 #include <gazebo/physics/physics.hh>
 #include <gazebo/common/common.hh>
 #include <stdio.h>
+#include <cmath>
+#include <algorithm>
 
 #include <boost/make_shared.hpp>
 #include <boost/thread/mutex.hpp>
@@ -11,6 +13,7 @@
 
 // tf headers
 #include <tf/transform_broadcaster.h>
+#include <tf2_ros/static_transform_broadcaster.h>
 #include <tf_conversions/tf_kdl.h>
 
 // visualize mates in rviz gui
@@ -18,12 +21,13 @@
 
 // send information to ros
 #include <assembly_msgs/MateList.h>
+#include <assembly_msgs/MateEvents.h>
 
 #include <kdl/frames_io.hpp>
 
 #include "assembly_soup_plugin.h"
 #include "models.h"
-#include "util.h"
+#include "gazebo_util.h"
 
 /************************************************************************************/
 /*                                Assembly Sim                                      */
@@ -33,14 +37,34 @@ namespace assembly_sim
 {
 
   AssemblySoup::AssemblySoup() :
-    mate_id_counter_(0),
-    atom_id_counter_(0),
-    tf_world_frame_("world"),
-    broadcast_tf_(false),
     publish_active_mates_(false),
+    publish_mate_events_(false),
+    mate_event_keyframe_cycles_(1),
+    mate_event_cycles_(0),
+    publish_telemetry_(false),
+    telemetry_rate_(0.0),
+    publish_profile_(false),
+    profile_cycles_(1),
+    profile_cycle_count_(0),
+    running_(false),
+    introspecting_(false),
+    introspection_rate_(0.0),
+    step_triggered_(false),
+    update_steps_(0),
+    step_count_(0),
+    check_requested_(false),
+    atom_requests_pending_(false),
+    structure_version_(0),
+    frames_version_(0),
+    broadcast_tf_(false),
+    tf_world_frame_("world"),
+    marker_tolerance_(0.001),
+    snapshot_write_(0),
+    snapshot_ready_(1),
+    snapshot_read_(2),
+    snapshot_fresh_(false),
     last_tick_(0),
-    updates_per_second_(10),
-    running_(false)
+    updates_per_second_(10)
   {
   }
 
@@ -50,17 +74,52 @@ namespace assembly_sim
     this->model_ = _parent;
     this->sdf_ = _sdf;
 
+    // Time the phases of the soup, starting with the rest of this
+    double profile_period = 1.0;
+    if(_sdf->HasElement("profile")) {
+      sdf::ElementPtr profile_elem = _sdf->GetElement("profile");
+      profile_elem->GetValue()->Get(publish_profile_);
+
+      // also time each mate, which is expensive with many mates
+      bool profile_mates = false;
+      if(_sdf->HasElement("profile_mates")) {
+        _sdf->GetElement("profile_mates")->GetValue()->Get(profile_mates);
+      }
+
+      // seconds between published profiles
+      if(_sdf->HasElement("profile_period")) {
+        _sdf->GetElement("profile_period")->GetValue()->Get(profile_period);
+      }
+
+      if(publish_profile_) {
+        Profiler::instance().setEnabled(true, profile_mates);
+        ros::NodeHandle nh;
+        profile_pub_ = nh.advertise<assembly_msgs::Profile>("profile",10);
+        ASSEMBLY_INFO(LOG_LOAD, "Publishing the soup profile!");
+      }
+    }
+
     // Get TF configuration
     sdf::ElementPtr broadcast_elem = _sdf->GetElement("tf_world_frame");
     if (broadcast_elem) {
       broadcast_elem->GetValue()->Get(tf_world_frame_);
-      gzwarn<<"Broadcasting TF frames for joints relative to \""<<tf_world_frame_<<"\""<<std::endl;
+      ASSEMBLY_INFO(LOG_LOAD, "Broadcasting TF frames for joints relative to \""<<tf_world_frame_<<"\"");
       broadcast_tf_ = true;
 
+      tf_broadcaster_.reset(new tf::TransformBroadcaster());
+      static_tf_broadcaster_.reset(new tf2_ros::StaticTransformBroadcaster());
+
       // set up publishers for visualization
+      // these are latched since the markers are only sent when they change
       ros::NodeHandle nh;
-      male_mate_pub_ = nh.advertise<visualization_msgs::MarkerArray>("male_mate_points",1000);
-      female_mate_pub_ = nh.advertise<visualization_msgs::MarkerArray>("female_mate_points",1000);
+      male_mate_pub_ = nh.advertise<visualization_msgs::MarkerArray>("male_mate_points",1,true);
+      female_mate_pub_ = nh.advertise<visualization_msgs::MarkerArray>("female_mate_points",1,true);
+    }
+
+    // distance a mate point has to move before its marker is updated
+    if(_sdf->HasElement("marker_tolerance")) {
+      sdf::ElementPtr marker_tolerance_elem = _sdf->GetElement("marker_tolerance");
+      marker_tolerance_elem->GetValue()->Get(marker_tolerance_);
     }
 
     // are we going to publish ros messages describing mate status?
@@ -70,12 +129,41 @@ namespace assembly_sim
       if (publish_active_mates_) {
         ros::NodeHandle nh;
         active_mates_pub_ = nh.advertise<assembly_msgs::MateList>("active_mates",1000);
-        gzwarn << "Publishing active mates!" << std::endl;
+        ASSEMBLY_INFO(LOG_LOAD, "Publishing active mates!");
       } else {
-        gzwarn << "Not publishing active mates!" << std::endl;
+        ASSEMBLY_INFO(LOG_LOAD, "Not publishing active mates!");
       }
     } else {
-      gzwarn<<"No \"publish_active_mates\" element."<<std::endl;
+      ASSEMBLY_INFO(LOG_LOAD, "No \"publish_active_mates\" element.");
+    }
+
+    // are we going to publish the mate state changes?
+    double mate_event_keyframe_period = 1.0;
+    if(_sdf->HasElement("publish_mate_events")) {
+      sdf::ElementPtr publish_events_elem = _sdf->GetElement("publish_mate_events");
+      publish_events_elem->GetValue()->Get(publish_mate_events_);
+      if(publish_mate_events_) {
+        ros::NodeHandle nh;
+        mate_events_pub_ = nh.advertise<assembly_msgs::MateEvents>("mate_events",100);
+        ASSEMBLY_INFO(LOG_LOAD, "Publishing mate events!");
+      }
+    }
+
+    // are we going to publish the errors and wrenches of the checked mates?
+    if(_sdf->HasElement("publish_telemetry")) {
+      sdf::ElementPtr publish_telemetry_elem = _sdf->GetElement("publish_telemetry");
+      publish_telemetry_elem->GetValue()->Get(publish_telemetry_);
+      if(publish_telemetry_) {
+        ros::NodeHandle nh;
+        telemetry_pub_ = nh.advertise<assembly_msgs::MateTelemetry>("mate_telemetry",10);
+        ASSEMBLY_INFO(LOG_LOAD, "Publishing mate telemetry!");
+      }
+    }
+
+    // seconds between keyframes with the full set of mated mates
+    if(_sdf->HasElement("mate_event_keyframe_period")) {
+      sdf::ElementPtr keyframe_period_elem = _sdf->GetElement("mate_event_keyframe_period");
+      keyframe_period_elem->GetValue()->Get(mate_event_keyframe_period);
     }
 
     if(_sdf->HasElement("updates_per_second")) {
@@ -83,436 +171,828 @@ namespace assembly_sim
       updates_per_second_elem->GetValue()->Get(updates_per_second_);
     }
 
-    gzwarn<<"Getting mate types..."<<std::endl;
-    // Get the description of the mates in this soup
-    sdf::ElementPtr mate_elem = _sdf->GetElement("mate_model");
+    // rate at which TF frames, markers and mate lists are published, which
+    // is the update rate unless it's given explicitly
+    introspection_rate_ = updates_per_second_;
+    if(_sdf->HasElement("introspection_rate")) {
+      sdf::ElementPtr introspection_rate_elem = _sdf->GetElement("introspection_rate");
+      introspection_rate_elem->GetValue()->Get(introspection_rate_);
+    }
 
-    while(mate_elem && mate_elem->GetName() == "mate_model")
-    {
-      // Create a new mate model
-      std::string model;
-      if(mate_elem->HasAttribute("model")) {
-        mate_elem->GetAttribute("model")->Get(model);
-      } else {
-        gzerr<<"ERROR: no mate model type for mate model"<<std::endl;
-        return;
+    // rate at which the telemetry is published, which is the introspection
+    // rate unless it's given explicitly
+    telemetry_rate_ = introspection_rate_;
+    if(_sdf->HasElement("telemetry_rate")) {
+      sdf::ElementPtr telemetry_rate_elem = _sdf->GetElement("telemetry_rate");
+      telemetry_rate_elem->GetValue()->Get(telemetry_rate_);
+    }
+
+    mate_event_keyframe_cycles_ = std::max(
+        static_cast<int>(std::floor(mate_event_keyframe_period * introspection_rate_ + 0.5)), 1);
+    profile_cycles_ = std::max(
+        static_cast<int>(std::floor(profile_period * introspection_rate_ + 0.5)), 1);
+
+    // Load the soup models and parameters
+    backend_ = boost::make_shared<GazeboBackend>(this->model_);
+    if(not soup_.load(_sdf, backend_)) {
+      return;
+    }
+
+    // check the mates on physics iterations instead of the sim time
+    if(_sdf->HasElement("update_trigger")) {
+      std::string update_trigger;
+      sdf::ElementPtr update_trigger_elem = _sdf->GetElement("update_trigger");
+      update_trigger_elem->GetValue()->Get(update_trigger);
+      if(update_trigger == "steps") {
+        step_triggered_ = true;
+      } else if(update_trigger != "sim_time") {
+        ASSEMBLY_ERROR(LOG_LOAD, "Unknown update trigger \""<<update_trigger<<"\", using \"sim_time\"");
       }
+    }
+
+    if(soup_.isDeterministic()) {
+      ASSEMBLY_INFO(LOG_LOAD, "Processing mates deterministically");
+      // There is no update thread to trigger
+      step_triggered_ = false;
+    }
 
-      // Get the model name
-      std::string mate_model_type;
-      if(mate_elem->HasAttribute("type")) {
-        mate_elem->GetAttribute("type")->Get(mate_model_type);
+    if(step_triggered_ or soup_.isDeterministic()) {
+      // number of physics iterations between checks, derived from the update
+      // rate unless it's given explicitly
+      if(_sdf->HasElement("update_steps")) {
+        sdf::ElementPtr update_steps_elem = _sdf->GetElement("update_steps");
+        update_steps_elem->GetValue()->Get(update_steps_);
       } else {
-        gzerr<<"ERROR: no mate type for mate model"<<std::endl;
-        return;
+        const double step_size = _parent->GetWorld()->GetPhysicsEngine()->GetMaxStepSize();
+        update_steps_ = static_cast<int>(std::floor(1.0 / (updates_per_second_ * step_size) + 0.5));
       }
+      update_steps_ = std::max(update_steps_, 1);
+      ASSEMBLY_INFO(LOG_LOAD, "Checking mates every "<<update_steps_<<" physics iterations");
+    }
 
-      if(mate_models_.find(mate_model_type) == mate_models_.end()) {
-        // Determine the type of mate model
-        gzlog<<"Adding mate model for "<<mate_model_type<<std::endl;
+    ASSEMBLY_INFO(LOG_LOAD, "Extracting links...");
+    const boost::uint64_t atoms_start = get_profile_time();
+    {
+      ASSEMBLY_PROFILE("load/atoms");
 
-        // Store this mate model
-        MateModelPtr mate_model = boost::make_shared<MateModel>(mate_model_type, mate_elem);
-        mate_models_[mate_model->type] = mate_model;
+      // Extract the links from the model
+      gazebo::physics::Link_V assembly_links = this->model_->GetLinks();
+      for(gazebo::physics::Link_V::iterator it=assembly_links.begin();
+          it != assembly_links.end();
+          ++it)
+      {
+        // Create new atom
+        AtomPtr atom = soup_.addAtom((*it)->GetName());
 
-        // Create a mate factory
-        MateFactoryBasePtr mate_factory;
-        if(model == "proximity") {
-          mate_factory = boost::make_shared<MateFactory<ProximityMate> >(mate_model, model_);
-        } else if(model == "dipole") {
-          mate_factory = boost::make_shared<MateFactory<DipoleMate> >(mate_model, model_);
-        } else {
-          gzerr<<"ERROR: \""<<model<<"\" is not a valid model type"<<std::endl;
-          return;
+        // Skip this link if it isn't an atom
+        if(atom) {
+          backend_->addLink(*atom, *it);
+          registered_atoms_.insert(atom->name);
         }
-        mate_factories_[mate_model->type] = mate_factory; 
       }
-
-      // Get the next atom element
-      mate_elem = mate_elem->GetNextElement(mate_elem->GetName());
     }
 
-    gzwarn<<"Getting atom models..."<<std::endl;
-    // Get the description of the atoms in this soup
-    sdf::ElementPtr atom_elem = _sdf->GetElement("atom_model");
+    // Create all potential mates
+    const boost::uint64_t mates_start = get_profile_time();
+    soup_.init();
+    atom_states_.resize(soup_.getAtoms().size());
 
-    while(atom_elem && atom_elem->GetName() == "atom_model")
+    // Name the TF frames and send the ones which never change
+    const boost::uint64_t frames_start = get_profile_time();
     {
-      // Create a new atom
-      AtomModelPtr atom_model = boost::make_shared<AtomModel>();
-      atom_elem->GetAttribute("type")->Get(atom_model->type);
+      ASSEMBLY_PROFILE("load/frames");
+      this->initFrames();
+      this->initMarkers(male_markers_, "male_mate_points", true);
+      this->initMarkers(female_markers_, "female_mate_points", false);
+    }
+    const boost::uint64_t frames_end = get_profile_time();
+
+    ASSEMBLY_INFO(LOG_LOAD, "Loaded the soup in "<<(frames_end - atoms_start)*1E-9<<"s"
+                  <<" (atoms: "<<(mates_start - atoms_start)*1E-9<<"s"
+                  <<", mates: "<<(frames_start - mates_start)*1E-9<<"s"
+                  <<", frames: "<<(frames_end - frames_start)*1E-9<<"s)");
+
+    // Publish introspection from its own thread
+    const bool introspection =
+      broadcast_tf_ or publish_active_mates_ or publish_mate_events_ or publish_telemetry_ or publish_profile_;
+    if(introspection and introspection_rate_ > 0.0 and (telemetry_rate_ > 0.0 or not publish_telemetry_)) {
+      this->reserveIntrospection();
+
+      if(publish_mate_events_) {
+        // Each mate changes state at most once per check, so this only
+        // overflows if the introspection thread falls far behind
+        soup_.enableMateEvents(soup_.getMates().size() + 1024);
+      }
 
-      // Get the atom mate points
-      sdf::ElementPtr mate_elem = atom_elem->GetElement("mate_point");
-      while(mate_elem)
-      {
-        std::string type;
-        std::string gender;
-        KDL::Frame base_pose;
+      introspecting_ = true;
+      introspection_thread_ = boost::thread(boost::bind(&AssemblySoup::introspectionLoop, this));
+    } else if(introspection) {
+      ASSEMBLY_WARN(LOG_LOAD, "The introspection and telemetry rates have to be positive, not publishing introspection");
+      broadcast_tf_ = publish_active_mates_ = publish_mate_events_ = publish_telemetry_ = publish_profile_ = false;
+    }
 
-        mate_elem->GetAttribute("type")->Get(type);
-        mate_elem->GetAttribute("gender")->Get(gender);
-        to_kdl(mate_elem->GetElement("pose"), base_pose);
+    // Add and remove atoms while the soup is running
+    {
+      ros::NodeHandle nh;
+      register_atom_server_ = nh.advertiseService("register_atom", &AssemblySoup::registerAtom, this);
+      unregister_atom_server_ = nh.advertiseService("unregister_atom", &AssemblySoup::unregisterAtom, this);
+    }
 
-        gzwarn<<"Adding mate point type: "<<type<<" gender: "<<gender<<" at: "<<base_pose<<std::endl;
+    // Listen to the update event. This event is broadcast every
+    // simulation iteration.
+    this->updateConnection_ = gazebo::event::Events::ConnectWorldUpdateBegin(
+        boost::bind(&AssemblySoup::OnUpdate, this, _1));
 
-        MateModelPtr mate_model = mate_models_[type];
+    // Count physics iterations to trigger the checks
+    if(step_triggered_) {
+      this->updateEndConnection_ = gazebo::event::Events::ConnectWorldUpdateEnd(
+          boost::bind(&AssemblySoup::OnUpdateEnd, this));
+    }
+  }
 
-        if(not mate_model) {
-          gzerr<<"No mate model for type: "<<type<<std::endl;
-          break;
-        }
+  void AssemblySoup::initFrames()
+  {
+    const std::vector<AtomPtr> &atoms = soup_.getAtoms();
+    atom_frames_.resize(atoms.size());
 
-        MatePointPtr mate_point;
+    for(std::vector<AtomPtr>::const_iterator it = atoms.begin();
+        it != atoms.end();
+        ++it)
+    {
+      const AtomPtr &atom = *it;
+      AtomFrames &frames = atom_frames_[atom->id];
 
-        if(boost::iequals(gender, "female")) {
-#if 0
-          for(std::vector<KDL::Frame>::iterator pose_it = mate_model->symmetries.begin();
-              pose_it != mate_model->symmetries.end();
-              ++pose_it)
-          {
-            mate_point = boost::make_shared<MatePoint>();
-            mate_point->model = mate_model;
-            mate_point->pose = base_pose * (*pose_it);
-            mate_point->id =
-              atom_model->female_mate_points.size()
-              + atom_model->male_mate_points.size();
+      // Slots of removed atoms are reused with new names
+      frames.male_mate_point_names.clear();
+      frames.female_mate_point_names.clear();
 
-            gzwarn<<"Adding female mate point "<<atom_model->type<<"#"<<mate_point->id<<" pose: "<<std::endl<<mate_point->pose<<std::endl;
+      frames.link_name = boost::str(
+          boost::format("%s/%s")
+          % atom->name
+          % atom->model->type);
 
-            atom_model->female_mate_points.push_back(mate_point);
-          }
-#else
-          mate_point = boost::make_shared<MatePoint>();
-          mate_point->model = mate_model;
-          mate_point->pose = base_pose;
-          mate_point->id =
-            atom_model->female_mate_points.size()
-            + atom_model->male_mate_points.size();
-
-          gzwarn<<"Adding female mate point "<<atom_model->type<<"#"<<mate_point->id<<" pose: "<<std::endl<<mate_point->pose<<std::endl;
-
-          atom_model->female_mate_points.push_back(mate_point);
-#endif
-        } else if(boost::iequals(gender, "male")) {
-          mate_point = boost::make_shared<MatePoint>();
-          mate_point->model = mate_model;
-          mate_point->pose = base_pose;
-          mate_point->id =
-            atom_model->female_mate_points.size()
-            + atom_model->male_mate_points.size();
-
-          gzwarn<<"Adding male mate point "<<atom_model->type<<"#"<<mate_point->id<<" pose: "<<std::endl<<mate_point->pose<<std::endl;
-
-          atom_model->male_mate_points.push_back(mate_point);
-        } else {
-          gzerr<<"Unknown gender: "<<gender<<std::endl;
-        }
+      for(std::vector<MatePointPtr>::iterator it_mmp = atom->model->male_mate_points.begin();
+          it_mmp != atom->model->male_mate_points.end();
+          ++it_mmp)
+      {
+        frames.male_mate_point_names.push_back(boost::str(
+            boost::format("%s/male_%d")
+            % atom->name
+            % (*it_mmp)->id));
+      }
 
-        // Get the next mate point element
-        mate_elem = mate_elem->GetNextElement(mate_elem->GetName());
+      for(std::vector<MatePointPtr>::iterator it_fmp = atom->model->female_mate_points.begin();
+          it_fmp != atom->model->female_mate_points.end();
+          ++it_fmp)
+      {
+        frames.female_mate_point_names.push_back(boost::str(
+            boost::format("%s/female_%d")
+            % atom->name
+            % (*it_fmp)->id));
       }
 
-      // Store this atom
-      atom_models_[atom_model->type] = atom_model;
+      // Mate point ids are shared between the genders
+      frames.mate_point_indices.resize(
+          atom->model->male_mate_points.size() + atom->model->female_mate_points.size());
+      for(size_t i=0; i < atom->model->male_mate_points.size(); i++) {
+        frames.mate_point_indices[atom->model->male_mate_points[i]->id] = i;
+      }
+      for(size_t i=0; i < atom->model->female_mate_points.size(); i++) {
+        frames.mate_point_indices[atom->model->female_mate_points[i]->id] = i;
+      }
+    }
 
-      // Get the next atom element
-      atom_elem = atom_elem->GetNextElement(atom_elem->GetName());
+    if(not broadcast_tf_) {
+      return;
     }
 
-    gzwarn<<"Extracting links..."<<std::endl;
-    // Extract the links from the model
-    gazebo::physics::Link_V assembly_links = this->model_->GetLinks();
-    for(gazebo::physics::Link_V::iterator it=assembly_links.begin();
-        it != assembly_links.end();
+    // The mate points are fixed to their atoms, so they only need to be sent
+    // once on /tf_static
+    const ros::Time now = ros::Time::now();
+    for(std::vector<AtomPtr>::const_iterator it = atoms.begin();
+        it != atoms.end();
         ++it)
     {
-      gzwarn<<"Creating atom for link: "<<(*it)->GetName()<<std::endl;
+      const AtomPtr &atom = *it;
+      const AtomFrames &frames = atom_frames_[atom->id];
 
-      // Create new atom
-      AtomPtr atom = boost::make_shared<Atom>();
-      atom->link = *it;
+      if(not atom->active) {
+        continue;
+      }
 
-      // Determine the atom type from the link name
-      for(std::map<std::string, AtomModelPtr>::iterator model_it=atom_models_.begin();
-          model_it != atom_models_.end();
-          ++model_it)
-      {
-        if(atom->link->GetName().find(model_it->second->type) == 0) {
-          atom->model = model_it->second;
-          break;
-        }
+      for(size_t i=0; i < atom->model->male_mate_points.size(); i++) {
+        this->addTransform(
+            atom->model->male_mate_points[i]->pose,
+            now,
+            frames.link_name,
+            frames.male_mate_point_names[i]);
       }
 
-      // Skip this atom if it doesn't have a model
-      if(not atom->model) {
-        gzerr<<"Atom doesn't have a model type!"<<std::endl;
-        continue;
+      for(size_t i=0; i < atom->model->female_mate_points.size(); i++) {
+        this->addTransform(
+            atom->model->female_mate_points[i]->pose,
+            now,
+            frames.link_name,
+            frames.female_mate_point_names[i]);
       }
+    }
+
+    static_tf_broadcaster_->sendTransform(tf_transforms_);
+    tf_transforms_.clear();
+  }
 
-      gzwarn<<"Atom "<<atom->link->GetName()<<" is a "<<atom->model->type<<std::endl;
+  // Get the marker color of a mate point in the given state
+  static void get_mate_point_color(Mate::State state, bool male, std_msgs::ColorRGBA &color)
+  {
+    switch(state) {
+      case Mate::MATED:
+        color.r = 0.0; color.g = 1.0; color.b = 0.0; color.a = 0.75;
+        break;
+      case Mate::MATING:
+        color.r = 1.0; color.g = 1.0; color.b = 0.0; color.a = 0.5;
+        break;
+      case Mate::NONE:
+        // The mate points of removed atoms are hidden
+        color.r = 0.0; color.g = 0.0; color.b = 0.0; color.a = 0.0;
+        break;
+      default:
+        color.r = male ? 1.0 : 0.0; color.g = 0.0; color.b = male ? 0.0 : 1.0; color.a = 0.25;
+        break;
+    };
+  }
+
+  void AssemblySoup::initMarkers(MatePointMarkers &markers, const std::string &ns, bool male)
+  {
+    const std::vector<AtomPtr> &atoms = soup_.getAtoms();
 
-      atoms_.push_back(atom);
+    // Each atom's mate points are stored together
+    size_t n_points = 0;
+    markers.atom_offsets.resize(atoms.size());
+    for(std::vector<AtomPtr>::const_iterator it = atoms.begin();
+        it != atoms.end();
+        ++it)
+    {
+      markers.atom_offsets[(*it)->id] = n_points;
+      n_points += male ? (*it)->model->male_mate_points.size() : (*it)->model->female_mate_points.size();
     }
 
-    // Iterate over all atoms and create potential mate objects
-    for(std::vector<AtomPtr>::iterator it_fa = atoms_.begin();
-        it_fa != atoms_.end();
-        ++it_fa)
+    markers.states.assign(n_points, Mate::UNMATED);
+    // Nothing has been published yet
+    markers.published_states.assign(n_points, Mate::NONE);
+
+    // One marker for all of the mate points
+    markers.marker_array.markers.resize(1);
+    visualization_msgs::Marker &marker = markers.marker_array.markers[0];
+    marker.header.frame_id = tf_world_frame_;
+    marker.header.stamp = ros::Time(0);
+    marker.ns = ns;
+    marker.id = 0;
+    marker.type = marker.CUBE_LIST;
+    marker.action = marker.ADD;
+    marker.pose.orientation.w = 1.0;
+    marker.scale.x = 0.02;
+    marker.scale.y = 0.02;
+    marker.scale.z = 0.01;
+    marker.points.resize(n_points);
+    marker.colors.resize(n_points);
+  }
+
+  void AssemblySoup::markMatePoint(
+      MatePointMarkers &markers,
+      const AtomPtr &atom,
+      const MatePointPtr &mate_point,
+      Mate::State state)
+  {
+    const size_t index =
+      markers.atom_offsets[atom->id] +
+      atom_frames_[atom->id].mate_point_indices[mate_point->id];
+
+    markers.states[index] = std::max(markers.states[index], state);
+  }
+
+  void AssemblySoup::updateMarkers(
+      MatePointMarkers &markers,
+      const AtomStateVector &atom_states,
+      bool male,
+      const ros::Publisher &publisher)
+  {
+    visualization_msgs::Marker &marker = markers.marker_array.markers[0];
+    const double tolerance_sq = marker_tolerance_ * marker_tolerance_;
+    bool changed = false;
+
+    const std::vector<AtomPtr> &atoms = soup_.getAtoms();
+    for(std::vector<AtomPtr>::const_iterator it = atoms.begin();
+        it != atoms.end();
+        ++it)
     {
-      AtomPtr female_atom = *it_fa;
-      gzwarn<<"Inspecting female atom: "<<female_atom->link->GetName()<<std::endl;
+      const std::vector<MatePointPtr> &mate_points =
+        male ? (*it)->model->male_mate_points : (*it)->model->female_mate_points;
+      size_t index = markers.atom_offsets[(*it)->id];
 
-      // Iterate over all female mate points of female link
-      for(std::vector<MatePointPtr>::iterator it_fmp = female_atom->model->female_mate_points.begin();
-          it_fmp != female_atom->model->female_mate_points.end();
-          ++it_fmp)
+      // Atoms added since the snapshot was taken aren't shown yet
+      const bool visible = (*it)->active and (*it)->id < atom_states.size();
+
+      for(size_t i=0; i < mate_points.size(); i++, index++)
       {
-        MatePointPtr female_mate_point = *it_fmp;
-
-        // Iterate over all other atoms
-        for(std::vector<AtomPtr>::iterator it_ma = atoms_.begin();
-            it_ma != atoms_.end();
-            ++it_ma)
-        {
-          AtomPtr male_atom = *it_ma;
-
-          // You can't mate with yourself
-          if(male_atom == female_atom) { continue; }
-
-          // Iterate over all male mate points of male link
-          for(std::vector<MatePointPtr>::iterator it_mmp = male_atom->model->male_mate_points.begin();
-              it_mmp != male_atom->model->male_mate_points.end();
-              ++it_mmp)
-          {
-            MatePointPtr male_mate_point = *it_mmp;
-
-            // Skip if the mates are incompatible
-            if(female_mate_point->model != male_mate_point->model) { continue; }
-
-            // Construct the mate between these two mate points
-            MatePtr mate = mate_factories_[female_mate_point->model->type]->createMate(
-              female_mate_point,
-              male_mate_point,
-              female_atom,
-              male_atom);
-
-            mates_.insert(mate);
+        // Only move the points which are out of tolerance, so every point
+        // stays within tolerance of where it was last published
+        if(visible) {
+          const KDL::Vector position = atom_states[(*it)->id].pose * mate_points[i]->pose.p;
+          geometry_msgs::Point &point = marker.points[index];
+          const double dx = position.x() - point.x;
+          const double dy = position.y() - point.y;
+          const double dz = position.z() - point.z;
+          if(dx*dx + dy*dy + dz*dz > tolerance_sq) {
+            point.x = position.x();
+            point.y = position.y();
+            point.z = position.z();
+            changed = true;
           }
         }
+
+        const Mate::State state = visible ? markers.states[index] : Mate::NONE;
+        if(state != markers.published_states[index]) {
+          get_mate_point_color(state, male, marker.colors[index]);
+          markers.published_states[index] = state;
+          changed = true;
+        }
+
+        // The states are marked again by the next cycle
+        markers.states[index] = Mate::UNMATED;
       }
     }
 
-    // Listen to the update event. This event is broadcast every
-    // simulation iteration.
-    this->updateConnection_ = gazebo::event::Events::ConnectWorldUpdateBegin(
-        boost::bind(&AssemblySoup::OnUpdate, this, _1));
+    if(changed) {
+      publisher.publish(markers.marker_array);
+    }
+  }
+
+  void AssemblySoup::addTransform(
+      const KDL::Frame &frame,
+      const ros::Time &stamp,
+      const std::string &parent_frame,
+      const std::string &child_frame)
+  {
+    tf_transforms_.resize(tf_transforms_.size() + 1);
+    geometry_msgs::TransformStamped &transform = tf_transforms_.back();
+
+    transform.header.stamp = stamp;
+    transform.header.frame_id = parent_frame;
+    transform.child_frame_id = child_frame;
+    tf::transformKDLToMsg(frame, transform.transform);
   }
 
   void AssemblySoup::queueStateUpdates() {
 
-    static tf::TransformBroadcaster br;
+    // Skip this check to let the OnUpdate thread add and remove atoms
+    // In deterministic mode this runs in the OnUpdate thread, after the
+    // requests have been applied.
+    if(atom_requests_pending_ and not soup_.isDeterministic()) {
+      ASSEMBLY_PROFILE_COUNT("check_yields", 1);
+      return;
+    }
+
+    // Keep the OnUpdate thread from adding or removing atoms until the
+    // snapshot has been taken
+    boost::shared_lock<boost::shared_mutex> structure_lock(structure_mutex_);
 
-    assembly_msgs::MateList mates_msg;
+    // Hold the latest atom states captured by the main update thread
+    AtomStateBuffer::Reader atom_states_reader(atom_states_);
+    const AtomStateVector &atom_states = atom_states_reader.states();
 
-    // Synchronize with main update thread
-    boost::mutex::scoped_lock update_lock(update_mutex_);
+    // Check the mates which are close enough to change state
+    soup_.queueUpdates(atom_states);
 
-    unsigned int iter = 0;
+    // Hand the result to the introspection thread
+    if(broadcast_tf_ or publish_active_mates_ or publish_telemetry_) {
+      this->takeSnapshot(atom_states);
+    }
+  }
 
-    // Iterate over all mates
-    for (boost::unordered_set<MatePtr>::iterator it = mates_.begin();
-         it != mates_.end();
-         ++it, ++iter)
-    {
-      MatePtr mate = *it;
-      std::cerr << tf_world_frame_ << ", " << mate->joint->GetName() << " " << broadcast_tf_ << "\n";
+  void AssemblySoup::reserveIntrospection()
+  {
+    const size_t n_atoms = soup_.getAtoms().size();
+    const size_t n_mates = soup_.getMates().size();
+
+    for(int i=0; i < 3; i++) {
+      snapshots_[i].atom_states.resize(n_atoms);
+      snapshots_[i].mates.reserve(n_mates);
+    }
+
+    if(publish_telemetry_) {
+      // Room for every mate, so the telemetry never allocates
+      telemetry_msg_.mate_id.reserve(n_mates);
+      telemetry_msg_.state.reserve(n_mates);
+      telemetry_msg_.linear_error.reserve(n_mates);
+      telemetry_msg_.angular_error.reserve(n_mates);
+      telemetry_msg_.symmetry.reserve(n_mates);
+      telemetry_msg_.force.reserve(n_mates);
+      telemetry_msg_.torque.reserve(n_mates);
+    }
 
-      if(publish_active_mates_ and mate->state == Mate::MATED) {
-        mates_msg.female.push_back(mate->joint->GetParent()->GetName());
-        mates_msg.male.push_back(mate->joint->GetChild()->GetName());
+    if(publish_mate_events_ and attach_events_.size() < n_mates) {
+      attach_events_.resize(n_mates);
+      attached_.resize(n_mates, false);
+    }
+  }
+
+  void AssemblySoup::takeSnapshot(const AtomStateVector &atom_states)
+  {
+    ASSEMBLY_PROFILE("check/snapshot");
+
+    IntrospectionSnapshot &snapshot = snapshots_[snapshot_write_];
+
+    snapshot.stamp = ros::Time::now();
+    snapshot.atom_states = atom_states;
+
+    const std::vector<MatePtr> &mate_candidates = soup_.getMateCandidates();
+    snapshot.mates.resize(mate_candidates.size());
+
+    for(size_t i=0; i < mate_candidates.size(); i++)
+    {
+      const MatePtr &mate = mate_candidates[i];
+      IntrospectionSnapshot::MateState &mate_state = snapshot.mates[i];
+
+      mate_state.mate = mate;
+
+      // The check thread is the only one which writes these
+      mate_state.linear_error = mate->checked_error.vel.Norm();
+      mate_state.angular_error = mate->checked_error.rot.Norm();
+      mate_state.symmetry = mate->checked_symmetry;
+      mate_state.force = mate->checked_wrench.force.Norm();
+      mate_state.torque = mate->checked_wrench.torque.Norm();
+
+      // Mates with pending updates belong to the OnUpdate thread until
+      // they're serviced, so only their requested state is used
+      mate_state.state = mate->getUpdate();
+      mate_state.pending = mate_state.state != Mate::NONE;
+      if(not mate_state.pending) {
+        mate_state.state = mate->state;
       }
 
-#if 1
-      // Check if this mate is already scheduled to be updated
-      if(mate->needsUpdate()) {
-        //gzwarn<<"mate "<<mate->getDescription()<<" already scheduled."<<std::endl;
-        continue;
+      mate_state.attached = broadcast_tf_ and not mate_state.pending and mate->constraint;
+      if(mate_state.attached) {
+        const KDL::Frame &male_atom_frame = atom_states[mate->male->id].pose;
+        KDL::Frame male_mate_frame = male_atom_frame * mate->male_mate_point->pose * mate->anchor_offset;
+        mate_state.joint_frame = KDL::Frame(
+            male_mate_frame.M,
+            mate->constraint->getAnchor());
+        mate_state.joint_name = mate->constraint->getName();
       }
+    }
+
+    // Make this snapshot the ready one
+    {
+      boost::mutex::scoped_lock lock(snapshot_mutex_);
+      std::swap(snapshot_write_, snapshot_ready_);
+      snapshot_fresh_ = true;
+    }
+  }
+
+  void AssemblySoup::publishIntrospection(const IntrospectionSnapshot &snapshot)
+  {
+    ASSEMBLY_PROFILE("introspection/publish");
+
+    assembly_msgs::MateList mates_msg;
 
-      // Queue any updates
-      mate->queueUpdate();
+    // All frames sent for this snapshot have the same stamp and go out in
+    // one message
+    tf_transforms_.clear();
 
-      // Schedule mates to detach / attach etc
-      if(mate->needsUpdate()) {
-        //gzwarn<<"mate /"<<mate->getDescription()<<" needs to be updated"<<std::endl;
-        mate_update_queue_.push(mate);
+    for(std::vector<IntrospectionSnapshot::MateState>::const_iterator it = snapshot.mates.begin();
+        it != snapshot.mates.end();
+        ++it)
+    {
+      const MatePtr &mate = it->mate;
+
+      // Color the mate points by the most advanced state of their mates
+      if(broadcast_tf_) {
+        markMatePoint(female_markers_, mate->female, mate->female_mate_point, it->state);
+        markMatePoint(male_markers_, mate->male, mate->male_mate_point, it->state);
       }
-#endif
 
-        std::cerr << "!!!!!!!!!!!!!\n";
-        std::cerr << tf_world_frame_ << ", " << mate->joint->GetName() << " " << broadcast_tf_ << "\n";
+      // Pending mates are reported once they're serviced
+      if(publish_active_mates_ and not it->pending and it->state == Mate::MATED) {
+        mates_msg.female.push_back(mate->female->name);
+        mates_msg.male.push_back(mate->male->name);
+      }
 
       // Broadcast the TF frame for this joint
-      // TODO: move this introspection out of this thread
-      if (broadcast_tf_ and mate->joint->GetParent() and mate->joint->GetChild())
+      if(it->attached) {
+        this->addTransform(
+            it->joint_frame,
+            snapshot.stamp,
+            tf_world_frame_,
+            it->joint_name);
+      }
+    }
+
+    if(broadcast_tf_)
+    {
+      const std::vector<AtomPtr> &atoms = soup_.getAtoms();
+      for(std::vector<AtomPtr>::const_iterator it = atoms.begin();
+          it != atoms.end();
+          ++it)
       {
-        tf::Transform tf_joint_frame;
-        //to_kdl(male_atom->link->GetWorldPose() * mate->joint->GetInitialAnchorPose(), tf_frame);
-        //to_tf(mate->joint->GetWorldPose(), tf_frame);
+        if(not (*it)->active or (*it)->id >= snapshot.atom_states.size()) {
+          continue;
+        }
+
+        // Broadcast a tf frame for this link
+        // The mate point frames are static and relative to this one
+        this->addTransform(
+            snapshot.atom_states[(*it)->id].pose,
+            snapshot.stamp,
+            tf_world_frame_,
+            atom_frames_[(*it)->id].link_name);
+      }
 
-        gazebo::math::Vector3 anchor = mate->joint->GetAnchor(0);
+      // Send the joint and link frames together
+      tf_broadcaster_->sendTransform(tf_transforms_);
 
-        KDL::Frame male_atom_frame;
-        to_kdl(mate->male->link->GetWorldPose(), male_atom_frame);
-        KDL::Frame male_mate_frame = male_atom_frame * mate->male_mate_point->pose * mate->anchor_offset;
-        KDL::Frame joint_frame = KDL::Frame(
-            male_mate_frame.M,
-            KDL::Vector(anchor.x, anchor.y, anchor.z));
-        tf::poseKDLToTF(joint_frame, tf_joint_frame);
+      // Mark the mate points if they've changed
+      this->updateMarkers(male_markers_, snapshot.atom_states, true, male_mate_pub_);
+      this->updateMarkers(female_markers_, snapshot.atom_states, false, female_mate_pub_);
+    }
+
+    if (publish_active_mates_) {
+      active_mates_pub_.publish(mates_msg);
+    }
+  }
+
+  // Advance a deadline by one period without trying to catch up on periods
+  // which were missed
+  static void advance_deadline(
+      boost::system_time &deadline,
+      const boost::posix_time::time_duration &period,
+      const boost::system_time &now)
+  {
+    deadline += period;
+    if(deadline < now) {
+      deadline = now;
+    }
+  }
 
-        br.sendTransform(
-            tf::StampedTransform(
-                tf_joint_frame,
-                ros::Time::now(),
-                tf_world_frame_,
-                mate->joint->GetName()));
+  void AssemblySoup::introspectionLoop()
+  {
+    ASSEMBLY_INFO(LOG_INTROSPECTION, "Introspection thread running at "<<introspection_rate_<<" Hz");
+
+    const boost::posix_time::time_duration period =
+      boost::posix_time::microseconds(static_cast<long>(1E6 / introspection_rate_));
+    const boost::posix_time::time_duration telemetry_period =
+      publish_telemetry_ ?
+      boost::posix_time::microseconds(static_cast<long>(1E6 / telemetry_rate_)) :
+      period;
+
+    const boost::system_time start_time = boost::get_system_time();
+    boost::system_time next_time = start_time + period;
+    boost::system_time next_telemetry_time = start_time + telemetry_period;
+
+    // Whether the read snapshot still has to be published by each of them
+    bool introspection_pending = false;
+    bool telemetry_pending = false;
+
+    boost::mutex::scoped_lock lock(snapshot_mutex_);
+    while(introspecting_) {
+      // Wait for the next period, or until the plugin is destroyed
+      const boost::system_time wake_time =
+        publish_telemetry_ ? std::min(next_time, next_telemetry_time) : next_time;
+      while(introspecting_ and snapshot_cond_.timed_wait(lock, wake_time)) { }
+
+      if(not introspecting_) {
+        break;
+      }
+
+      // Take the latest snapshot if anything has been checked since the last one
+      if(snapshot_fresh_) {
+        std::swap(snapshot_read_, snapshot_ready_);
+        snapshot_fresh_ = false;
+        introspection_pending = telemetry_pending = true;
+      }
+
+      const boost::system_time now = boost::get_system_time();
+      const bool introspect = now >= next_time;
+      const bool telemetry = publish_telemetry_ and now >= next_telemetry_time;
+      if(introspect) {
+        advance_deadline(next_time, period, now);
       }
+      if(telemetry) {
+        advance_deadline(next_telemetry_time, telemetry_period, now);
+      }
+
+      // Publish next cycle to let the OnUpdate thread add and remove atoms
+      if(atom_requests_pending_) {
+        continue;
+      }
+
+      // Publish without holding up the update thread
+      lock.unlock();
+      // The atoms and mates can't be changed while they're published
+      boost::shared_lock<boost::shared_mutex> structure_lock(structure_mutex_);
+      if(introspect) {
+        // Name the frames of the atoms which have been added
+        if(frames_version_ != structure_version_.load()) {
+          frames_version_ = structure_version_.load();
+          this->initFrames();
+          this->initMarkers(male_markers_, "male_mate_points", true);
+          this->initMarkers(female_markers_, "female_mate_points", false);
+        }
+        if(introspection_pending) {
+          this->publishIntrospection(snapshots_[snapshot_read_]);
+          introspection_pending = false;
+        }
+        if(publish_mate_events_) {
+          this->publishMateEvents();
+        }
+        if(publish_profile_ and ++profile_cycle_count_ >= profile_cycles_) {
+          profile_cycle_count_ = 0;
+          this->publishProfile();
+        }
+      }
+      if(telemetry and telemetry_pending) {
+        this->publishTelemetry(snapshots_[snapshot_read_]);
+        telemetry_pending = false;
+      }
+      structure_lock.unlock();
+      lock.lock();
     }
+  }
 
-    // Broadcast TF frames for this link
-    // TODO: move this introspection out of this thread
-    if(broadcast_tf_)
+  void AssemblySoup::publishTelemetry(const IntrospectionSnapshot &snapshot)
+  {
+    ASSEMBLY_PROFILE("introspection/telemetry");
+
+    assembly_msgs::MateTelemetry &msg = telemetry_msg_;
+    const size_t n_mates = snapshot.mates.size();
+
+    // These were reserved for every mate, so resizing them doesn't allocate
+    msg.mate_id.resize(n_mates);
+    msg.state.resize(n_mates);
+    msg.linear_error.resize(n_mates);
+    msg.angular_error.resize(n_mates);
+    msg.symmetry.resize(n_mates);
+    msg.force.resize(n_mates);
+    msg.torque.resize(n_mates);
+
+    for(size_t i=0; i < n_mates; i++)
     {
-      visualization_msgs::MarkerArray male_mate_markers;
-      visualization_msgs::MarkerArray female_mate_markers;
+      const IntrospectionSnapshot::MateState &mate_state = snapshot.mates[i];
+      msg.mate_id[i] = mate_state.mate->id;
+      msg.state[i] = mate_state.state;
+      msg.linear_error[i] = mate_state.linear_error;
+      msg.angular_error[i] = mate_state.angular_error;
+      msg.symmetry[i] = mate_state.symmetry;
+      msg.force[i] = mate_state.force;
+      msg.torque[i] = mate_state.torque;
+    }
 
-      unsigned int atom_id = 0;
-      for(std::vector<AtomPtr>::iterator it_fa = atoms_.begin();
-          it_fa != atoms_.end();
-          ++it_fa,++atom_id)
-      {
+    msg.header.stamp = snapshot.stamp;
+    telemetry_pub_.publish(msg);
+  }
 
-        AtomPtr female_atom = *it_fa;
-        //gzwarn<<"broadcasting tf/marker info"<<std::endl;
+  void AssemblySoup::publishProfile()
+  {
+    // Each profile covers the timings since the last one
+    Profiler::instance().getIntervalStats(timer_stats_, counter_stats_);
 
-        // Get the female atom frame
-        KDL::Frame female_atom_frame;
-        to_kdl(female_atom->link->GetWorldPose(), female_atom_frame);
+    assembly_msgs::Profile msg;
+    msg.header.stamp = ros::Time::now();
 
-        // Construct some names for use with TF
-        const std::string atom_name = boost::str(
-            boost::format("%s")
-            % female_atom->link->GetName());
-        const std::string link_name = boost::str(
-            boost::format("%s/%s")
-            % atom_name
-            % female_atom->model->type);
+    for(std::vector<TimerStats>::const_iterator it = timer_stats_.begin();
+        it != timer_stats_.end();
+        ++it)
+    {
+      msg.timer.push_back(it->name);
+      msg.count.push_back(it->count);
+      msg.total_count.push_back(it->total_count);
+      msg.mean.push_back(it->mean);
+      msg.p50.push_back(it->p50);
+      msg.p99.push_back(it->p99);
+      msg.max.push_back(it->max);
+    }
 
-        tf::Transform tf_frame;
+    for(std::vector<CounterStats>::const_iterator it = counter_stats_.begin();
+        it != counter_stats_.end();
+        ++it)
+    {
+      msg.counter.push_back(it->name);
+      msg.value.push_back(it->value);
+    }
 
-        // Broadcast a tf frame for this link
-        to_tf(female_atom->link->GetWorldPose(), tf_frame);
-        br.sendTransform(
-            tf::StampedTransform(
-                tf_frame,
-                ros::Time::now(),
-                tf_world_frame_,
-                link_name));
-
-        // Broadcast all male mate points for this atom
-        for(std::vector<MatePointPtr>::iterator it_mmp = female_atom->model->male_mate_points.begin();
-            it_mmp != female_atom->model->male_mate_points.end();
-            ++it_mmp)
-        {
-          MatePointPtr male_mate_point = *it_mmp;
-
-          const std::string male_mate_point_name = boost::str(
-              boost::format("%s/male_%d")
-              % atom_name
-              % male_mate_point->id);
-
-          tf::poseKDLToTF(male_mate_point->pose,tf_frame);
-          br.sendTransform(
-              tf::StampedTransform(
-                  tf_frame,
-                  ros::Time::now(),
-                  link_name,
-                  male_mate_point_name));
-
-          visualization_msgs::Marker mate_marker;
-          mate_marker.header.frame_id = male_mate_point_name;
-          mate_marker.header.stamp = ros::Time(0);
-          mate_marker.type = mate_marker.CUBE;
-          mate_marker.action = mate_marker.ADD;
-          mate_marker.id = (atom_id * 10000) + (iter * 100) + male_mate_point->id;
-          mate_marker.scale.x = 0.02;
-          mate_marker.scale.y = 0.02;
-          mate_marker.scale.z = 0.01;
-          mate_marker.color.r = 1.0;
-          mate_marker.color.g = 0.0;
-          mate_marker.color.b = 0.0;
-          mate_marker.color.a = 0.25;
-          male_mate_markers.markers.push_back(mate_marker);
-        }
+    profile_pub_.publish(msg);
+  }
 
-        // Broadcast all female mate points for this atom
-        for(std::vector<MatePointPtr>::iterator it_fmp = female_atom->model->female_mate_points.begin();
-            it_fmp != female_atom->model->female_mate_points.end();
-            ++it_fmp)
-        {
-          MatePointPtr female_mate_point = *it_fmp;
-
-          const std::string female_mate_point_name = boost::str(
-              boost::format("%s/female_%d")
-              % atom_name
-              % female_mate_point->id);
-
-          tf::poseKDLToTF(female_mate_point->pose, tf_frame);
-          br.sendTransform(
-              tf::StampedTransform(
-                  tf_frame,
-                  ros::Time::now(),
-                  link_name,
-                  female_mate_point_name));
-
-          visualization_msgs::Marker mate_marker;
-          mate_marker.header.frame_id = female_mate_point_name;
-          mate_marker.header.stamp = ros::Time(0);
-          mate_marker.type = mate_marker.CUBE;
-          mate_marker.action = mate_marker.ADD;
-          mate_marker.id = (atom_id * 10000) + (iter * 100) + female_mate_point->id;
-          mate_marker.scale.x = 0.02;
-          mate_marker.scale.y = 0.02;
-          mate_marker.scale.z = 0.01;
-          mate_marker.color.r = 0.0;
-          mate_marker.color.g = 0.0;
-          mate_marker.color.b = 1.0;
-          mate_marker.color.a = 0.25;
-          female_mate_markers.markers.push_back(mate_marker);
-        }
+  void AssemblySoup::publishMateEvents()
+  {
+    ASSEMBLY_PROFILE("introspection/events");
+
+    std::vector<assembly_msgs::MateEvent> &events = mate_events_msg_.events;
+    events.clear();
 
+    // Collect the changes made since the last cycle
+    MateEvent event;
+    while(soup_.popMateEvent(event))
+    {
+      // Mates are added along with atoms
+      if(event.mate_id >= attached_.size()) {
+        attached_.resize(event.mate_id + 1, false);
+        attach_events_.resize(event.mate_id + 1);
       }
 
-      male_mate_pub_.publish(male_mate_markers);
-      female_mate_pub_.publish(female_mate_markers);
+      events.resize(events.size() + 1);
+      assembly_msgs::MateEvent &event_msg = events.back();
+      event_msg.mate_id = event.mate_id;
+      event_msg.female = event.female;
+      event_msg.male = event.male;
+      event_msg.stamp = ros::Time(event.time);
+      event_msg.state = event.state;
+      event_msg.cause = event.cause;
+      tf::twistKDLToMsg(event.mate_error, event_msg.mate_error);
+
+      attached_[event.mate_id] = event.state == Mate::MATED;
+      if(attached_[event.mate_id]) {
+        attach_events_[event.mate_id] = event_msg;
+      }
     }
 
-    // TODO: move this introspection out of this thread
-    if (publish_active_mates_) {
-      active_mates_pub_.publish(mates_msg);
+    mate_events_msg_.header.stamp = ros::Time::now();
+
+    if(not events.empty()) {
+      mate_events_msg_.keyframe = false;
+      mate_events_pub_.publish(mate_events_msg_);
+    }
+
+    // Periodically send the full set of mated mates
+    if(++mate_event_cycles_ < mate_event_keyframe_cycles_) {
+      return;
+    }
+    mate_event_cycles_ = 0;
+
+    events.clear();
+    for(size_t i=0; i < attached_.size(); i++) {
+      if(attached_[i]) {
+        events.push_back(attach_events_[i]);
+      }
     }
 
+    mate_events_msg_.keyframe = true;
+    mate_events_pub_.publish(mate_events_msg_);
   }
 
   AssemblySoup::~AssemblySoup() {
-    running_ = false;
+    {
+      boost::mutex::scoped_lock lock(check_mutex_);
+      running_ = false;
+    }
+    check_cond_.notify_one();
     state_update_thread_.join();
+
+    {
+      boost::mutex::scoped_lock lock(snapshot_mutex_);
+      introspecting_ = false;
+    }
+    snapshot_cond_.notify_one();
+    introspection_thread_.join();
+  }
+
+  void AssemblySoup::OnUpdateEnd()
+  {
+    // Wake up the update thread every update_steps_ iterations
+    if(++step_count_ % update_steps_ != 0) {
+      return;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(check_mutex_);
+      check_requested_ = true;
+    }
+    check_cond_.notify_one();
   }
 
   void AssemblySoup::stateUpdateLoop() {
 
-    gzwarn << "State update thread running!" << std::endl;
+    ASSEMBLY_INFO(LOG_CHECK, "State update thread running!");
+
+    if(step_triggered_) {
+      boost::mutex::scoped_lock lock(check_mutex_);
+      while(running_) {
+        // Wait to be triggered by OnUpdateEnd
+        while(running_ and not check_requested_) {
+          check_cond_.wait(lock);
+        }
+
+        if(not running_) {
+          break;
+        }
+
+        // Triggers which arrive during this check are merged into one
+        check_requested_ = false;
+        lock.unlock();
+        this->queueStateUpdates();
+        lock.lock();
+      }
+      return;
+    }
 
     gazebo::physics::WorldPtr world = this->model_->GetWorld();
     gazebo::common::Time now(0);
@@ -536,14 +1016,45 @@ namespace assembly_sim
   // This is where the logic that connects and updates joints needs to happen
   void AssemblySoup::OnUpdate(const gazebo::common::UpdateInfo & _info)
   {
+    ASSEMBLY_PROFILE("physics/tick");
+
+    // Add and remove the requested atoms, unless the soup is being checked
+    // or introspected, in which case they're tried again next tick
+    // The other threads stop taking the structure lock while requests are
+    // pending, so this gets it within a cycle.
+    boost::unique_lock<boost::shared_mutex> structure_lock(structure_mutex_, boost::defer_lock);
+    if(atom_requests_pending_ and structure_lock.try_lock()) {
+      this->applyAtomRequests(_info.simTime.Double());
+    }
+
+    // Capture the state of all atoms once for this tick and share it with
+    // the check thread
+    // If atoms were just added, nothing is reading the published states, so
+    // their states are published before they're checked
+    AtomStateVector &atom_states = atom_states_.write();
+    soup_.captureAtomStates(atom_states);
+    atom_states_.publish();
+    if(structure_lock.owns_lock()) {
+      structure_lock.unlock();
+    }
 
-    if (!running_) {
+    if(soup_.isDeterministic()) {
+      // Check the mates in this thread at fixed iteration boundaries so that
+      // the resulting constraint changes don't depend on thread timing
+      if(step_count_++ % update_steps_ == 0) {
+        this->queueStateUpdates();
+      }
+    } else if (!running_) {
       this->queueStateUpdates();
 
-      gzwarn << "Starting thread..." << std::endl;
+      ASSEMBLY_INFO(LOG_CHECK, "Starting thread...");
+      // This has to be set before the thread starts, or it will exit right away
+      {
+        boost::mutex::scoped_lock lock(check_mutex_);
+        running_ = true;
+      }
       state_update_thread_ = boost::thread(boost::bind(&AssemblySoup::stateUpdateLoop, this));
-      running_ = true;
-      gzwarn << "Started." <<std::endl;
+      ASSEMBLY_INFO(LOG_CHECK, "Started.");
     }
 
     if(last_update_time_ == gazebo::common::Time::Zero) {
@@ -551,33 +1062,149 @@ namespace assembly_sim
       return;
     }
 
-    // Try to lock mutex in order to change mate constraints
+    // Change mate constraints
+    soup_.updateConstraints(atom_states, _info.simTime.Double());
+
+    // Compute
+    gazebo::common::Time timestep = _info.simTime - last_update_time_;
+
+    // Compute the mate interactions and apply them to the atoms
+    soup_.update(timestep.Double(), atom_states);
+
+    last_update_time_ = _info.simTime;
+  }
+
+  bool AssemblySoup::registerAtom(
+      assembly_msgs::RegisterAtom::Request &req,
+      assembly_msgs::RegisterAtom::Response &res)
+  {
+    // The models don't change, but the atoms belong to the OnUpdate thread,
+    // so the request is checked against the queued requests instead
+    if(not soup_.getAtomModel(req.link)) {
+      res.success = false;
+      res.message = "No atom model for link \"" + req.link + "\"";
+      return true;
+    }
+
+    if(not this->getLink(req.link)) {
+      res.success = false;
+      res.message = "No link \"" + req.link + "\"";
+      return true;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(atom_requests_mutex_);
+      if(not registered_atoms_.insert(req.link).second) {
+        res.success = false;
+        res.message = "Atom \"" + req.link + "\" is already in the soup";
+        return true;
+      }
+
+      AtomRequest request;
+      request.link = req.link;
+      request.add = true;
+      atom_requests_.push_back(request);
+      atom_requests_pending_ = true;
+    }
+
+    res.success = true;
+    res.message = "Adding atom \"" + req.link + "\" on the next tick";
+    return true;
+  }
+
+  bool AssemblySoup::unregisterAtom(
+      assembly_msgs::UnregisterAtom::Request &req,
+      assembly_msgs::UnregisterAtom::Response &res)
+  {
     {
-      boost::mutex::scoped_lock update_lock(update_mutex_, boost::try_to_lock);
-      while(not mate_update_queue_.empty()) {
-        //gzwarn<<"updating mate "<<mate_update_queue_.front()->getDescription()<<std::endl;
-        mate_update_queue_.front()->updateConstraints();
-        mate_update_queue_.pop();
+      boost::mutex::scoped_lock lock(atom_requests_mutex_);
+      if(registered_atoms_.erase(req.link) == 0) {
+        res.success = false;
+        res.message = "Atom \"" + req.link + "\" isn't in the soup";
+        return true;
       }
+
+      AtomRequest request;
+      request.link = req.link;
+      request.add = false;
+      atom_requests_.push_back(request);
+      atom_requests_pending_ = true;
     }
 
-    // Compute
-    gazebo::common::Time timestep = _info.simTime - last_update_time_;
+    res.success = true;
+    res.message = "Removing atom \"" + req.link + "\" on the next tick";
+    return true;
+  }
+
+  gazebo::physics::LinkPtr AssemblySoup::getLink(const std::string &name)
+  {
+    const std::string::size_type scope = name.rfind("::");
+    if(scope == std::string::npos) {
+      return model_->GetLink(name);
+    }
+
+    gazebo::physics::ModelPtr model = model_->GetWorld()->GetModel(name.substr(0, scope));
+    if(not model) {
+      return gazebo::physics::LinkPtr();
+    }
+
+    return model->GetLink(name.substr(scope + 2));
+  }
+
+  void AssemblySoup::applyAtomRequests(double time)
+  {
+    ASSEMBLY_PROFILE("physics/atom_requests");
 
-    gazebo::common::Time now = gazebo::common::Time::GetWallTime();
-    for (boost::unordered_set<MatePtr>::iterator it = mates_.begin();
-         it != mates_.end();
-         ++it)
     {
-      MatePtr mate = *it;
-      mate->update(timestep);
+      boost::mutex::scoped_lock lock(atom_requests_mutex_);
+      applied_atom_requests_.swap(atom_requests_);
+      atom_requests_pending_ = false;
     }
-    static const double a = 0.95;
-    static double dt = 0;
-    dt = (1.0-a)*(gazebo::common::Time::GetWallTime() - now).Double() + (a) * dt;
-    //gzwarn<<"update: "<<dt<<std::endl;
 
-    last_update_time_ = _info.simTime;
+    // The requests are applied in the order they were made, so an atom can
+    // be removed and added again in one tick
+    for(std::vector<AtomRequest>::const_iterator it = applied_atom_requests_.begin();
+        it != applied_atom_requests_.end();
+        ++it)
+    {
+      if(it->add) {
+        // The link can have been deleted since the request was made
+        gazebo::physics::LinkPtr link = this->getLink(it->link);
+        AtomPtr atom;
+        if(not link) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Can't add atom for link \""<<it->link<<"\", it doesn't exist");
+        } else {
+          atom = soup_.addAtom(it->link);
+        }
+
+        if(atom) {
+          backend_->addLink(*atom, link);
+        } else {
+          boost::mutex::scoped_lock lock(atom_requests_mutex_);
+          registered_atoms_.erase(it->link);
+        }
+      } else {
+        AtomPtr atom = soup_.getAtom(it->link);
+        if(not atom) {
+          ASSEMBLY_WARN(LOG_LOAD, "Can't remove atom \""<<it->link<<"\", it isn't in the soup");
+          continue;
+        }
+
+        soup_.removeAtom(atom, time);
+        backend_->removeLink(*atom);
+      }
+    }
+    applied_atom_requests_.clear();
+
+    atom_states_.resize(soup_.getAtoms().size());
+
+    // The check and introspection threads are held off by the structure
+    // lock, so their buffers can grow for the new mates here
+    if(introspecting_) {
+      this->reserveIntrospection();
+    }
+
+    structure_version_++;
   }
 
   // Register this plugin with the simulator
@@ -1,7 +1,6 @@
 #ifndef __ASSEMBLY_SIM_ASSEMBLY_SOUP_PLUGIN_H
 #define __ASSEMBLY_SIM_ASSEMBLY_SOUP_PLUGIN_H
 
-#include <queue>
 
 #include <ros/ros.h>
 
@@ -15,10 +14,25 @@
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/locks.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/unordered_set.hpp>
 
 #include <kdl/frames.hpp>
 
-#include "models.h"
+#include <tf/transform_broadcaster.h>
+#include <tf2_ros/static_transform_broadcaster.h>
+#include <geometry_msgs/TransformStamped.h>
+#include <visualization_msgs/MarkerArray.h>
+#include <assembly_msgs/MateEvents.h>
+#include <assembly_msgs/MateTelemetry.h>
+#include <assembly_msgs/Profile.h>
+#include <assembly_msgs/RegisterAtom.h>
+#include <assembly_msgs/UnregisterAtom.h>
+
+#include "soup.h"
+#include "gazebo_backend.h"
+#include "atom_state.h"
 
 namespace assembly_sim {
 
@@ -37,6 +51,7 @@ namespace assembly_sim {
 
       // Pointer to the update event connection
       gazebo::event::ConnectionPtr updateConnection_;
+      gazebo::event::ConnectionPtr updateEndConnection_;
 
       ros::Publisher male_mate_pub_;
       ros::Publisher female_mate_pub_;
@@ -45,37 +60,208 @@ namespace assembly_sim {
       bool publish_active_mates_;
       ros::Publisher active_mates_pub_;
 
-      // used to synchronize main update thread with check thread
-      boost::mutex update_mutex_;
+      // for broadcasting mate state changes as they happen
+      bool publish_mate_events_;
+      ros::Publisher mate_events_pub_;
+      // number of introspection cycles between keyframes
+      int mate_event_keyframe_cycles_;
+      int mate_event_cycles_;
+      assembly_msgs::MateEvents mate_events_msg_;
+      // the event which attached each mate, by mate id, for the keyframes
+      std::vector<assembly_msgs::MateEvent> attach_events_;
+      std::vector<bool> attached_;
+      void publishMateEvents();
+
+      // for broadcasting the errors and wrenches of the checked mates
+      bool publish_telemetry_;
+      double telemetry_rate_;
+      ros::Publisher telemetry_pub_;
+      assembly_msgs::MateTelemetry telemetry_msg_;
+
+      // for broadcasting the timing of each phase
+      bool publish_profile_;
+      ros::Publisher profile_pub_;
+      // number of introspection cycles between profiles
+      int profile_cycles_;
+      int profile_cycle_count_;
+      std::vector<TimerStats> timer_stats_;
+      std::vector<CounterStats> counter_stats_;
+      void publishProfile();
 
       // update thread
       boost::thread state_update_thread_;
       void stateUpdateLoop();
       void queueStateUpdates();
-      bool running_;
+      boost::atomic<bool> running_;
 
-    protected:
-      size_t mate_id_counter_;
-      size_t atom_id_counter_;
+      // introspection thread, which publishes TF frames, markers and mate
+      // lists from snapshots taken by the update thread at its own rate
+      boost::thread introspection_thread_;
+      void introspectionLoop();
+      bool introspecting_;
+      double introspection_rate_;
 
-      double max_trans_err_;
-      double max_rot_err_;
+      // when step triggering is enabled, the update thread checks the mates
+      // once every update_steps_ physics iterations instead of polling the
+      // sim time, and waits on check_cond_ in between
+      bool step_triggered_;
+      int update_steps_;
+      boost::uint64_t step_count_;
+      bool check_requested_;
+      boost::mutex check_mutex_;
+      boost::condition_variable check_cond_;
+      void OnUpdateEnd();
 
-      std::map<std::string, MateFactoryBasePtr> mate_factories_;
-      std::map<std::string, MateModelPtr> mate_models_;
-      std::map<std::string, AtomModelPtr> atom_models_;
+      // for adding and removing atoms while the soup is running
+      // requests from the services are applied by the OnUpdate thread at the
+      // start of a tick in which the soup isn't being checked or introspected
+      struct AtomRequest
+      {
+        std::string link;
+        bool add;
+      };
+      std::vector<AtomRequest> atom_requests_;
+      std::vector<AtomRequest> applied_atom_requests_;
+      // names of the atoms which will be in the soup once the queued
+      // requests are applied, so that the services can refuse bad requests
+      boost::unordered_set<std::string> registered_atoms_;
+      boost::mutex atom_requests_mutex_;
+      // set while requests are queued, so that the check and introspection
+      // threads yield the structure lock to the OnUpdate thread
+      boost::atomic<bool> atom_requests_pending_;
+      ros::ServiceServer register_atom_server_;
+      ros::ServiceServer unregister_atom_server_;
+      bool registerAtom(
+          assembly_msgs::RegisterAtom::Request &req,
+          assembly_msgs::RegisterAtom::Response &res);
+      bool unregisterAtom(
+          assembly_msgs::UnregisterAtom::Request &req,
+          assembly_msgs::UnregisterAtom::Response &res);
+      void applyAtomRequests(double time);
+      // get a link of this model, or of another model if the name is scoped
+      gazebo::physics::LinkPtr getLink(const std::string &name);
 
-      std::vector<AtomPtr> atoms_;
+      // held shared by the update and introspection threads while they read
+      // the atoms and mates, and exclusively by the OnUpdate thread while it
+      // adds and removes atoms
+      boost::shared_mutex structure_mutex_;
+      // incremented whenever atoms are added or removed, so that the
+      // introspection thread knows to rebuild its frames and markers
+      boost::atomic<unsigned int> structure_version_;
+      unsigned int frames_version_;
 
-      // all mates
-      boost::unordered_set<MatePtr> mates_;
+    protected:
+      // the atoms and mates, simulated with the links of this model
+      // in deterministic mode, the mates are checked in the OnUpdate thread
+      // once every update_steps_ physics iterations
+      Soup soup_;
+      boost::shared_ptr<GazeboBackend> backend_;
 
-      // mates to attach/detach in OnUpdate thread
-      std::queue<MatePtr> mate_update_queue_;
+      // atom states captured each physics tick, shared with the check thread
+      AtomStateBuffer atom_states_;
 
       // for broadcasting coordinate transforms
       bool broadcast_tf_;
       std::string tf_world_frame_;
+      boost::scoped_ptr<tf::TransformBroadcaster> tf_broadcaster_;
+      boost::scoped_ptr<tf2_ros::StaticTransformBroadcaster> static_tf_broadcaster_;
+
+      // TF frame names for each atom, built at Load and again whenever
+      // atoms are added or removed
+      struct AtomFrames
+      {
+        std::string link_name;
+        // indexed like the atom model's mate points
+        std::vector<std::string> male_mate_point_names;
+        std::vector<std::string> female_mate_point_names;
+        // index of each mate point in its gender, by mate point id
+        std::vector<size_t> mate_point_indices;
+      };
+      std::vector<AtomFrames> atom_frames_;
+      void initFrames();
+
+      // transforms which are sent together in one message
+      std::vector<geometry_msgs::TransformStamped> tf_transforms_;
+      void addTransform(
+          const KDL::Frame &frame,
+          const ros::Time &stamp,
+          const std::string &parent_frame,
+          const std::string &child_frame);
+
+      // One CUBE_LIST marker with the mate points of one gender, colored by
+      // the state of their mates
+      struct MatePointMarkers
+      {
+        visualization_msgs::MarkerArray marker_array;
+        // index of the first mate point of each atom, by atom id
+        std::vector<size_t> atom_offsets;
+        // the state of each mate point this cycle and when it was last sent
+        std::vector<Mate::State> states;
+        std::vector<Mate::State> published_states;
+      };
+      MatePointMarkers male_markers_;
+      MatePointMarkers female_markers_;
+      // distance a mate point moves before its marker is sent again
+      double marker_tolerance_;
+      void initMarkers(MatePointMarkers &markers, const std::string &ns, bool male);
+      void markMatePoint(
+          MatePointMarkers &markers,
+          const AtomPtr &atom,
+          const MatePointPtr &mate_point,
+          Mate::State state);
+      void updateMarkers(
+          MatePointMarkers &markers,
+          const AtomStateVector &atom_states,
+          bool male,
+          const ros::Publisher &publisher);
+
+      // The state of the soup after a check, taken for introspection
+      struct IntrospectionSnapshot
+      {
+        struct MateState
+        {
+          MatePtr mate;
+          // the requested state if the mate has a pending update
+          Mate::State state;
+          bool pending;
+          // the joint frame and name, if the mate is attached and not
+          // pending, since its constraint can be released or handed to
+          // another mate once the snapshot is taken
+          bool attached;
+          KDL::Frame joint_frame;
+          std::string joint_name;
+          // telemetry from the last check
+          double linear_error;
+          double angular_error;
+          int symmetry;
+          double force;
+          double torque;
+        };
+
+        ros::Time stamp;
+        AtomStateVector atom_states;
+        // the mate candidates when the snapshot was taken
+        std::vector<MateState> mates;
+      };
+
+      // Triple buffer of snapshots
+      // The update thread fills the write snapshot and swaps it with the
+      // ready one, and the introspection thread swaps the ready snapshot
+      // with the read one when it's fresh, so neither waits on the other
+      IntrospectionSnapshot snapshots_[3];
+      int snapshot_write_;
+      int snapshot_ready_;
+      int snapshot_read_;
+      bool snapshot_fresh_;
+      boost::mutex snapshot_mutex_;
+      boost::condition_variable snapshot_cond_;
+      // Make room for every atom and mate in the snapshots, the telemetry
+      // and the mate events, so that the check and introspection threads
+      // don't allocate
+      void reserveIntrospection();
+      void takeSnapshot(const AtomStateVector &atom_states);
+      void publishIntrospection(const IntrospectionSnapshot &snapshot);
+      void publishTelemetry(const IntrospectionSnapshot &snapshot);
 
       clock_t last_tick_;
       int updates_per_second_;
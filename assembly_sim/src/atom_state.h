@@ -0,0 +1,107 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_ATOM_STATE_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_ATOM_STATE_H__
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+
+#include <kdl/frames.hpp>
+
+namespace assembly_sim {
+
+  // The state of an atom, captured once per physics tick
+  struct AtomState
+  {
+    // Pose of the atom link in the world frame
+    KDL::Frame pose;
+    // Velocity of the atom link origin in the world frame
+    KDL::Twist twist;
+    // Position of the atom's center of mass in the world frame
+    KDL::Vector cog;
+  };
+
+  // Atom states indexed by atom id
+  typedef std::vector<AtomState> AtomStateVector;
+
+  // Net wrench on each atom about its center of mass in the world frame,
+  // indexed by atom id
+  typedef std::vector<KDL::Wrench> AtomWrenchVector;
+
+  // Triple buffer of atom states shared between the physics thread, which
+  // writes a new snapshot every tick, and a reader on another thread, which
+  // holds the most recently published snapshot while it uses it.
+  //
+  // The writer and the reader each own one buffer, and the third one holds
+  // the latest published snapshot. Publishing and reading only swap buffer
+  // indices, so neither side ever waits for the other, and every snapshot
+  // is published.
+  class AtomStateBuffer
+  {
+  public:
+    AtomStateBuffer() :
+      back_(0),
+      middle_(1),
+      front_(2)
+    { }
+
+    // This must not be called while the buffer is being written or read
+    void resize(size_t n_atoms)
+    {
+      for(int i=0; i<3; i++) {
+        buffers_[i].resize(n_atoms);
+      }
+    }
+
+    // Get the snapshot to be filled by the writer
+    // This is never the snapshot which is held by the reader
+    AtomStateVector &write()
+    {
+      return buffers_[back_];
+    }
+
+    // Make the most recently written snapshot visible to the reader
+    void publish()
+    {
+      back_ = middle_.exchange(back_ | FRESH, boost::memory_order_acq_rel) & INDEX;
+    }
+
+    // Holds the latest published snapshot for reading while in scope
+    // There can only be one reader at a time.
+    class Reader
+    {
+    public:
+      Reader(AtomStateBuffer &buffer) :
+        states_(buffer.read())
+      { }
+
+      const AtomStateVector &states() const { return states_; }
+
+    private:
+      const AtomStateVector &states_;
+    };
+
+  private:
+    // The middle buffer index is flagged when it was published after the
+    // reader last took it
+    static const int INDEX = 0x3;
+    static const int FRESH = 0x4;
+
+    const AtomStateVector &read()
+    {
+      if(middle_.load(boost::memory_order_relaxed) & FRESH) {
+        front_ = middle_.exchange(front_, boost::memory_order_acq_rel) & INDEX;
+      }
+      return buffers_[front_];
+    }
+
+    AtomStateVector buffers_[3];
+    // owned by the writer
+    int back_;
+    boost::atomic<int> middle_;
+    // owned by the reader
+    int front_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_ATOM_STATE_H__
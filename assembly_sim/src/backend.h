@@ -0,0 +1,74 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_BACKEND_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_BACKEND_H__
+
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+
+#include <kdl/frames.hpp>
+
+#include "atom_state.h"
+
+namespace assembly_sim {
+
+  struct Atom;
+  struct Mate;
+
+  class Constraint;
+  class Backend;
+
+  typedef boost::shared_ptr<Constraint> ConstraintPtr;
+  typedef boost::shared_ptr<Backend> BackendPtr;
+
+  // A rigid constraint between the female and male atoms of a mate, e.g. a
+  // fixed joint in Gazebo
+  class Constraint
+  {
+  public:
+    virtual ~Constraint() { }
+
+    // Attach the male atom to the female atom with the constraint anchored
+    // at the given frame in the world frame. If the constraint is already
+    // attached, it's re-anchored.
+    virtual void attach(const KDL::Frame &anchor_frame) = 0;
+
+    // Detach the atoms
+    virtual void detach() = 0;
+
+    // Get the wrench which the constraint applies to its atoms, expressed
+    // like Gazebo's joint wrench for the first body
+    virtual KDL::Wrench getWrench() = 0;
+
+    // Get the position of the anchor in the world frame
+    virtual KDL::Vector getAnchor() = 0;
+
+    // Name for introspection
+    virtual const std::string &getName() const = 0;
+  };
+
+  // The physics engine which simulates the atoms. Atoms are identified by
+  // their ids, which are dense and assigned in the order they're added to
+  // the soup.
+  class Backend
+  {
+  public:
+    virtual ~Backend() { }
+
+    // Read the pose and velocity of an atom
+    virtual void getAtomState(const Atom &atom, AtomState &atom_state) = 0;
+
+    // Apply a wrench to an atom about its center of mass in the world frame
+    // This is applied on the next physics step
+    virtual void applyWrench(const Atom &atom, const KDL::Wrench &wrench) = 0;
+
+    // Create a detached constraint between the atoms of a mate
+    virtual ConstraintPtr createConstraint(const Mate &mate) = 0;
+
+    // Hand back a detached constraint which is no longer used by a mate
+    // Backends can reuse it for the next mate of the same type
+    virtual void releaseConstraint(const Mate &mate, const ConstraintPtr &constraint) = 0;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_BACKEND_H__
@@ -0,0 +1,160 @@
+#include <cmath>
+#include <algorithm>
+
+#include "dipole_kernel.h"
+#include "dipole_kernel_impl.h"
+
+namespace assembly_sim {
+
+  void DipoleBatch::clear()
+  {
+    female_atom.clear();
+    male_atom.clear();
+    female_position.clear();
+    male_position.clear();
+    female_moment.clear();
+    male_moment.clear();
+    min_distance.clear();
+  }
+
+  void DipoleBatch::add(
+      size_t female_atom_id,
+      size_t male_atom_id,
+      const KDL::Vector &female_dipole_position,
+      const KDL::Vector &male_dipole_position,
+      const KDL::Vector &female_dipole_moment,
+      const KDL::Vector &male_dipole_moment,
+      double dipole_min_distance)
+  {
+    female_atom.push_back(female_atom_id);
+    male_atom.push_back(male_atom_id);
+    female_position.push_back(female_dipole_position);
+    male_position.push_back(male_dipole_position);
+    female_moment.push_back(female_dipole_moment);
+    male_moment.push_back(male_dipole_moment);
+    min_distance.push_back(dipole_min_distance);
+  }
+
+  namespace {
+
+    typedef void (*DipoleKernel)(const DipoleArrays &batch);
+
+    struct DipoleKernelChoice
+    {
+      DipoleKernel kernel;
+      const char *name;
+    };
+
+    void computeDipoleWrenchesScalarImpl(const DipoleArrays &batch)
+    {
+      computeDipoleWrenchesImpl<ScalarPack>(batch);
+    }
+
+    // Get the widest kernel which was compiled and which this CPU supports
+    DipoleKernelChoice chooseDipoleKernel()
+    {
+      DipoleKernelChoice choice;
+      choice.kernel = &computeDipoleWrenchesScalarImpl;
+      choice.name = "scalar";
+
+#if defined(ASSEMBLY_SIM_DIPOLE_AVX) || defined(ASSEMBLY_SIM_DIPOLE_AVX512)
+      __builtin_cpu_init();
+#endif
+#if defined(ASSEMBLY_SIM_DIPOLE_AVX)
+      if(__builtin_cpu_supports("avx")) {
+        choice.kernel = &computeDipoleWrenchesAVX;
+        choice.name = "avx";
+      }
+#endif
+#if defined(ASSEMBLY_SIM_DIPOLE_AVX512)
+      if(__builtin_cpu_supports("avx512f")) {
+        choice.kernel = &computeDipoleWrenchesAVX512;
+        choice.name = "avx512";
+      }
+#endif
+
+      return choice;
+    }
+
+    const DipoleKernelChoice &getDipoleKernel()
+    {
+      static const DipoleKernelChoice choice = chooseDipoleKernel();
+      return choice;
+    }
+
+    Vector3Pointers getPointers(Vector3Array &a)
+    {
+      Vector3Pointers p = {NULL, NULL, NULL};
+      if(not a.x.empty()) {
+        p.x = &a.x[0];
+        p.y = &a.y[0];
+        p.z = &a.z[0];
+      }
+      return p;
+    }
+
+    // Size the outputs and get the arrays for the kernels, which can't
+    // touch the vectors since they can be compiled for another instruction
+    // set
+    DipoleArrays getDipoleArrays(DipoleBatch &batch)
+    {
+      const size_t n = batch.size();
+      batch.force.resize(n);
+      batch.female_torque.resize(n);
+      batch.male_torque.resize(n);
+
+      DipoleArrays arrays;
+      arrays.size = n;
+      arrays.female_position = getPointers(batch.female_position);
+      arrays.male_position = getPointers(batch.male_position);
+      arrays.female_moment = getPointers(batch.female_moment);
+      arrays.male_moment = getPointers(batch.male_moment);
+      arrays.min_distance = batch.min_distance.empty() ? NULL : &batch.min_distance[0];
+      arrays.force = getPointers(batch.force);
+      arrays.female_torque = getPointers(batch.female_torque);
+      arrays.male_torque = getPointers(batch.male_torque);
+      return arrays;
+    }
+  }
+
+  void computeDipoleWrenches(DipoleBatch &batch)
+  {
+    getDipoleKernel().kernel(getDipoleArrays(batch));
+  }
+
+  void computeDipoleWrenchesScalar(DipoleBatch &batch)
+  {
+    computeDipoleWrenchesScalarImpl(getDipoleArrays(batch));
+  }
+
+  void accumulateDipoleWrenches(
+      const DipoleBatch &batch,
+      const AtomStateVector &atom_states,
+      AtomWrenchVector &atom_wrenches)
+  {
+    for(size_t i=0; i < batch.size(); i++)
+    {
+      const KDL::Vector force = batch.force[i];
+
+      // The force on each dipole also produces a torque about the center of
+      // mass of its atom
+      const size_t female_id = batch.female_atom[i];
+      KDL::Wrench &female_wrench = atom_wrenches[female_id];
+      female_wrench.force += force;
+      female_wrench.torque += batch.female_torque[i]
+        + (batch.female_position[i] - atom_states[female_id].cog) * force;
+
+      const size_t male_id = batch.male_atom[i];
+      KDL::Wrench &male_wrench = atom_wrenches[male_id];
+      male_wrench.force -= force;
+      male_wrench.torque += batch.male_torque[i]
+        - (batch.male_position[i] - atom_states[male_id].cog) * force;
+    }
+  }
+
+  const char *getDipoleKernelName()
+  {
+    return getDipoleKernel().name;
+  }
+
+}
@@ -0,0 +1,89 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_H__
+
+#include <vector>
+
+#include <kdl/frames.hpp>
+
+#include "atom_state.h"
+
+namespace assembly_sim {
+
+  // Structure-of-arrays storage for a list of 3-vectors
+  struct Vector3Array
+  {
+    std::vector<double> x, y, z;
+
+    void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); }
+    void reserve(size_t n) { x.reserve(n); y.reserve(n); z.reserve(n); }
+    void clear() { x.clear(); y.clear(); z.clear(); }
+
+    void push_back(const KDL::Vector &v)
+    {
+      x.push_back(v.x());
+      y.push_back(v.y());
+      z.push_back(v.z());
+    }
+
+    KDL::Vector operator[](size_t i) const { return KDL::Vector(x[i], y[i], z[i]); }
+  };
+
+  // A batch of interacting magnetic dipole pairs from all mates which are
+  // close enough to attract each other this tick. Each pair is an (female,
+  // male) dipole with world-frame positions and moments. Wrenches for all
+  // pairs are computed at once by computeDipoleWrenches().
+  struct DipoleBatch
+  {
+    // Atom ids of the female and male sides of each pair
+    std::vector<size_t> female_atom;
+    std::vector<size_t> male_atom;
+
+    // Inputs: world-frame dipole positions and magnetic moments
+    Vector3Array female_position;
+    Vector3Array male_position;
+    Vector3Array female_moment;
+    Vector3Array male_moment;
+    // Inputs: minimum distance used in place of the dipole separation
+    std::vector<double> min_distance;
+
+    // Outputs: force on the female dipole (the male dipole gets the
+    // opposite force) and the torques on each dipole, all in the world frame
+    Vector3Array force;
+    Vector3Array female_torque;
+    Vector3Array male_torque;
+
+    size_t size() const { return female_atom.size(); }
+
+    void clear();
+
+    void add(
+        size_t female_atom_id,
+        size_t male_atom_id,
+        const KDL::Vector &female_dipole_position,
+        const KDL::Vector &male_dipole_position,
+        const KDL::Vector &female_dipole_moment,
+        const KDL::Vector &male_dipole_moment,
+        double dipole_min_distance);
+  };
+
+  // Compute the force and torques for every dipole pair in the batch
+  // This uses the widest SIMD instruction set which the kernel was compiled
+  // for and the CPU supports, chosen the first time it's called
+  void computeDipoleWrenches(DipoleBatch &batch);
+
+  // Same as above, but always uses the scalar implementation
+  void computeDipoleWrenchesScalar(DipoleBatch &batch);
+
+  // Add the computed wrench of every dipole pair in the batch to the net
+  // wrenches on its female and male atoms
+  void accumulateDipoleWrenches(
+      const DipoleBatch &batch,
+      const AtomStateVector &atom_states,
+      AtomWrenchVector &atom_wrenches);
+
+  // Name of the instruction set used by computeDipoleWrenches()
+  const char *getDipoleKernelName();
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_H__
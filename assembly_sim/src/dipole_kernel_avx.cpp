@@ -0,0 +1,41 @@
+#include <immintrin.h>
+
+#include "dipole_kernel_impl.h"
+
+// This is compiled with -mavx, and only called on CPUs which support it
+
+namespace assembly_sim {
+
+  namespace {
+
+    struct AVXPack
+    {
+      typedef __m256d Mask;
+      static const size_t width = 4;
+
+      __m256d v;
+
+      AVXPack() { }
+      AVXPack(__m256d p) : v(p) { }
+      AVXPack(double d) : v(_mm256_set1_pd(d)) { }
+
+      static AVXPack load(const double *p) { return _mm256_loadu_pd(p); }
+      void store(double *p) const { _mm256_storeu_pd(p, v); }
+    };
+
+    inline AVXPack operator+(AVXPack a, AVXPack b) { return _mm256_add_pd(a.v, b.v); }
+    inline AVXPack operator-(AVXPack a, AVXPack b) { return _mm256_sub_pd(a.v, b.v); }
+    inline AVXPack operator*(AVXPack a, AVXPack b) { return _mm256_mul_pd(a.v, b.v); }
+    inline AVXPack operator/(AVXPack a, AVXPack b) { return _mm256_div_pd(a.v, b.v); }
+    inline AVXPack psqrt(AVXPack a) { return _mm256_sqrt_pd(a.v); }
+    inline AVXPack pmax(AVXPack a, AVXPack b) { return _mm256_max_pd(a.v, b.v); }
+    inline __m256d pgreater(AVXPack a, AVXPack b) { return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ); }
+    inline AVXPack pselect(__m256d m, AVXPack a, AVXPack b) { return _mm256_blendv_pd(b.v, a.v, m); }
+  }
+
+  void computeDipoleWrenchesAVX(const DipoleArrays &batch)
+  {
+    computeDipoleWrenchesImpl<AVXPack>(batch);
+  }
+
+}
@@ -0,0 +1,41 @@
+#include <immintrin.h>
+
+#include "dipole_kernel_impl.h"
+
+// This is compiled with -mavx512f, and only called on CPUs which support it
+
+namespace assembly_sim {
+
+  namespace {
+
+    struct AVX512Pack
+    {
+      typedef __mmask8 Mask;
+      static const size_t width = 8;
+
+      __m512d v;
+
+      AVX512Pack() { }
+      AVX512Pack(__m512d p) : v(p) { }
+      AVX512Pack(double d) : v(_mm512_set1_pd(d)) { }
+
+      static AVX512Pack load(const double *p) { return _mm512_loadu_pd(p); }
+      void store(double *p) const { _mm512_storeu_pd(p, v); }
+    };
+
+    inline AVX512Pack operator+(AVX512Pack a, AVX512Pack b) { return _mm512_add_pd(a.v, b.v); }
+    inline AVX512Pack operator-(AVX512Pack a, AVX512Pack b) { return _mm512_sub_pd(a.v, b.v); }
+    inline AVX512Pack operator*(AVX512Pack a, AVX512Pack b) { return _mm512_mul_pd(a.v, b.v); }
+    inline AVX512Pack operator/(AVX512Pack a, AVX512Pack b) { return _mm512_div_pd(a.v, b.v); }
+    inline AVX512Pack psqrt(AVX512Pack a) { return _mm512_sqrt_pd(a.v); }
+    inline AVX512Pack pmax(AVX512Pack a, AVX512Pack b) { return _mm512_max_pd(a.v, b.v); }
+    inline __mmask8 pgreater(AVX512Pack a, AVX512Pack b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ); }
+    inline AVX512Pack pselect(__mmask8 m, AVX512Pack a, AVX512Pack b) { return _mm512_mask_blend_pd(m, b.v, a.v); }
+  }
+
+  void computeDipoleWrenchesAVX512(const DipoleArrays &batch)
+  {
+    computeDipoleWrenchesImpl<AVX512Pack>(batch);
+  }
+
+}
@@ -0,0 +1,202 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_IMPL_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_IMPL_H__
+
+// The dipole kernel, written against packs of doubles so that it can be
+// compiled once for each instruction set. Only the dipole kernel sources
+// include this.
+//
+// The sources for wider instruction sets are compiled with flags for them.
+// Any inline function or template which they share with the rest of the
+// build could have its copy from one of them kept by the linker, and then
+// run on a CPU which doesn't support it. So everything here has internal
+// linkage, and the kernels only see the batch through raw pointers, without
+// including any C++ library or KDL headers.
+
+#include <stddef.h>
+#include <math.h>
+
+namespace assembly_sim {
+
+  // Raw pointers to the x, y and z arrays of a Vector3Array
+  struct Vector3Pointers
+  {
+    double *x, *y, *z;
+  };
+
+  // Raw pointers to the arrays of a DipoleBatch, which are filled in by the
+  // dispatcher so that the kernels don't touch the std::vectors
+  struct DipoleArrays
+  {
+    size_t size;
+
+    Vector3Pointers female_position;
+    Vector3Pointers male_position;
+    Vector3Pointers female_moment;
+    Vector3Pointers male_moment;
+    const double *min_distance;
+
+    Vector3Pointers force;
+    Vector3Pointers female_torque;
+    Vector3Pointers male_torque;
+  };
+
+  namespace {
+
+    // Packs of doubles that the dipole kernel is written against. Each pack
+    // type evaluates the kernel for `width` dipole pairs at once.
+
+    struct ScalarPack
+    {
+      typedef bool Mask;
+      static const size_t width = 1;
+
+      double v;
+
+      ScalarPack() { }
+      ScalarPack(double d) : v(d) { }
+
+      static ScalarPack load(const double *p) { return ScalarPack(*p); }
+      void store(double *p) const { *p = v; }
+    };
+
+    inline ScalarPack operator+(ScalarPack a, ScalarPack b) { return a.v + b.v; }
+    inline ScalarPack operator-(ScalarPack a, ScalarPack b) { return a.v - b.v; }
+    inline ScalarPack operator*(ScalarPack a, ScalarPack b) { return a.v * b.v; }
+    inline ScalarPack operator/(ScalarPack a, ScalarPack b) { return a.v / b.v; }
+    inline ScalarPack psqrt(ScalarPack a) { return sqrt(a.v); }
+    // Same as std::max, which isn't used since its instantiations could come
+    // from a kernel compiled for another instruction set
+    inline ScalarPack pmax(ScalarPack a, ScalarPack b) { return (a.v < b.v) ? b : a; }
+    inline bool pgreater(ScalarPack a, ScalarPack b) { return a.v > b.v; }
+    inline ScalarPack pselect(bool m, ScalarPack a, ScalarPack b) { return m ? a : b; }
+
+    // A 3-vector of packs
+    template <class Pack>
+      struct PackVector
+      {
+        Pack x, y, z;
+
+        PackVector() { }
+        PackVector(Pack x_, Pack y_, Pack z_) : x(x_), y(y_), z(z_) { }
+
+        static PackVector load(const Vector3Pointers &a, size_t i)
+        {
+          return PackVector(Pack::load(a.x + i), Pack::load(a.y + i), Pack::load(a.z + i));
+        }
+
+        void store(const Vector3Pointers &a, size_t i) const
+        {
+          x.store(a.x + i);
+          y.store(a.y + i);
+          z.store(a.z + i);
+        }
+      };
+
+    template <class Pack>
+      inline PackVector<Pack> operator+(const PackVector<Pack> &a, const PackVector<Pack> &b)
+      {
+        return PackVector<Pack>(a.x + b.x, a.y + b.y, a.z + b.z);
+      }
+
+    template <class Pack>
+      inline PackVector<Pack> operator-(const PackVector<Pack> &a, const PackVector<Pack> &b)
+      {
+        return PackVector<Pack>(a.x - b.x, a.y - b.y, a.z - b.z);
+      }
+
+    template <class Pack>
+      inline PackVector<Pack> operator*(const Pack &s, const PackVector<Pack> &a)
+      {
+        return PackVector<Pack>(s * a.x, s * a.y, s * a.z);
+      }
+
+    template <class Pack>
+      inline Pack dot(const PackVector<Pack> &a, const PackVector<Pack> &b)
+      {
+        return a.x*b.x + a.y*b.y + a.z*b.z;
+      }
+
+    template <class Pack>
+      inline PackVector<Pack> cross(const PackVector<Pack> &a, const PackVector<Pack> &b)
+      {
+        return PackVector<Pack>(
+            a.y*b.z - a.z*b.y,
+            a.z*b.x - a.x*b.z,
+            a.x*b.y - a.y*b.x);
+      }
+
+    // Magnetic permeability of free space over 4 pi
+    const double MU0_4PI = 1E-7;
+
+    // Compute the wrenches for the dipole pairs starting at index i
+    template <class Pack>
+      inline void computeDipoleWrench(const DipoleArrays &batch, size_t i)
+      {
+        typedef PackVector<Pack> V;
+
+        const V female_position = V::load(batch.female_position, i);
+        const V male_position = V::load(batch.male_position, i);
+
+        // Displacement from the female to the male dipole
+        const V r = male_position - female_position;
+        const Pack rn = pmax(Pack::load(batch.min_distance + i), psqrt(dot(r, r)));
+        const Pack rn_inv = Pack(1.0) / rn;
+
+        // Direction from the female to the male dipole
+        const typename Pack::Mask valid = pgreater(rn, Pack(1E-5));
+        const V rh(
+            pselect(valid, r.x * rn_inv, Pack(1.0)),
+            pselect(valid, r.y * rn_inv, Pack(0.0)),
+            pselect(valid, r.z * rn_inv, Pack(0.0)));
+
+        // Magnetic moments
+        const V m1 = V::load(batch.female_moment, i);
+        const V m2 = V::load(batch.male_moment, i);
+
+        // Field of each dipole at the other dipole
+        const Pack b_scale = Pack(3.0 * MU0_4PI) * rn_inv * rn_inv * rn_inv;
+        const V B1 = b_scale * (dot(m1, rh) * rh - m1);
+        const V B2 = b_scale * (dot(m2, rh) * rh - m2);
+
+        // Force on the female dipole
+        const V rh_m2 = cross(rh, m2);
+        const V rh_m1 = cross(rh, m1);
+        const Pack f_scale = Pack(-3.0 * MU0_4PI) * rn_inv * rn_inv * rn_inv * rn_inv;
+        const V force = f_scale * (
+            cross(rh_m2, m1)
+            + cross(rh_m1, m2)
+            - (Pack(2.0) * dot(m1, m2)) * rh
+            + (Pack(5.0) * dot(rh_m2, rh_m1)) * rh);
+
+        force.store(batch.force, i);
+        cross(m1, B2).store(batch.female_torque, i);
+        cross(m2, B1).store(batch.male_torque, i);
+      }
+
+    // Compute the wrenches for all dipole pairs in the batch
+    template <class Pack>
+      void computeDipoleWrenchesImpl(const DipoleArrays &batch)
+      {
+        const size_t n = batch.size;
+
+        size_t i = 0;
+        for(; i + Pack::width <= n; i += Pack::width) {
+          computeDipoleWrench<Pack>(batch, i);
+        }
+
+        // Finish the pairs which don't fill a whole pack
+        for(; i < n; i++) {
+          computeDipoleWrench<ScalarPack>(batch, i);
+        }
+      }
+  }
+
+
+  // Kernels for wider instruction sets, which are only compiled when the
+  // compiler supports them, and only called when the CPU does
+  void computeDipoleWrenchesAVX(const DipoleArrays &batch);
+  void computeDipoleWrenchesAVX512(const DipoleArrays &batch);
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_DIPOLE_KERNEL_IMPL_H__
@@ -0,0 +1,190 @@
+#include <boost/make_shared.hpp>
+#include <boost/format.hpp>
+
+#include "gazebo_backend.h"
+#include "gazebo_util.h"
+
+namespace assembly_sim {
+
+  GazeboJointConstraint::GazeboJointConstraint(gazebo::physics::JointPtr joint) :
+    joint_(joint),
+    attached_(false)
+  {
+  }
+
+  void GazeboJointConstraint::load(
+      const Mate &mate,
+      gazebo::physics::LinkPtr parent,
+      gazebo::physics::LinkPtr child)
+  {
+    parent_ = parent;
+    child_ = child;
+    name_ = boost::str( boost::format("%s_m%0d_to_%s_m%0d")
+        % mate.female->name
+        % mate.female_mate_point->id
+        % mate.male->name
+        % mate.male_mate_point->id);
+
+    // Customize the joint sdf template
+    sdf::ElementPtr joint_sdf = boost::make_shared<sdf::Element>();
+    joint_sdf->Copy(mate.model->joint_template);
+    joint_sdf->GetAttribute("name")->Set(name_);
+    // The links can belong to other models which were added to the soup
+    joint_sdf->GetElement("parent")->GetValue()->Set(parent_->GetScopedName());
+    joint_sdf->GetElement("child")->GetValue()->Set(child_->GetScopedName());
+
+    // The joint is anchored at the male mate point
+    gazebo::math::Pose pose;
+    to_gazebo(mate.male_mate_point->pose, pose);
+    joint_sdf->GetElement("pose")->GetValue()->Set(pose);
+
+    //gzwarn<<"joint sdf:\n\n"<<joint_sdf->ToString(">>")<<std::endl;
+
+    // Load joint description from SDF
+    //  - sets parend a child links
+    //  - sets the anchor pose
+    //  - loads sensor elements
+    joint_->Load(joint_sdf);
+
+    // Initialize joint
+    //  - sets axis orientation
+    //  - sets axis limits
+    //  - attaches parent and child via this joint
+    joint_->Init();
+
+    // Don't attach the links until the mate is attached
+    // A pooled joint which is loaded again keeps its old links until then,
+    // since attach() always attaches it to parent_ and child_ explicitly.
+    joint_->Detach();
+    attached_ = false;
+  }
+
+  void GazeboJointConstraint::attach(const KDL::Frame &anchor_frame)
+  {
+    // detach the links if they're already attached (they're going to be re-attached)
+    if(attached_) {
+      joint_->Detach();
+    }
+
+    joint_->Attach(parent_, child_);
+    attached_ = true;
+
+    // Set the anchor position (location of the joint)
+    gazebo::math::Vector3 anchor;
+    to_gazebo(anchor_frame.p, anchor);
+    joint_->SetAnchor(0, anchor);
+  }
+
+  void GazeboJointConstraint::detach()
+  {
+    joint_->Detach();
+    attached_ = false;
+
+    // Don't hold on to the links while the joint is pooled, since their
+    // atoms can be removed
+    parent_.reset();
+    child_.reset();
+  }
+
+  KDL::Wrench GazeboJointConstraint::getWrench()
+  {
+    gazebo::physics::JointWrench joint_wrench = joint_->GetForceTorque(0);
+
+    KDL::Wrench wrench;
+    to_kdl(joint_wrench.body1Force, wrench.force);
+    to_kdl(joint_wrench.body1Torque, wrench.torque);
+
+    return wrench;
+  }
+
+  KDL::Vector GazeboJointConstraint::getAnchor()
+  {
+    KDL::Vector anchor;
+    to_kdl(joint_->GetAnchor(0), anchor);
+
+    return anchor;
+  }
+
+  GazeboBackend::GazeboBackend(gazebo::physics::ModelPtr model) :
+    model_(model)
+  {
+  }
+
+  void GazeboBackend::addLink(const Atom &atom, gazebo::physics::LinkPtr link)
+  {
+    if(atom.id >= links_.size()) {
+      links_.resize(atom.id + 1);
+    }
+
+    links_[atom.id] = link;
+  }
+
+  void GazeboBackend::removeLink(const Atom &atom)
+  {
+    if(atom.id < links_.size()) {
+      links_[atom.id].reset();
+    }
+  }
+
+  void GazeboBackend::getAtomState(const Atom &atom, AtomState &atom_state)
+  {
+    const gazebo::physics::LinkPtr &link = links_[atom.id];
+
+    to_kdl(link->GetWorldPose(), atom_state.pose);
+    to_kdl(link->GetWorldLinearVel(), atom_state.twist.vel);
+    to_kdl(link->GetWorldAngularVel(), atom_state.twist.rot);
+    to_kdl(link->GetWorldCoGPose().pos, atom_state.cog);
+  }
+
+  void GazeboBackend::applyWrench(const Atom &atom, const KDL::Wrench &wrench)
+  {
+    gazebo::math::Vector3 force, torque;
+    to_gazebo(wrench, force, torque);
+
+    // Forces are applied at the center of mass
+    links_[atom.id]->AddForce(force);
+    links_[atom.id]->AddTorque(torque);
+  }
+
+  ConstraintPtr GazeboBackend::createConstraint(const Mate &mate)
+  {
+    std::vector<GazeboJointConstraintPtr> &joint_pool = joint_pools_[mate.model->type];
+    GazeboJointConstraintPtr constraint;
+
+    if(joint_pool.empty()) {
+      ASSEMBLY_INFO_THROTTLE(1.0, LOG_PHYSICS, "Creating joint for mate type: "
+        <<mate.model->type<<" ("
+        <<mate.female->name<<"#"
+        <<mate.female_mate_point->id
+        <<") -> ("
+        <<mate.male->name<<"#"
+        <<mate.male_mate_point->id<<")");
+
+      // Get the joint type
+      std::string joint_type;
+      mate.model->joint_template->GetAttribute("type")->Get(joint_type);
+
+      // Construct the actual joint between these two atom links
+      gazebo::physics::JointPtr joint = model_->GetWorld()->GetPhysicsEngine()->CreateJoint(joint_type, model_);
+      joint->SetModel(model_);
+
+      constraint = boost::make_shared<GazeboJointConstraint>(joint);
+    } else {
+      // Reuse a joint released by another mate of this type
+      constraint = joint_pool.back();
+      joint_pool.pop_back();
+    }
+
+    constraint->load(mate, links_[mate.female->id], links_[mate.male->id]);
+
+    return constraint;
+  }
+
+  void GazeboBackend::releaseConstraint(const Mate &mate, const ConstraintPtr &constraint)
+  {
+    // Only this backend creates these constraints
+    joint_pools_[mate.model->type].push_back(
+        boost::static_pointer_cast<GazeboJointConstraint>(constraint));
+  }
+
+}
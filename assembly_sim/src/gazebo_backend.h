@@ -0,0 +1,78 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_BACKEND_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_BACKEND_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gazebo/gazebo.hh>
+#include <gazebo/physics/physics.hh>
+
+#include "backend.h"
+#include "models.h"
+
+namespace assembly_sim {
+
+  // A Gazebo joint between the links of a mate's atoms
+  class GazeboJointConstraint : public Constraint
+  {
+  public:
+    GazeboJointConstraint(gazebo::physics::JointPtr joint);
+
+    // Load the joint from the mate model's joint template for a mate
+    // between the given links
+    void load(
+        const Mate &mate,
+        gazebo::physics::LinkPtr parent,
+        gazebo::physics::LinkPtr child);
+
+    virtual void attach(const KDL::Frame &anchor_frame);
+    virtual void detach();
+    virtual KDL::Wrench getWrench();
+    virtual KDL::Vector getAnchor();
+    virtual const std::string &getName() const { return name_; }
+
+  private:
+    gazebo::physics::JointPtr joint_;
+    gazebo::physics::LinkPtr parent_;
+    gazebo::physics::LinkPtr child_;
+    std::string name_;
+    bool attached_;
+  };
+
+  typedef boost::shared_ptr<GazeboJointConstraint> GazeboJointConstraintPtr;
+
+  // Simulates each atom with a link of a Gazebo model, and each attached
+  // mate with a joint between the links
+  class GazeboBackend : public Backend
+  {
+  public:
+    GazeboBackend(gazebo::physics::ModelPtr model);
+
+    // Simulate an atom with a link
+    // The link can belong to another model, as long as the atom is removed
+    // before the link is deleted.
+    void addLink(const Atom &atom, gazebo::physics::LinkPtr link);
+
+    // Stop simulating an atom which has been removed from the soup
+    void removeLink(const Atom &atom);
+
+    virtual void getAtomState(const Atom &atom, AtomState &atom_state);
+    virtual void applyWrench(const Atom &atom, const KDL::Wrench &wrench);
+    virtual ConstraintPtr createConstraint(const Mate &mate);
+    virtual void releaseConstraint(const Mate &mate, const ConstraintPtr &constraint);
+
+  private:
+    gazebo::physics::ModelPtr model_;
+
+    // links indexed by atom id
+    std::vector<gazebo::physics::LinkPtr> links_;
+
+    // detached joints which can be reused by any mate of the same type,
+    // keyed by mate type
+    std::map<std::string, std::vector<GazeboJointConstraintPtr> > joint_pools_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_BACKEND_H__
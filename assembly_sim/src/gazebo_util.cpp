@@ -0,0 +1,50 @@
+#include "gazebo_util.h"
+
+namespace assembly_sim {
+
+  void to_kdl(const gazebo::math::Pose &pose, KDL::Frame &frame)
+  {
+    frame = KDL::Frame(
+        KDL::Rotation::Quaternion(pose.rot.x, pose.rot.y, pose.rot.z, pose.rot.w),
+        KDL::Vector(pose.pos.x, pose.pos.y, pose.pos.z));
+  }
+
+  void to_kdl(const gazebo::math::Vector3 &vector3, KDL::Vector &vector)
+  {
+    vector.data[0] = vector3.x;
+    vector.data[1] = vector3.y;
+    vector.data[2] = vector3.z;
+  }
+
+  void to_tf(const gazebo::math::Pose &pose, tf::Transform &frame)
+  {
+    frame.setRotation( tf::Quaternion(
+            pose.rot.x,
+            pose.rot.y,
+            pose.rot.z,
+            pose.rot.w));
+    frame.setOrigin( tf::Vector3(pose.pos.x, pose.pos.y, pose.pos.z) );
+  }
+
+  void to_gazebo(const KDL::Frame &frame, gazebo::math::Pose &pose)
+  {
+    pose = gazebo::math::Pose(
+        gazebo::math::Vector3(frame.p.data[0], frame.p.data[1], frame.p.data[2]),
+        gazebo::math::Quaternion());
+    frame.M.GetQuaternion(pose.rot.x, pose.rot.y, pose.rot.z, pose.rot.w);
+  }
+
+  void to_gazebo(const KDL::Vector &vector, gazebo::math::Vector3 &vector3)
+  {
+    vector3.x = vector.x();
+    vector3.y = vector.y();
+    vector3.z = vector.z();
+  }
+
+  void to_gazebo(const KDL::Wrench &wrench, gazebo::math::Vector3 &force, gazebo::math::Vector3 &torque)
+  {
+    to_gazebo(wrench.force, force);
+    to_gazebo(wrench.torque, torque);
+  }
+
+}
@@ -0,0 +1,29 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_UTIL_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_UTIL_H__
+
+#include <gazebo/gazebo.hh>
+#include <gazebo/physics/physics.hh>
+#include <gazebo/common/common.hh>
+
+// tf headers
+#include <tf/transform_broadcaster.h>
+#include <tf_conversions/tf_kdl.h>
+
+#include "util.h"
+
+namespace assembly_sim {
+  // Convert between gazebo and KDL / TF geometric types
+  void to_kdl(const gazebo::math::Pose &pose, KDL::Frame &frame);
+
+  void to_kdl(const gazebo::math::Vector3 &vector3, KDL::Vector &vector);
+
+  void to_tf(const gazebo::math::Pose &pose, tf::Transform &frame);
+
+  void to_gazebo(const KDL::Frame &frame, gazebo::math::Pose &pose);
+
+  void to_gazebo(const KDL::Vector &vector, gazebo::math::Vector3 &vector3);
+
+  void to_gazebo(const KDL::Wrench &wrench, gazebo::math::Vector3 &force, gazebo::math::Vector3 &torque);
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_GAZEBO_UTIL_H__
@@ -0,0 +1,236 @@
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include "log.h"
+
+namespace assembly_sim {
+
+  // Number of records which can be waiting to be written
+  static const size_t LOG_QUEUE_CAPACITY = 4096;
+
+  double get_log_time()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+  }
+
+  static bool parse_level(const std::string &name, LogLevel &level)
+  {
+    for(int i=LOG_LEVEL_DEBUG; i <= LOG_LEVEL_OFF; i++) {
+      if(boost::iequals(name, Logger::getLevelName(static_cast<LogLevel>(i)))) {
+        level = static_cast<LogLevel>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  Logger &Logger::instance()
+  {
+    static Logger logger;
+    return logger;
+  }
+
+  Logger::Logger() :
+    start_time_(get_log_time()),
+    queue_(LOG_QUEUE_CAPACITY),
+    dropped_(0),
+    running_(true)
+  {
+    this->setLevel(LOG_LEVEL_INFO);
+    writer_thread_ = boost::thread(boost::bind(&Logger::writerLoop, this));
+  }
+
+  Logger::~Logger()
+  {
+    running_ = false;
+    writer_thread_.join();
+    this->flush();
+  }
+
+  void Logger::configure(sdf::ElementPtr sdf)
+  {
+    if(sdf->HasElement("level")) {
+      std::string level_name;
+      LogLevel level;
+      sdf->GetElement("level")->GetValue()->Get(level_name);
+      if(parse_level(level_name, level)) {
+        this->setLevel(level);
+      } else {
+        ASSEMBLY_ERROR(LOG_LOAD, "Unknown log level \""<<level_name<<"\"");
+      }
+    }
+
+    if(sdf->HasElement("category")) {
+      sdf::ElementPtr category_elem = sdf->GetElement("category");
+      while(category_elem && category_elem->GetName() == "category")
+      {
+        std::string category_name, level_name;
+        category_elem->GetAttribute("name")->Get(category_name);
+        category_elem->GetValue()->Get(level_name);
+
+        int category = 0;
+        while(category < N_LOG_CATEGORIES and
+              not boost::iequals(category_name, getCategoryName(static_cast<LogCategory>(category))))
+        {
+          category++;
+        }
+
+        LogLevel level;
+        if(category == N_LOG_CATEGORIES) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Unknown log category \""<<category_name<<"\"");
+        } else if(not parse_level(level_name, level)) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Unknown log level \""<<level_name<<"\"");
+        } else {
+          this->setLevel(static_cast<LogCategory>(category), level);
+        }
+
+        category_elem = category_elem->GetNextElement(category_elem->GetName());
+      }
+    }
+  }
+
+  void Logger::setLevel(LogCategory category, LogLevel level)
+  {
+    levels_[category].store(level, boost::memory_order_relaxed);
+  }
+
+  void Logger::setLevel(LogLevel level)
+  {
+    for(int i=0; i < N_LOG_CATEGORIES; i++) {
+      this->setLevel(static_cast<LogCategory>(i), level);
+    }
+  }
+
+  void Logger::push(const LogRecord &record)
+  {
+    if(not queue_.bounded_push(record)) {
+      dropped_.fetch_add(1, boost::memory_order_relaxed);
+    }
+  }
+
+  void Logger::flush()
+  {
+    boost::mutex::scoped_lock lock(write_mutex_);
+
+    LogRecord record;
+    while(queue_.pop(record)) {
+      this->write(record);
+    }
+
+    size_t dropped = dropped_.exchange(0, boost::memory_order_relaxed);
+    if(dropped > 0) {
+      fprintf(stderr, "[ WARN] [log] %lu log messages were dropped\n", (unsigned long)dropped);
+    }
+
+    fflush(stderr);
+  }
+
+  void Logger::writerLoop()
+  {
+    while(running_) {
+      this->flush();
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+  }
+
+  void Logger::write(const LogRecord &record)
+  {
+    fprintf(stderr, "[%5s] [%s] [%.3f] %s\n",
+            getLevelName(record.level),
+            getCategoryName(record.category),
+            record.time - start_time_,
+            record.text);
+  }
+
+  const char *Logger::getLevelName(LogLevel level)
+  {
+    switch(level) {
+      case LOG_LEVEL_DEBUG: return "debug";
+      case LOG_LEVEL_INFO: return "info";
+      case LOG_LEVEL_WARN: return "warn";
+      case LOG_LEVEL_ERROR: return "error";
+      case LOG_LEVEL_OFF: return "off";
+    };
+    return "";
+  }
+
+  const char *Logger::getCategoryName(LogCategory category)
+  {
+    switch(category) {
+      case LOG_LOAD: return "load";
+      case LOG_MATE: return "mate";
+      case LOG_CHECK: return "check";
+      case LOG_PHYSICS: return "physics";
+      case LOG_INTROSPECTION: return "introspection";
+      case N_LOG_CATEGORIES: break;
+    };
+    return "";
+  }
+
+  LogThrottle::LogThrottle(double period) :
+    period_(period),
+    next_time_(0.0),
+    suppressed_(0)
+  {
+  }
+
+  bool LogThrottle::pass(size_t &suppressed)
+  {
+    const double now = get_log_time();
+    double next_time = next_time_.load(boost::memory_order_relaxed);
+
+    // Only one thread gets to write each period
+    if(now < next_time or
+       not next_time_.compare_exchange_strong(next_time, now + period_, boost::memory_order_relaxed))
+    {
+      suppressed_.fetch_add(1, boost::memory_order_relaxed);
+      return false;
+    }
+
+    suppressed = suppressed_.exchange(0, boost::memory_order_relaxed);
+    return true;
+  }
+
+  LogMessage::Stream &LogMessage::getThreadStream()
+  {
+    static boost::thread_specific_ptr<Stream> streams;
+
+    Stream *stream = streams.get();
+    if(not stream) {
+      stream = new Stream();
+      streams.reset(stream);
+    }
+
+    return *stream;
+  }
+
+  LogMessage::LogMessage(LogLevel level, LogCategory category) :
+    stream_(getThreadStream())
+  {
+    record_.level = level;
+    record_.category = category;
+    record_.time = get_log_time();
+
+    // Start from the default format, since the last message may have
+    // changed it
+    stream_.buffer.reset(record_.text, LogRecord::MAX_TEXT);
+    std::ostream &stream = stream_.stream;
+    stream.clear();
+    stream.flags(std::ios_base::dec | std::ios_base::skipws);
+    stream.precision(6);
+    stream.width(0);
+    stream.fill(' ');
+  }
+
+  LogMessage::~LogMessage()
+  {
+    record_.text[stream_.buffer.size()] = '\0';
+    Logger::instance().push(record_);
+  }
+
+}
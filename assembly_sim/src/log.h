@@ -0,0 +1,203 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_LOG_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_LOG_H__
+
+#include <ostream>
+#include <streambuf>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/lockfree/queue.hpp>
+
+#include <sdf/sdf.hh>
+
+namespace assembly_sim {
+
+  enum LogLevel {
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_INFO = 1,
+    LOG_LEVEL_WARN = 2,
+    LOG_LEVEL_ERROR = 3,
+    LOG_LEVEL_OFF = 4
+  };
+
+  enum LogCategory {
+    LOG_LOAD = 0, // loading models and creating atoms and mates
+    LOG_MATE, // mate state changes
+    LOG_CHECK, // the mate check pipeline
+    LOG_PHYSICS, // the physics backend
+    LOG_INTROSPECTION, // ROS / TF introspection
+    N_LOG_CATEGORIES
+  };
+
+  // A log message, copied through the log queue by value
+  struct LogRecord
+  {
+    static const size_t MAX_TEXT = 240;
+
+    LogLevel level;
+    LogCategory category;
+    // Seconds since the logger was created
+    double time;
+    char text[MAX_TEXT];
+  };
+
+  // Asynchronous logger
+  //
+  // Messages are formatted into fixed-size records on the calling thread and
+  // pushed onto a lock-free queue, and a writer thread prints them to
+  // stderr. Each thread formats with a stream which is made for its first
+  // message and reused after that, so after that message nothing on the
+  // calling thread blocks or allocates. If the queue is full, messages are
+  // dropped and counted instead.
+  //
+  // Use the ASSEMBLY_* macros below instead of calling this directly.
+  class Logger
+  {
+  public:
+    static Logger &instance();
+
+    ~Logger();
+
+    // Set the runtime filters from a <logging> element:
+    //   <logging>
+    //     <level>info</level>
+    //     <category name="mate">debug</category>
+    //   </logging>
+    // Levels are debug, info, warn, error or off. Messages below the
+    // compile-time ASSEMBLY_SIM_LOG_LEVEL are removed regardless.
+    void configure(sdf::ElementPtr sdf);
+
+    // Set the minimum level for one or all categories
+    void setLevel(LogCategory category, LogLevel level);
+    void setLevel(LogLevel level);
+
+    bool isEnabled(LogLevel level, LogCategory category) const
+    {
+      return level >= levels_[category].load(boost::memory_order_relaxed);
+    }
+
+    // Queue a record to be written
+    void push(const LogRecord &record);
+
+    // Write all queued records on the calling thread
+    void flush();
+
+    static const char *getLevelName(LogLevel level);
+    static const char *getCategoryName(LogCategory category);
+
+  private:
+    Logger();
+
+    void writerLoop();
+    void write(const LogRecord &record);
+
+    double start_time_;
+    boost::atomic<int> levels_[N_LOG_CATEGORIES];
+
+    boost::lockfree::queue<LogRecord, boost::lockfree::fixed_sized<true> > queue_;
+    boost::atomic<size_t> dropped_;
+
+    boost::mutex write_mutex_;
+    boost::thread writer_thread_;
+    boost::atomic<bool> running_;
+  };
+
+  // Limits a log statement to one message per period, counting the messages
+  // which were suppressed in between
+  class LogThrottle
+  {
+  public:
+    LogThrottle(double period);
+
+    // Returns true if a message should be written now, along with the
+    // number of messages suppressed since the last one
+    bool pass(size_t &suppressed);
+
+  private:
+    double period_;
+    boost::atomic<double> next_time_;
+    boost::atomic<size_t> suppressed_;
+  };
+
+  // Formats one log record and queues it when it goes out of scope
+  class LogMessage
+  {
+  public:
+    LogMessage(LogLevel level, LogCategory category);
+    ~LogMessage();
+
+    std::ostream &stream() { return stream_.stream; }
+
+  private:
+    // Writes into the record text, truncating what doesn't fit
+    class Buffer : public std::streambuf
+    {
+    public:
+      void reset(char *begin, size_t size) { setp(begin, begin + size - 1); }
+      size_t size() const { return pptr() - pbase(); }
+    };
+
+    // The stream of one thread, which is pointed at each of its records
+    // Building a std::ostream copies a locale, so it isn't done per message.
+    struct Stream
+    {
+      Stream() : stream(&buffer) { }
+
+      Buffer buffer;
+      std::ostream stream;
+    };
+
+    static Stream &getThreadStream();
+
+    LogRecord record_;
+    Stream &stream_;
+  };
+
+  // Seconds on a monotonic clock
+  double get_log_time();
+}
+
+// Messages below this level are compiled out
+#ifndef ASSEMBLY_SIM_LOG_LEVEL
+#define ASSEMBLY_SIM_LOG_LEVEL 1
+#endif
+
+#define ASSEMBLY_LOG(level, category, message) \
+  do { \
+    if((level) >= ASSEMBLY_SIM_LOG_LEVEL and \
+       ::assembly_sim::Logger::instance().isEnabled(level, category)) \
+    { \
+      ::assembly_sim::LogMessage assembly_log_message_(level, category); \
+      assembly_log_message_.stream() << message; \
+    } \
+  } while(0)
+
+// Write at most one message per period (in seconds) from this statement
+#define ASSEMBLY_LOG_THROTTLE(period, level, category, message) \
+  do { \
+    if((level) >= ASSEMBLY_SIM_LOG_LEVEL and \
+       ::assembly_sim::Logger::instance().isEnabled(level, category)) \
+    { \
+      static ::assembly_sim::LogThrottle assembly_log_throttle_(period); \
+      size_t assembly_log_suppressed_; \
+      if(assembly_log_throttle_.pass(assembly_log_suppressed_)) { \
+        ::assembly_sim::LogMessage assembly_log_message_(level, category); \
+        assembly_log_message_.stream() << message; \
+        if(assembly_log_suppressed_ > 0) { \
+          assembly_log_message_.stream() << " (" << assembly_log_suppressed_ << " more since last)"; \
+        } \
+      } \
+    } \
+  } while(0)
+
+#define ASSEMBLY_DEBUG(category, message) ASSEMBLY_LOG(::assembly_sim::LOG_LEVEL_DEBUG, category, message)
+#define ASSEMBLY_INFO(category, message) ASSEMBLY_LOG(::assembly_sim::LOG_LEVEL_INFO, category, message)
+#define ASSEMBLY_WARN(category, message) ASSEMBLY_LOG(::assembly_sim::LOG_LEVEL_WARN, category, message)
+#define ASSEMBLY_ERROR(category, message) ASSEMBLY_LOG(::assembly_sim::LOG_LEVEL_ERROR, category, message)
+
+#define ASSEMBLY_INFO_THROTTLE(period, category, message) ASSEMBLY_LOG_THROTTLE(period, ::assembly_sim::LOG_LEVEL_INFO, category, message)
+#define ASSEMBLY_WARN_THROTTLE(period, category, message) ASSEMBLY_LOG_THROTTLE(period, ::assembly_sim::LOG_LEVEL_WARN, category, message)
+#define ASSEMBLY_ERROR_THROTTLE(period, category, message) ASSEMBLY_LOG_THROTTLE(period, ::assembly_sim::LOG_LEVEL_ERROR, category, message)
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_LOG_H__
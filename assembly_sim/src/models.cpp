@@ -4,81 +4,68 @@
 
 namespace assembly_sim {
   Mate::Mate(
-      MateModelPtr mate_model,
-      gazebo::physics::ModelPtr gazebo_model_,
+      MateModel *mate_model,
       MatePointPtr female_mate_point_,
       MatePointPtr male_mate_point_,
       AtomPtr female_atom,
       AtomPtr male_atom) :
     model(mate_model),
+    id(0),
     state(Mate::UNMATED),
     pending_state(Mate::NONE),
     female(female_atom),
     male(male_atom),
     female_mate_point(female_mate_point_),
     male_mate_point(male_mate_point_),
-    joint_sdf(),
-    joint(),
-    gazebo_model(gazebo_model_),
-    anchor_offset(KDL::Frame::Identity())
+    anchor_offset(KDL::Frame::Identity()),
+    update_cause(Mate::PROXIMITY),
+    update_error(KDL::Twist::Zero()),
+    checked_error(KDL::Twist::Zero()),
+    checked_symmetry(-1),
+    checked_wrench(KDL::Wrench::Zero()),
+    constraint()
   {
     // Make sure male and female mate points have the same model
     assert(female_mate_point->model == male_mate_point->model);
+  }
 
-    gzwarn<<"Creating joint for mate type: "
-      <<female_mate_point->model->type<<" ("
-      <<female_atom->link->GetName()<<"#"
-      <<female_mate_point->id
-      <<") -> ("
-      <<male_atom->link->GetName()<<"#"
-      <<male_mate_point->id<<")"
-      <<std::endl;
-
-    description = boost::str(boost::format("%s#%d -> %s#%d")% female_atom->link->GetName()% female_mate_point->id% male_atom->link->GetName()% male_mate_point->id);
-
-    // Get the joint type
-    std::string joint_type;
-    model->joint_template->GetAttribute("type")->Get(joint_type);
-
-    // Customize the joint sdf template
-    joint_sdf = boost::make_shared<sdf::Element>();
-    joint_sdf->Copy(model->joint_template);
-    joint_sdf->GetAttribute("name")->Set(
-        boost::str( boost::format("%s_m%0d_to_%s_m%0d")
-             % female_atom->link->GetName()
-             % female_mate_point->id
-             % male_atom->link->GetName()
-             % male_mate_point->id));
-    joint_sdf->GetElement("parent")->GetValue()->Set(female_atom->link->GetName());
-    joint_sdf->GetElement("child")->GetValue()->Set(male_atom->link->GetName());
-
-    gazebo::math::Pose pose;
-    to_gazebo(male_mate_point->pose, pose);
-    joint_sdf->GetElement("pose")->GetValue()->Set(pose);
+  std::string Mate::getDescription() const
+  {
+    return boost::str(boost::format("%s#%d -> %s#%d")% female->name% female_mate_point->id% male->name% male_mate_point->id);
+  }
 
-    //gzwarn<<"joint sdf:\n\n"<<joint_sdf->ToString(">>")<<std::endl;
+  void Mate::reset()
+  {
+    this->releaseConstraint();
+    this->serviceUpdate();
 
-    // Construct the actual joint between these two atom links
-    joint = gazebo_model->GetWorld()->GetPhysicsEngine()->CreateJoint(joint_type, gazebo_model);
-    joint->SetModel(gazebo_model);
+    state = Mate::UNMATED;
+    anchor_offset = KDL::Frame::Identity();
+    checked_error = KDL::Twist::Zero();
+    checked_symmetry = -1;
+    checked_wrench = KDL::Wrench::Zero();
+  }
 
-    // Load joint description from SDF
-    //  - sets parend a child links
-    //  - sets the anchor pose
-    //  - loads sensor elements
-    joint->Load(joint_sdf);
+  void Mate::acquireConstraint()
+  {
+    if(constraint) {
+      return;
+    }
 
-    // Initialize joint
-    //  - sets axis orientation
-    //  - sets axis limits
-    //  - attaches parent and child via this joint
-    joint->Init();
+    constraint = model->backend->createConstraint(*this);
+  }
 
-    // Joints should initially be detached
-    joint->Detach();
+  void Mate::releaseConstraint()
+  {
+    if(not constraint) {
+      return;
+    }
 
-    // Get the stop stiffness
-    max_erp = joint->GetAttribute("erp",0);
-    max_stop_erp = joint->GetAttribute("stop_erp",0);
+    // Detach the constraint and hand it back to the backend for reuse
+    constraint->detach();
+    model->backend->releaseConstraint(*this, constraint);
+    constraint.reset();
   }
+
+  const double DipoleParams::DEFAULT_INTERACTION_RADIUS = 0.03;
 }
@@ -1,7 +1,18 @@
 #ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_MODELS_H__
 #define __LCSR_ASSEMBLY_ASSEMBLY_SIM_MODELS_H__
 
+#include <limits>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
 #include "util.h"
+#include "log.h"
+#include "profiler.h"
+#include "arena.h"
+#include "backend.h"
+#include "atom_state.h"
+#include "dipole_kernel.h"
 
 namespace assembly_sim {
 
@@ -14,22 +25,43 @@ namespace assembly_sim {
   struct MatePoint;
   struct Atom;
 
+  struct MateParams;
+
   typedef boost::shared_ptr<MateModel> MateModelPtr;
+  typedef boost::shared_ptr<const MateParams> MateParamsPtr;
   typedef boost::shared_ptr<AtomModel> AtomModelPtr;
 
-  typedef boost::shared_ptr<Mate> MatePtr;
-  typedef boost::shared_ptr<MatePoint> MatePointPtr;
   typedef boost::shared_ptr<MateFactoryBase> MateFactoryBasePtr;
-  typedef boost::shared_ptr<Atom> AtomPtr;
+
+  // Atoms, mate points and mates are owned by the arenas of the soup and its
+  // mate factories, and only referred to by these
+  typedef Mate *MatePtr;
+  typedef MatePoint *MatePointPtr;
+  typedef Atom *AtomPtr;
+
+  // The parameters shared by all mates of a mate model
+  // These are parsed once by the model's mate factory, and never change.
+  struct MateParams
+  {
+    virtual ~MateParams() { }
+
+    // Whether the mates can be simulated with these parameters
+    virtual bool isValid() const { return true; }
+  };
 
   // The model for a type of mate
   struct MateModel
   {
     MateModel(
         std::string type_,
-        sdf::ElementPtr mate_elem_) :
+        sdf::ElementPtr mate_elem_,
+        BackendPtr backend_) :
       type(type_),
-      mate_elem(mate_elem_)
+      id(0),
+      mate_elem(mate_elem_),
+      backend(backend_),
+      check_timer(Profiler::instance().getTimer("check/mates/" + type_)),
+      update_timer(Profiler::instance().getTimer("physics/update/mates/" + type_))
     {
       // Get the mate template joint
       joint_template_sdf = boost::make_shared<sdf::SDF>();
@@ -77,38 +109,75 @@ namespace assembly_sim {
 
     std::string type;
 
+    // Index of this model in the soup
+    size_t id;
+
     // Transforms from the base mate frame to alternative frames
     std::vector<KDL::Frame> symmetries;
 
     // The mate sdf parameters
     sdf::ElementPtr mate_elem;
 
+    // The parsed parameters for the type of mate created for this model
+    MateParamsPtr params;
+
+    // The backend which creates the constraints for these mates
+    BackendPtr backend;
+
     // The sdf template for the joint to be created
     boost::shared_ptr<sdf::SDF> joint_template_sdf;
     sdf::ElementPtr joint_template;
+
+    // Timers for checking and updating each mate of this type
+    size_t check_timer;
+    size_t update_timer;
   };
 
   struct MateFactoryBase
   {
+    virtual ~MateFactoryBase() { }
+
+    // Size of the mates created by this factory
+    virtual size_t getMateSize() const = 0;
+
     virtual MatePtr createMate(
         MatePointPtr female_mate_point,
         MatePointPtr male_mate_point,
         AtomPtr female_atom,
         AtomPtr male_atom) = 0;
+
+    // Create many mates from multiple threads
+    // Room for n mates is made with reserveMates(n), each one is created
+    // with createMateAt() with a different index in [0, n), and they're all
+    // added with commitMates(n).
+    virtual void reserveMates(size_t n) = 0;
+    virtual MatePtr createMateAt(
+        size_t index,
+        MatePointPtr female_mate_point,
+        MatePointPtr male_mate_point,
+        AtomPtr female_atom,
+        AtomPtr male_atom) = 0;
+    virtual void commitMates(size_t n) = 0;
   };
 
   template <class MateType>
     struct MateFactory : public MateFactoryBase
   {
-    MateFactory(
-        MateModelPtr mate_model_,
-        gazebo::physics::ModelPtr gazebo_model_) :
-      mate_model(mate_model_),
-      gazebo_model(gazebo_model_)
-    {}
+    MateFactory(MateModelPtr mate_model_) :
+      mate_model(mate_model_)
+    {
+      mate_model->params = boost::make_shared<typename MateType::Params>(mate_model->mate_elem);
+    }
 
     MateModelPtr mate_model;
-    gazebo::physics::ModelPtr gazebo_model;
+
+    // All mates created by this factory
+    Arena<MateType> mates;
+
+    virtual size_t getMateSize() const
+    {
+      return sizeof(MateType);
+    }
 
     virtual MatePtr createMate(
         MatePointPtr female_mate_point,
@@ -116,14 +185,39 @@ namespace assembly_sim {
         AtomPtr female_atom,
         AtomPtr male_atom)
     {
-      return boost::make_shared<MateType>(
-          mate_model,
-          gazebo_model,
+      new (mates.reserve()) MateType(
+          mate_model.get(),
+          female_mate_point,
+          male_mate_point,
+          female_atom,
+          male_atom);
+      return mates.commit();
+    }
+
+    virtual void reserveMates(size_t n)
+    {
+      mates.grow(n);
+    }
+
+    virtual MatePtr createMateAt(
+        size_t index,
+        MatePointPtr female_mate_point,
+        MatePointPtr male_mate_point,
+        AtomPtr female_atom,
+        AtomPtr male_atom)
+    {
+      return new (mates.getStorage(mates.size() + index)) MateType(
+          mate_model.get(),
           female_mate_point,
           male_mate_point,
           female_atom,
           male_atom);
     }
+
+    virtual void commitMates(size_t n)
+    {
+      mates.commit(n);
+    }
   };
 
   // This is a male or female point at which a given mate is located
@@ -131,8 +225,8 @@ namespace assembly_sim {
   {
     // The mate model used by this mate point
     MateModelPtr model;
-    // Mate point index
-    size_t id;
+    // Mate point index within the atom model
+    boost::uint32_t id;
     // The pose of the mate point in the owner frame
     KDL::Frame pose;
   };
@@ -144,12 +238,20 @@ namespace assembly_sim {
       NONE = 0, // No state / undefined
       UNMATED = 1, // There is no interaction between this mate's atoms
       MATING = 2, // This mate's atoms are connected by the transitional mechanism
-      MATED = 3 // This mate's atoms are connected by a static joint
+      MATED = 3 // This mate's atoms are connected by a static constraint
+    };
+
+    // Reasons for a change in attachment state
+    enum Cause {
+      PROXIMITY = 0, // The mate points came within the attach threshold
+      SEPARATION = 1, // The mate points moved beyond the detach threshold
+      FORCE_LIMIT = 2, // The constraint wrench exceeded its limit
+      REMATE = 3, // The mate was reattached closer to its mate points
+      REMOVAL = 4 // One of the mate's atoms was removed from the soup
     };
 
     Mate(
-      MateModelPtr mate_model,
-      gazebo::physics::ModelPtr gazebo_model_,
+      MateModel *mate_model,
       MatePointPtr female_mate_point_,
       MatePointPtr male_mate_point_,
       AtomPtr female_atom,
@@ -157,38 +259,65 @@ namespace assembly_sim {
 
     // Determine if the mate's attachment state needs to be updated
     // Asynchronous with Gazebo's update loop
-    virtual void queueUpdate() = 0;
+    virtual void queueUpdate(const AtomStateVector &atom_states) = 0;
 
     // Update the constraint connectivity
-    virtual void updateConstraints() = 0;
+    virtual void updateConstraints(const AtomStateVector &atom_states) = 0;
 
     // Update calculations needed to be done every tick
-    virtual void update(gazebo::common::Time timestep) = 0;
+    // Magnetic interactions are added to the dipole batch, which is
+    // evaluated for all mates at once after every mate has been updated
+    virtual void update(
+        double timestep,
+        const AtomStateVector &atom_states,
+        DipoleBatch &dipole_batch) = 0;
+
+    // Distance between the mate points within which queueUpdate() can
+    // request this mate to be attached
+    virtual double getAttachRadius() const = 0;
+
+    // Distance between the mate points beyond which update() has no effect
+    // The soup skips calling update() for mates which are mated or farther
+    // apart than this, and never calls it if this is zero.
+    virtual double getInteractionRadius() const { return 0.0; }
+
+    // Detach the mate and forget its attachment state, e.g. when one of its
+    // atoms is removed from the soup
+    // This cancels any pending update, so it can't be called while the
+    // check thread is running.
+    virtual void reset();
+
+    // Get a detached constraint for this mate from the backend
+    void acquireConstraint();
+
+    // Detach the constraint and hand it back to the backend
+    void releaseConstraint();
 
     // Update functions
-    void requestUpdate(State new_pending_state) { pending_state = new_pending_state; }
-    bool needsUpdate() const { return pending_state != NONE; }
-    void serviceUpdate() { pending_state = NONE; }
-    State getUpdate() { return pending_state; }
+    // An update is requested by the check thread and serviced by the
+    // Gazebo update thread. While an update is pending, only the Gazebo
+    // update thread may change the mate's attachment state or constraint.
+    void requestUpdate(State new_pending_state) { pending_state.store(new_pending_state, boost::memory_order_release); }
+    bool needsUpdate() const { return pending_state.load(boost::memory_order_acquire) != NONE; }
+    void serviceUpdate() { pending_state.store(NONE, boost::memory_order_release); }
+    State getUpdate() { return pending_state.load(boost::memory_order_acquire); }
 
     // Introspection
-    std::string description;
-    std::string getDescription() {
-      return description;
-    }
+    // This is only built when it's needed, since mates are numerous
+    std::string getDescription() const;
+
+    // The members used every time a mate is checked or updated come first
 
     // Mate model (same as mate points)
-    MateModelPtr model;
+    MateModel *model;
 
-    // Attachment states
-    Mate::State state, pending_state;
+    // Mate index
+    // This is stable across runs with the same world
+    boost::uint32_t id;
 
-    // Joint SDF
-    sdf::ElementPtr joint_sdf;
-    // Joint associated with mate
-    // If this is NULL then the mate is unoccupied
-    gazebo::physics::JointPtr joint;
-    gazebo::physics::ModelPtr gazebo_model;
+    // Attachment states
+    Mate::State state;
+    boost::atomic<Mate::State> pending_state;
 
     // Atoms associated with this mate
     AtomPtr female;
@@ -198,14 +327,27 @@ namespace assembly_sim {
     MatePointPtr female_mate_point;
     MatePointPtr male_mate_point;
 
-    // Max erp
-    double max_stop_erp;
-    double max_erp;
-
     // The pose of the joint anchor point relative to the mate point.
     // This gets set each time two atoms are mated, and enables joints
     // to be consistently strong.
     KDL::Frame anchor_offset;
+
+    // Why the pending update was requested, and the mate error at the time
+    // These are written by the check thread before the update is requested
+    Mate::Cause update_cause;
+    KDL::Twist update_error;
+
+    // Telemetry from the last check, written by the check thread
+    // The error is for the mated symmetry, or the nearest one if the mate
+    // isn't mated, and the wrench is only sampled while mated.
+    KDL::Twist checked_error;
+    int checked_symmetry;
+    KDL::Wrench checked_wrench;
+
+    // Constraint associated with mate
+    // If this is NULL then the mate is unoccupied
+    // Constraints are only held while the mate is attached
+    ConstraintPtr constraint;
   };
 
   // The model for a type of atom
@@ -223,52 +365,43 @@ namespace assembly_sim {
     sdf::ElementPtr link_template;
   };
 
+  // Order mates by index
+  inline bool mateIdLess(const MatePtr &a, const MatePtr &b)
+  {
+    return a->id < b->id;
+  }
+
   // An instantiated atom
   struct Atom
   {
+    // Atom index
+    boost::uint32_t id;
+
     // The model used by this atom
     AtomModelPtr model;
 
-    // The link on the assembly model
-    gazebo::physics::LinkPtr link;
+    // The name of the body simulated by the backend
+    std::string name;
+
+    // Whether the atom is in the soup
+    // Removed atoms keep their ids, and their slots are reused by the next
+    // atoms of the same model.
+    bool active;
   };
 
-  // A mate
-  struct ProximityMateBase : public Mate
+  // Parameters of proximity mates
+  struct ProximityParams : public MateParams
   {
-    // Threshold for attaching a mate
-    double attach_threshold_linear;
-    double attach_threshold_angular;
-
-    // Threshold for detaching a mate
-    double detach_threshold_linear;
-    double detach_threshold_angular;
-
-    std::vector<KDL::Frame>::iterator mated_symmetry;
-    KDL::Twist mate_error;
-
-    Eigen::Vector3d max_force, max_torque;
-
-    ProximityMateBase(
-        MateModelPtr mate_model,
-        gazebo::physics::ModelPtr gazebo_model,
-        MatePointPtr female_mate_point_,
-        MatePointPtr male_mate_point_,
-        AtomPtr female_atom,
-        AtomPtr male_atom) :
-      Mate(mate_model, gazebo_model, female_mate_point_, male_mate_point_, female_atom, male_atom),
-      mated_symmetry(mate_model->symmetries.end()),
+    ProximityParams(sdf::ElementPtr mate_elem) :
+      attach_threshold_linear(0.0),
+      attach_threshold_angular(0.0),
+      detach_threshold_linear(0.0),
+      detach_threshold_angular(0.0),
       max_force(Eigen::Vector3d::Zero()),
-      max_torque(Eigen::Vector3d::Zero())
-    {
-      this->load_proximity_params();
-    }
-
-  protected:
-    virtual void load_proximity_params()
+      max_torque(Eigen::Vector3d::Zero()),
+      limit_force(false),
+      limit_torque(false)
     {
-      sdf::ElementPtr mate_elem = model->mate_elem;
-
       // Get the attach/detach thresholds
       sdf::ElementPtr attach_threshold_elem = mate_elem->GetElement("attach_threshold");
       if(attach_threshold_elem and attach_threshold_elem->HasElement("linear") and attach_threshold_elem->HasElement("angular"))
@@ -276,9 +409,9 @@ namespace assembly_sim {
         attach_threshold_elem->GetElement("linear")->GetValue()->Get(attach_threshold_linear);
         attach_threshold_elem->GetElement("angular")->GetValue()->Get(attach_threshold_angular);
 
-        gzwarn<<(boost::format("Attach threshold linear: %f angular %f") % attach_threshold_linear % attach_threshold_angular)<<std::endl;
+        ASSEMBLY_DEBUG(LOG_LOAD, boost::format("Attach threshold linear: %f angular %f") % attach_threshold_linear % attach_threshold_angular);
       } else {
-        gzerr<<"No attach_threshold / linear / angular elements!"<<std::endl;
+        ASSEMBLY_ERROR(LOG_LOAD, "No attach_threshold / linear / angular elements!");
       }
 
       sdf::ElementPtr detach_threshold_elem = mate_elem->GetElement("detach_threshold");
@@ -287,65 +420,96 @@ namespace assembly_sim {
         detach_threshold_elem->GetElement("linear")->GetValue()->Get(detach_threshold_linear);
         detach_threshold_elem->GetElement("angular")->GetValue()->Get(detach_threshold_angular);
 
-        gzwarn<<(boost::format("Detach threshold linear: %f angular %f") % attach_threshold_linear % attach_threshold_angular)<<std::endl;
+        ASSEMBLY_DEBUG(LOG_LOAD, boost::format("Detach threshold linear: %f angular %f") % detach_threshold_linear % detach_threshold_angular);
       } else {
-        gzerr<<"No detach_threshold / linear / angular elements!"<<std::endl;
+        ASSEMBLY_ERROR(LOG_LOAD, "No detach_threshold / linear / angular elements!");
       }
 
-      gazebo::math::Vector3 gz_max_force, gz_max_torque;
+      sdf::Vector3 sdf_max_force, sdf_max_torque;
       sdf::ElementPtr max_force_elem = mate_elem->GetElement("max_force");
       if(max_force_elem) {
-        max_force_elem->GetValue()->Get(gz_max_force);
-        to_eigen(gz_max_force, max_force);
+        max_force_elem->GetValue()->Get(sdf_max_force);
+        to_eigen(sdf_max_force, max_force);
       }
       sdf::ElementPtr max_torque_elem = mate_elem->GetElement("max_torque");
       if(max_torque_elem) {
-        max_torque_elem->GetValue()->Get(gz_max_torque);
-        to_eigen(gz_max_torque, max_torque);
+        max_torque_elem->GetValue()->Get(sdf_max_torque);
+        to_eigen(sdf_max_torque, max_torque);
       }
+
+      // Only positive limits are enforced
+      limit_force = (max_force.array() > 0.0).any();
+      limit_torque = (max_torque.array() > 0.0).any();
     }
 
-    virtual void attach()
+    // Threshold for attaching a mate
+    double attach_threshold_linear;
+    double attach_threshold_angular;
+
+    // Threshold for detaching a mate
+    double detach_threshold_linear;
+    double detach_threshold_angular;
+
+    Eigen::Vector3d max_force, max_torque;
+    bool limit_force, limit_torque;
+  };
+
+  // A mate
+  struct ProximityMateBase : public Mate
+  {
+    typedef ProximityParams Params;
+
+    std::vector<KDL::Frame>::iterator mated_symmetry;
+    KDL::Twist mate_error;
+
+    ProximityMateBase(
+        MateModel *mate_model,
+        MatePointPtr female_mate_point_,
+        MatePointPtr male_mate_point_,
+        AtomPtr female_atom,
+        AtomPtr male_atom) :
+      Mate(mate_model, female_mate_point_, male_mate_point_, female_atom, male_atom),
+      mated_symmetry(mate_model->symmetries.end())
+    {
+    }
+
+    const ProximityParams &getProximityParams() const
+    {
+      return static_cast<const ProximityParams&>(*model->params);
+    }
+
+    virtual double getAttachRadius() const
+    {
+      return this->getProximityParams().attach_threshold_linear;
+    }
+
+    virtual void reset()
+    {
+      Mate::reset();
+      this->mated_symmetry = model->symmetries.end();
+      this->mate_error = KDL::Twist::Zero();
+    }
+
+  protected:
+    virtual void attach(const AtomStateVector &atom_states)
     {
       // Get the male atom frame
-      KDL::Frame male_atom_frame;
-      to_kdl(this->male->link->GetWorldPose(), male_atom_frame);
-
-      // detach the atoms if they're already attached (they're going to be re-attached)
-      this->detach();
-
-      // attach two atoms via joint
-      this->joint->Attach(this->female->link, this->male->link);
-
-      // set stiffness based on proximity to goal
-      double lin_err = this->mate_error.vel.Norm();
-      double ang_err = this->mate_error.rot.Norm();
-      double max_lin_err = detach_threshold_linear;
-      double max_ang_err = detach_threshold_angular;
-      //this->joint->SetAttribute(
-      //"stop_erp", 0,
-      //this->max_stop_erp *
-      //std::min(std::max(0.0, max_lin_err - lin_err), max_lin_err) / max_lin_err *
-      //std::min(std::max(0.0, max_ang_err - ang_err), max_ang_err) / max_ang_err);
-      //this->joint->SetAttribute(
-      //"erp", 0,
-      //this->max_erp *
-      //std::min(std::max(0.0, max_lin_err - lin_err), max_lin_err) / max_lin_err *
-      //std::min(std::max(0.0, max_ang_err - ang_err), max_ang_err) / max_ang_err);
-
-      //this->joint->SetHighStop(0, lin_err);
-
-      // get the location of the joint in the child (male atom) frame, as specified by the SDF
+      const KDL::Frame &male_atom_frame = atom_states[this->male->id].pose;
+
+      // get a constraint unless the atoms are already attached (they're
+      // going to be re-attached)
+      this->acquireConstraint();
+
+      // get the location of the joint in the child (male atom) frame
+      // constraints are always anchored at the male mate point
       KDL::Frame initial_anchor_frame, actual_anchor_frame;
-      to_kdl(this->joint->GetInitialAnchorPose(), initial_anchor_frame);
+      initial_anchor_frame = this->male_mate_point->pose;
       actual_anchor_frame = male_atom_frame*initial_anchor_frame;
 
-      // Set the anchor position (location of the joint)
+      // attach two atoms via the constraint at the anchor position
       // This is in the WORLD frame
       // IMPORTANT: This avoids injecting energy into the system in the form of a constraint violation
-      gazebo::math::Pose actual_anchor_pose;
-      to_gazebo(actual_anchor_frame, actual_anchor_pose);
-      this->joint->SetAnchor(0, actual_anchor_pose.pos);
+      this->constraint->attach(actual_anchor_frame);
 
       // Save the anchor offset (mate point to anchor)
       this->anchor_offset = (
@@ -356,46 +520,37 @@ namespace assembly_sim {
 
       //gzwarn<<" ---- initial anchor pose: "<<std::endl<<initial_anchor_frame<<std::endl;
       //gzwarn<<" ---- actual anchor pose: "<<std::endl<<actual_anchor_frame<<std::endl;
-      gzwarn<<">> mate error: "<<this->mate_error.vel.Norm()<<", "<<this->mate_error.rot.Norm()<<std::endl;
+      ASSEMBLY_DEBUG(LOG_MATE, ">> mate error: "<<this->mate_error.vel.Norm()<<", "<<this->mate_error.rot.Norm());
     }
 
     virtual void detach()
     {
-      // Simply detach joint
-      joint->Detach();
+      // Detach constraint and give it back to the backend
+      this->releaseConstraint();
     }
   };
 
   struct ProximityMate : public ProximityMateBase
   {
     ProximityMate(
-        MateModelPtr mate_model,
-        gazebo::physics::ModelPtr gazebo_model,
+        MateModel *mate_model,
         MatePointPtr female_mate_point_,
         MatePointPtr male_mate_point_,
         AtomPtr female_atom,
         AtomPtr male_atom) :
-      ProximityMateBase(mate_model, gazebo_model, female_mate_point_, male_mate_point_, female_atom, male_atom)
+      ProximityMateBase(mate_model, female_mate_point_, male_mate_point_, female_atom, male_atom)
     {
     }
 
-    virtual void queueUpdate()
+    virtual void queueUpdate(const AtomStateVector &atom_states)
     {
-      // Convenient references
-      AtomPtr &female_atom = female;
-      AtomPtr &male_atom = male;
-
-      // Only analyze mates with associated joints
-      if(!joint) {
-        gzwarn<<"No joint for mate from "<<female_atom->link->GetName()<<" -> "<<male_atom->link->GetName()<<std::endl;
-        return;
-      }
+      const ProximityParams &params = this->getProximityParams();
+      const KDL::Frame &female_atom_frame = atom_states[female->id].pose;
+      const KDL::Frame &male_atom_frame = atom_states[male->id].pose;
 
-      KDL::Frame female_atom_frame;
-      to_kdl(female_atom->link->GetWorldPose(), female_atom_frame);
-
-      KDL::Frame male_atom_frame;
-      to_kdl(male_atom->link->GetWorldPose(), male_atom_frame);
+      this->checked_symmetry = -1;
+      this->checked_wrench = KDL::Wrench::Zero();
+      double nearest_error = std::numeric_limits<double>::infinity();
 
       // Iterate over all symmetric mating positions
       for(std::vector<KDL::Frame>::iterator it_sym = model->symmetries.begin();
@@ -413,24 +568,41 @@ namespace assembly_sim {
         // compute twist between the two mate points
         KDL::Twist twist_err = diff(female_mate_frame, male_mate_frame);
         //gzwarn<<female_mate_point->pose.M<<std::endl;
-        //gzwarn<<twist_err.vel.Norm()<<", "<<twist_err.rot.Norm()<<" VS "<<this->mate_error.vel.Norm()<<", "<<this->mate_error.rot.Norm()<<std::endl;
+
+        // Record the error of the symmetry which is (or would be) mated
+        const int symmetry = it_sym - model->symmetries.begin();
+        if(state == Mate::MATED ?
+           it_sym == mated_symmetry :
+           twist_err.vel.Norm() < nearest_error)
+        {
+          nearest_error = twist_err.vel.Norm();
+          this->checked_error = twist_err;
+          this->checked_symmetry = symmetry;
+        }
 
         if(state == Mate::MATED and it_sym == mated_symmetry)
         {
-          gazebo::physics::JointWrench joint_wrench = joint->GetForceTorque(0);
-          Eigen::Vector3d force, torque;
-          to_eigen(joint_wrench.body1Force, force);
-          to_eigen(joint_wrench.body1Torque, torque);
+          Eigen::Vector3d force(Eigen::Vector3d::Zero()), torque(Eigen::Vector3d::Zero());
+          if(constraint) {
+            this->checked_wrench = constraint->getWrench();
+            to_eigen(this->checked_wrench.force, force);
+            to_eigen(this->checked_wrench.torque, torque);
+          }
 
-          //gzwarn<<">>> "<<this->getDescription()<<" Force: "<<force<<" Torque: "<<torque<<std::endl;
           // Determine if active mate needs to be detached
-          if(twist_err.vel.Norm() > detach_threshold_linear or
-             twist_err.rot.Norm() > detach_threshold_angular or
-             ((max_force.array() > 0.0).any() and (force.array().abs() > max_force.array()).any()) or
-             ((max_torque.array() > 0.0).any() and (torque.array().abs() > max_torque.array()).any()))
+          const bool separated =
+            twist_err.vel.Norm() > params.detach_threshold_linear or
+            twist_err.rot.Norm() > params.detach_threshold_angular;
+          const bool overloaded =
+            (params.limit_force and (force.array().abs() > params.max_force.array()).any()) or
+            (params.limit_torque and (torque.array().abs() > params.max_torque.array()).any());
+
+          if(separated or overloaded)
           {
             // The mate points are beyond the detach threhold and should be demated
-            gzwarn<<"> Request unmate "<<getDescription()<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Request unmate "<<getDescription());
+            this->update_cause = separated ? Mate::SEPARATION : Mate::FORCE_LIMIT;
+            this->update_error = twist_err;
             this->requestUpdate(Mate::UNMATED);
             break;
           } else if(
@@ -438,20 +610,24 @@ namespace assembly_sim {
               twist_err.rot.Norm() / mate_error.rot.Norm() < 0.8)
           {
             // Re-mate but closer to the desired point
-            gzwarn<<"> Request remate "<<getDescription()<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Request remate "<<getDescription());
             this->mate_error = twist_err;
+            this->update_cause = Mate::REMATE;
+            this->update_error = twist_err;
             this->requestUpdate(Mate::MATED);
             break;
           }
         } else {
           // Determine if mated atoms need to be attached
-          if(twist_err.vel.Norm() < attach_threshold_linear and
-             twist_err.rot.Norm() < attach_threshold_angular)
+          if(twist_err.vel.Norm() < params.attach_threshold_linear and
+             twist_err.rot.Norm() < params.attach_threshold_angular)
           {
             // The mate points are within the attach threshold and should be mated
-            gzwarn<<"> Request mate "<<getDescription()<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Request mate "<<getDescription());
             this->mated_symmetry = it_sym;
             this->mate_error = twist_err;
+            this->update_cause = Mate::PROXIMITY;
+            this->update_error = twist_err;
             this->requestUpdate(Mate::MATED);
             break;
           }
@@ -459,10 +635,10 @@ namespace assembly_sim {
       }
     }
 
-    virtual void updateConstraints()
+    virtual void updateConstraints(const AtomStateVector &atom_states)
     {
       if(not this->needsUpdate()) {
-        this->queueUpdate();
+        this->queueUpdate(atom_states);
       }
 
       if(not this->needsUpdate()) {
@@ -475,7 +651,7 @@ namespace assembly_sim {
 
         case Mate::UNMATED:
           if(state == Mate::MATED) {
-            gzwarn<<"> Detaching "<<female->link->GetName()<<" from "<<male->link->GetName()<<"!"<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Detaching "<<female->name<<" from "<<male->name<<"!");
             this->detach();
             this->state = Mate::UNMATED;
             this->mated_symmetry = model->symmetries.end();
@@ -483,16 +659,16 @@ namespace assembly_sim {
           break;
 
         case Mate::MATING:
-          gzwarn<<"ProximityMate does not support Mate::MATING"<<std::endl;
+          ASSEMBLY_WARN_THROTTLE(1.0, LOG_MATE, "ProximityMate does not support Mate::MATING");
           break;
 
         case Mate::MATED:
           if(state != Mate::MATED) {
-            gzwarn<<"> Attaching "<<female->link->GetName()<<" to "<<male->link->GetName()<<"!"<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Attaching "<<female->name<<" to "<<male->name<<"!");
           } else {
-            gzwarn<<"> Reattaching "<<female->link->GetName()<<" to "<<male->link->GetName()<<"!"<<std::endl;
+            ASSEMBLY_INFO_THROTTLE(1.0, LOG_MATE, "> Reattaching "<<female->name<<" to "<<male->name<<"!");
           }
-          this->attach();
+          this->attach(atom_states);
           this->state = Mate::MATED;
           break;
       };
@@ -500,19 +676,18 @@ namespace assembly_sim {
       this->serviceUpdate();
     }
 
-    virtual void update(gazebo::common::Time timestep)
+    virtual void update(
+        double timestep,
+        const AtomStateVector &atom_states,
+        DipoleBatch &dipole_batch)
     {
     }
 
   };
 
-  struct DipoleMate : public ProximityMate
+  // Parameters of dipole mates
+  struct DipoleParams : public ProximityParams
   {
-    //TODO: Remove these, unused
-    double min_force_linear, min_force_angular, min_force_linear_deadband, min_force_angular_deadband;
-    double max_force_linear, max_force_angular, max_force_linear_deadband, max_force_angular_deadband;
-    double moment;
-
     // Individual magnetic dipole parameters
     struct Dipole {
       double min_distance;
@@ -520,49 +695,22 @@ namespace assembly_sim {
       KDL::Vector moment;
     };
 
-    // Dipoles involved in this mate
-    std::vector<Dipole> dipoles;
+    // Maximum number of dipoles on each side of a mate
+    static const size_t MAX_DIPOLES = 8;
 
-    DipoleMate(
-        MateModelPtr mate_model,
-        gazebo::physics::ModelPtr gazebo_model,
-        MatePointPtr female_mate_point_,
-        MatePointPtr male_mate_point_,
-        AtomPtr female_atom,
-        AtomPtr male_atom) :
-      ProximityMate(mate_model, gazebo_model, female_mate_point_, male_mate_point_, female_atom, male_atom)
-    {
-      this->load();
-    }
+    // Default distance between the mate points within which the dipoles
+    // interact
+    static const double DEFAULT_INTERACTION_RADIUS;
 
-    virtual void load()
+    DipoleParams(sdf::ElementPtr mate_elem) :
+      ProximityParams(mate_elem),
+      interaction_radius(DEFAULT_INTERACTION_RADIUS),
+      n_dipoles(0),
+      too_many_dipoles(false)
     {
-      sdf::ElementPtr mate_elem = model->mate_elem;
-
-      // Get force attach/detach thresholds
-      sdf::ElementPtr force_elem = mate_elem->GetElement("force");
-      if(force_elem and force_elem->HasElement("min") and force_elem->HasElement("max")) {
-
-        sdf::ElementPtr min_elem = force_elem->GetElement("min");
-        sdf::ElementPtr max_elem = force_elem->GetElement("max");
-
-        sdf::ElementPtr min_linear_elem = min_elem->GetElement("linear");
-        sdf::ElementPtr min_angular_elem = min_elem->GetElement("angular");
-
-        sdf::ElementPtr max_linear_elem = max_elem->GetElement("linear");
-        sdf::ElementPtr max_angular_elem = max_elem->GetElement("angular");
-
-        min_linear_elem->GetAttribute("threshold")->Get(min_force_linear);
-        max_linear_elem->GetAttribute("threshold")->Get(max_force_linear);
-        min_angular_elem->GetAttribute("threshold")->Get(min_force_angular);
-        max_angular_elem->GetAttribute("threshold")->Get(max_force_angular);
-
-        min_linear_elem->GetAttribute("deadband")->Get(min_force_linear_deadband);
-        max_linear_elem->GetAttribute("deadband")->Get(max_force_linear_deadband);
-        min_angular_elem->GetAttribute("deadband")->Get(min_force_angular_deadband);
-        max_angular_elem->GetAttribute("deadband")->Get(max_force_angular_deadband);
-      } else {
-        gzerr<<"No force threshold elements!"<<std::endl;
+      sdf::ElementPtr interaction_radius_elem = mate_elem->GetElement("interaction_radius");
+      if(interaction_radius_elem) {
+        interaction_radius_elem->GetValue()->Get(interaction_radius);
       }
 
       // Get the dipole moments (along Z axis)
@@ -570,41 +718,91 @@ namespace assembly_sim {
 
       while(dipole_elem && dipole_elem->GetName() == "dipole")
       {
-        gazebo::math::Vector3 position_gz, moment_gz;
+        if(n_dipoles == MAX_DIPOLES) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Dipole mates can have at most "<<MAX_DIPOLES<<" dipoles");
+          too_many_dipoles = true;
+          break;
+        }
+
+        sdf::Vector3 position_sdf, moment_sdf;
         double min_distance;
 
         // Get the position of the dipole
         sdf::ElementPtr position_elem = dipole_elem->GetElement("position");
-        position_elem->GetValue()->Get(position_gz);
+        position_elem->GetValue()->Get(position_sdf);
 
         // Get the magnetic moment
         sdf::ElementPtr moment_elem = dipole_elem->GetElement("moment");
-        moment_elem->GetValue()->Get(moment_gz);
+        moment_elem->GetValue()->Get(moment_sdf);
 
         // Get minimum distance
         sdf::ElementPtr min_dist_elem = dipole_elem->GetElement("min_distance");
         min_dist_elem->GetValue()->Get(min_distance);
 
         Dipole dipole;
-        dipole.position = KDL::Vector(position_gz.x, position_gz.y, position_gz.z);
-        dipole.moment = KDL::Vector(moment_gz.x, moment_gz.y, moment_gz.z);
+        to_kdl(position_sdf, dipole.position);
+        to_kdl(moment_sdf, dipole.moment);
         dipole.min_distance = min_distance;
 
-        dipoles.push_back(dipole);
+        dipoles[n_dipoles++] = dipole;
 
         // Get the next dipole element
         dipole_elem = dipole_elem->GetNextElement(dipole_elem->GetName());
       }
     }
 
-    virtual void update(gazebo::common::Time timestep)
+    // Distance between the mate points within which the dipoles interact
+    double interaction_radius;
+
+    // Dipoles involved in this mate
+    Dipole dipoles[MAX_DIPOLES];
+    size_t n_dipoles;
+
+    // The model had more than MAX_DIPOLES dipoles
+    bool too_many_dipoles;
+
+    virtual bool isValid() const
+    {
+      return not too_many_dipoles;
+    }
+  };
+
+  struct DipoleMate : public ProximityMate
+  {
+    typedef DipoleParams Params;
+
+    DipoleMate(
+        MateModel *mate_model,
+        MatePointPtr female_mate_point_,
+        MatePointPtr male_mate_point_,
+        AtomPtr female_atom,
+        AtomPtr male_atom) :
+      ProximityMate(mate_model, female_mate_point_, male_mate_point_, female_atom, male_atom)
+    {
+    }
+
+    const DipoleParams &getDipoleParams() const
+    {
+      return static_cast<const DipoleParams&>(*model->params);
+    }
+
+    // Distance between the mate points within which the dipoles interact
+    virtual double getInteractionRadius() const
+    {
+      return this->getDipoleParams().interaction_radius;
+    }
+
+    virtual void update(
+        double timestep,
+        const AtomStateVector &atom_states,
+        DipoleBatch &dipole_batch)
     {
       // Convenient references
-      AtomPtr &female_atom = this->female;
-      AtomPtr &male_atom = this->male;
+      const AtomPtr female_atom = this->female;
+      const AtomPtr male_atom = this->male;
 
-      MatePointPtr &female_mate_point = this->female_mate_point;
-      MatePointPtr &male_mate_point = this->male_mate_point;
+      const MatePointPtr female_mate_point = this->female_mate_point;
+      const MatePointPtr male_mate_point = this->male_mate_point;
 
       // Don't apply magnetic force if the mate is attached
       if(state == Mate::MATED) {
@@ -612,91 +810,49 @@ namespace assembly_sim {
       }
 
       // Compute the world pose of the female mate frame
-      KDL::Frame female_atom_frame;
-      to_kdl(female_atom->link->GetWorldPose(), female_atom_frame);
+      const KDL::Frame &female_atom_frame = atom_states[female_atom->id].pose;
       KDL::Frame female_mate_frame = female_atom_frame * female_mate_point->pose;
-      gazebo::math::Pose female_mate_pose;
-      to_gazebo(female_mate_frame, female_mate_pose);
 
       // Compute the world pose of the male mate frame
       // This takes into account the attachment displacement (anchor_offset)
-      KDL::Frame male_atom_frame;
-      to_kdl(male_atom->link->GetWorldPose(), male_atom_frame);
+      const KDL::Frame &male_atom_frame = atom_states[male_atom->id].pose;
       KDL::Frame male_mate_frame = male_atom_frame * male_mate_point->pose * this->anchor_offset;
-      gazebo::math::Pose male_mate_pose;
-      to_gazebo(male_mate_frame, male_mate_pose);
 
       // compute twist between the two mate points to determine if we need to simulate dipole interactions
-      mate_error = diff(female_mate_frame, male_mate_frame);
-      if(mate_error.vel.Norm() > 0.03) {
+      // mate_error belongs to the check thread, so it isn't used here
+      const KDL::Twist dipole_error = diff(female_mate_frame, male_mate_frame);
+      if(dipole_error.vel.Norm() > this->getInteractionRadius()) {
         return;
       } else {
         //gzwarn<<"mate "<<description<<" attracting"<<std::endl;
       }
 
-      // compute and apply forces between all male/female pairs of dipoles
-      for(std::vector<Dipole>::iterator it_fdp=dipoles.begin(); it_fdp!=dipoles.end(); ++it_fdp)
+      // Compute the world positions and moments of the dipoles on each side
+      const DipoleParams &params = this->getDipoleParams();
+      const size_t n_dipoles = params.n_dipoles;
+      const DipoleParams::Dipole *dipoles = params.dipoles;
+      KDL::Vector female_positions[DipoleParams::MAX_DIPOLES], female_moments[DipoleParams::MAX_DIPOLES];
+      KDL::Vector male_positions[DipoleParams::MAX_DIPOLES], male_moments[DipoleParams::MAX_DIPOLES];
+      for(size_t i=0; i<n_dipoles; i++) {
+        female_positions[i] = female_mate_frame * dipoles[i].position;
+        female_moments[i] = female_mate_frame.M * dipoles[i].moment;
+        male_positions[i] = male_mate_frame * dipoles[i].position;
+        male_moments[i] = male_mate_frame.M * dipoles[i].moment;
+      }
+
+      // Queue all male/female pairs of dipoles to be computed and applied
+      for(size_t i_fdp=0; i_fdp<n_dipoles; i_fdp++)
       {
-        for(std::vector<Dipole>::iterator it_mdp=dipoles.begin(); it_mdp!=dipoles.end(); ++it_mdp)
+        for(size_t i_mdp=0; i_mdp<n_dipoles; i_mdp++)
         {
-          KDL::Frame female_dipole_frame(female_mate_frame.M, female_mate_frame*it_fdp->position);
-          KDL::Frame male_dipole_frame(male_mate_frame.M, male_mate_frame*it_mdp->position);
-
-          gazebo::math::Pose female_dipole_pose;
-          to_gazebo(female_dipole_frame, female_dipole_pose);
-          gazebo::math::Pose male_dipole_pose;
-          to_gazebo(male_dipole_frame, male_dipole_pose);
-
-          // compute twist between the two mate points
-          KDL::Twist twist_err = diff(female_dipole_frame, male_dipole_frame);
-
-          // Compute dipole force
-          static const double mu0 = 4*M_PI*1E-7;
-
-          KDL::Vector r = twist_err.vel;
-          double rn = r.Norm();
-          rn = std::max(it_fdp->min_distance, rn);
-          r = rn / r.Norm() * r;
-
-          KDL::Vector rh = (rn > 1E-5) ? twist_err.vel/rn : KDL::Vector(1,0,0);
-
-          // Compute magnetic moments and fields
-          KDL::Vector
-            m1 = female_dipole_frame.M * it_fdp->moment,
-            m2 = male_dipole_frame.M * it_mdp->moment,
-            B1 = mu0 / 4 / M_PI / pow(rn,3) * ( 3 * (KDL::dot(m1,rh)*rh - m1)),
-            B2 = mu0 / 4 / M_PI / pow(rn,3) * ( 3 * (KDL::dot(m2,rh)*rh - m2));
-
-          // Compute wrenches in the world frame applied at the dipole point
-          KDL::Wrench
-            W1(-3 * mu0 / 4 / M_PI / pow(rn,4) * ( (rh*m2)*m1 + (rh*m1)*m2 - 2*rh*KDL::dot(m1,m2) + 5*rh*KDL::dot(rh*m2,rh*m1) ), m1 * B2),
-            W2(-W1.force, m2 * B1);
-
-          // Convert to wrenches applied at centers of mass
-          KDL::Wrench
-            W1cog(W1),
-            W2cog(W2);
-
-          W1.force -= W1.torque * it_fdp->position / pow(it_fdp->position.Norm(),2.0);
-          W2.force -= W2.torque * it_mdp->position / pow(it_mdp->position.Norm(),2.0);
-
-          //gzwarn<<"Dipole force: "<<std::setprecision(4)<<std::fixed
-            //<<"female("<<female_atom->link->GetName()<<"#"<<female_mate_point->id<<") "<<[>female_mate_frame<<<]" --> "<<m1<<" F1="<<W1.force
-            //<<" - "
-            //<<"  male("<<male_atom->link->GetName()<<"#"<<male_mate_point->id<<") "<<[>male_mate_frame<<<]" --> "<<m2<<" F2="<<W2.force
-            //<<""<<std::endl;
-
-          // Apply force to links
-          gazebo::math::Vector3 F1gz, F2gz, T1gz, T2gz;
-
-          to_gazebo(W1cog, F1gz, T1gz);
-          to_gazebo(W2cog, F2gz, T2gz);
-
-          female_atom->link->AddForceAtWorldPosition(F1gz, female_dipole_pose.pos);
-          female_atom->link->AddTorque(T1gz);
-
-          male_atom->link->AddForceAtWorldPosition(F2gz, male_dipole_pose.pos);
-          male_atom->link->AddTorque(T2gz);
+          dipole_batch.add(
+              female_atom->id,
+              male_atom->id,
+              female_positions[i_fdp],
+              male_positions[i_mdp],
+              female_moments[i_fdp],
+              male_moments[i_mdp],
+              dipoles[i_fdp].min_distance);
         }
       }
     }
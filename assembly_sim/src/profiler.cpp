@@ -0,0 +1,273 @@
+#include <time.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "profiler.h"
+
+namespace assembly_sim {
+
+  boost::uint64_t get_profile_time()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<boost::uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+  }
+
+  LatencyHistogram::LatencyHistogram() :
+    count_(0),
+    sum_(0),
+    max_(0)
+  {
+    for(int i=0; i < N_BUCKETS; i++) {
+      buckets_[i].store(0, boost::memory_order_relaxed);
+    }
+  }
+
+  int LatencyHistogram::getBucket(boost::uint64_t ns)
+  {
+    // Small durations are counted exactly
+    if(ns < static_cast<boost::uint64_t>(SUB_BUCKETS)) {
+      return static_cast<int>(ns);
+    }
+
+    // Index of the highest set bit
+    int msb = 0;
+    for(boost::uint64_t v = ns; v > 1; v >>= 1) {
+      msb++;
+    }
+
+    if(msb >= MAX_BITS) {
+      return N_BUCKETS - 1;
+    }
+
+    // The bits below the highest one select the sub-bucket
+    const int shift = msb - SUB_BITS;
+    const int sub_bucket = static_cast<int>((ns >> shift) & (SUB_BUCKETS - 1));
+    return (shift + 1) * SUB_BUCKETS + sub_bucket;
+  }
+
+  boost::uint64_t LatencyHistogram::getBucketMidpoint(int bucket)
+  {
+    if(bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+
+    const int shift = bucket / SUB_BUCKETS - 1;
+    const boost::uint64_t sub_bucket = bucket % SUB_BUCKETS;
+    const boost::uint64_t lower = (SUB_BUCKETS + sub_bucket) << shift;
+    return lower + ((1ULL << shift) >> 1);
+  }
+
+  void LatencyHistogram::record(boost::uint64_t ns)
+  {
+    buckets_[getBucket(ns)].fetch_add(1, boost::memory_order_relaxed);
+    count_.fetch_add(1, boost::memory_order_relaxed);
+    sum_.fetch_add(ns, boost::memory_order_relaxed);
+
+    boost::uint64_t max = max_.load(boost::memory_order_relaxed);
+    while(ns > max and not max_.compare_exchange_weak(max, ns, boost::memory_order_relaxed)) { }
+  }
+
+  // Get the duration below which the given fraction of the samples in the
+  // buckets lie
+  static boost::uint64_t get_percentile(
+      const std::vector<boost::uint64_t> &buckets,
+      boost::uint64_t total,
+      double fraction,
+      boost::uint64_t max)
+  {
+    if(total == 0) {
+      return 0;
+    }
+
+    const boost::uint64_t rank = std::max<boost::uint64_t>(
+        static_cast<boost::uint64_t>(fraction * total + 0.5), 1);
+    boost::uint64_t seen = 0;
+    for(size_t i=0; i < buckets.size(); i++) {
+      seen += buckets[i];
+      if(seen >= rank) {
+        return std::min(LatencyHistogram::getBucketMidpoint(i), max);
+      }
+    }
+
+    return max;
+  }
+
+  boost::uint64_t LatencyHistogram::getPercentile(double fraction) const
+  {
+    std::vector<boost::uint64_t> buckets(N_BUCKETS);
+    boost::uint64_t total = 0;
+    for(int i=0; i < N_BUCKETS; i++) {
+      buckets[i] = buckets_[i].load(boost::memory_order_relaxed);
+      total += buckets[i];
+    }
+
+    return get_percentile(buckets, total, fraction, this->getMax());
+  }
+
+  Profiler &Profiler::instance()
+  {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  Profiler::Profiler() :
+    enabled_(false),
+    detailed_(false),
+    n_timers_(0),
+    n_counters_(0)
+  {
+  }
+
+  void Profiler::setEnabled(bool enabled, bool detailed)
+  {
+    enabled_.store(enabled, boost::memory_order_relaxed);
+    detailed_.store(enabled and detailed, boost::memory_order_relaxed);
+  }
+
+  size_t Profiler::getTimer(const std::string &name)
+  {
+    boost::mutex::scoped_lock lock(names_mutex_);
+
+    const size_t n_timers = n_timers_.load(boost::memory_order_relaxed);
+    for(size_t i=0; i < n_timers; i++) {
+      if(timers_[i].name == name) {
+        return i;
+      }
+    }
+
+    if(n_timers == MAX_TIMERS) {
+      return MAX_TIMERS - 1;
+    }
+
+    timers_[n_timers].name = name;
+    timers_[n_timers].histogram.reset(new LatencyHistogram());
+    n_timers_.store(n_timers + 1, boost::memory_order_release);
+
+    return n_timers;
+  }
+
+  size_t Profiler::getCounter(const std::string &name)
+  {
+    boost::mutex::scoped_lock lock(names_mutex_);
+
+    const size_t n_counters = n_counters_.load(boost::memory_order_relaxed);
+    for(size_t i=0; i < n_counters; i++) {
+      if(counters_[i].name == name) {
+        return i;
+      }
+    }
+
+    if(n_counters == MAX_COUNTERS) {
+      return MAX_COUNTERS - 1;
+    }
+
+    counters_[n_counters].name = name;
+    n_counters_.store(n_counters + 1, boost::memory_order_release);
+
+    return n_counters;
+  }
+
+  void Profiler::getStats(
+      std::vector<TimerStats> &timer_stats,
+      std::vector<CounterStats> &counter_stats) const
+  {
+    timer_stats.clear();
+    const size_t n_timers = n_timers_.load(boost::memory_order_acquire);
+    for(size_t i=0; i < n_timers; i++)
+    {
+      const LatencyHistogram &histogram = *timers_[i].histogram;
+      const boost::uint64_t count = histogram.getCount();
+      if(count == 0) {
+        continue;
+      }
+
+      TimerStats stats;
+      stats.name = timers_[i].name;
+      stats.count = count;
+      stats.total_count = count;
+      stats.mean = histogram.getSum() * 1E-9 / count;
+      stats.p50 = histogram.getPercentile(0.5) * 1E-9;
+      stats.p99 = histogram.getPercentile(0.99) * 1E-9;
+      stats.max = histogram.getMax() * 1E-9;
+      timer_stats.push_back(stats);
+    }
+
+    counter_stats.clear();
+    const size_t n_counters = n_counters_.load(boost::memory_order_acquire);
+    for(size_t i=0; i < n_counters; i++)
+    {
+      CounterStats stats;
+      stats.name = counters_[i].name;
+      stats.value = counters_[i].value.load(boost::memory_order_relaxed);
+      counter_stats.push_back(stats);
+    }
+  }
+
+  void Profiler::getIntervalStats(
+      std::vector<TimerStats> &timer_stats,
+      std::vector<CounterStats> &counter_stats)
+  {
+    boost::mutex::scoped_lock lock(interval_mutex_);
+
+    timer_stats.clear();
+    interval_buckets_.resize(LatencyHistogram::N_BUCKETS);
+    const size_t n_timers = n_timers_.load(boost::memory_order_acquire);
+    for(size_t i=0; i < n_timers; i++)
+    {
+      Timer &timer = timers_[i];
+      const LatencyHistogram &histogram = *timer.histogram;
+      if(timer.last_buckets.empty()) {
+        timer.last_buckets.assign(LatencyHistogram::N_BUCKETS, 0);
+      }
+
+      // Samples can be recorded while the buckets are read, so the count is
+      // taken from the buckets themselves
+      boost::uint64_t count = 0;
+      boost::uint64_t max = 0;
+      for(int b=0; b < LatencyHistogram::N_BUCKETS; b++) {
+        const boost::uint64_t bucket_count = histogram.getBucketCount(b);
+        interval_buckets_[b] = bucket_count - timer.last_buckets[b];
+        timer.last_buckets[b] = bucket_count;
+        count += interval_buckets_[b];
+        if(interval_buckets_[b] > 0) {
+          max = LatencyHistogram::getBucketMidpoint(b);
+        }
+      }
+
+      const boost::uint64_t total_count = histogram.getCount();
+      const boost::uint64_t sum = histogram.getSum();
+      const boost::uint64_t interval_count = total_count - timer.last_count;
+      const boost::uint64_t interval_sum = sum - timer.last_sum;
+      timer.last_count = total_count;
+      timer.last_sum = sum;
+
+      if(count == 0) {
+        continue;
+      }
+
+      max = std::min(max, histogram.getMax());
+
+      TimerStats stats;
+      stats.name = timer.name;
+      stats.count = count;
+      stats.total_count = total_count;
+      stats.mean = interval_count > 0 ? interval_sum * 1E-9 / interval_count : 0.0;
+      stats.p50 = get_percentile(interval_buckets_, count, 0.5, max) * 1E-9;
+      stats.p99 = get_percentile(interval_buckets_, count, 0.99, max) * 1E-9;
+      stats.max = max * 1E-9;
+      timer_stats.push_back(stats);
+    }
+
+    counter_stats.clear();
+    const size_t n_counters = n_counters_.load(boost::memory_order_acquire);
+    for(size_t i=0; i < n_counters; i++)
+    {
+      CounterStats stats;
+      stats.name = counters_[i].name;
+      stats.value = counters_[i].value.load(boost::memory_order_relaxed);
+      counter_stats.push_back(stats);
+    }
+  }
+}
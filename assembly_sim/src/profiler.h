@@ -0,0 +1,228 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_PROFILER_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_PROFILER_H__
+
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace assembly_sim {
+
+  // Nanoseconds on a monotonic clock
+  boost::uint64_t get_profile_time();
+
+  // Lock-free histogram of durations in nanoseconds
+  //
+  // Buckets are log-linear: each power of two is split into 16 linear
+  // sub-buckets, so a percentile is within about 6% of the real value.
+  class LatencyHistogram
+  {
+  public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    // Durations up to 2^40 ns (about 18 minutes) get their own buckets
+    static const int MAX_BITS = 40;
+    static const int N_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    LatencyHistogram();
+
+    void record(boost::uint64_t ns);
+
+    boost::uint64_t getCount() const { return count_.load(boost::memory_order_relaxed); }
+    boost::uint64_t getSum() const { return sum_.load(boost::memory_order_relaxed); }
+    boost::uint64_t getMax() const { return max_.load(boost::memory_order_relaxed); }
+    boost::uint64_t getBucketCount(int bucket) const { return buckets_[bucket].load(boost::memory_order_relaxed); }
+
+    // Get the duration below which the given fraction of the samples lie
+    // This is approximate if samples are recorded while it's computed.
+    boost::uint64_t getPercentile(double fraction) const;
+
+    static int getBucket(boost::uint64_t ns);
+    static boost::uint64_t getBucketMidpoint(int bucket);
+
+  private:
+    boost::atomic<boost::uint64_t> buckets_[N_BUCKETS];
+    boost::atomic<boost::uint64_t> count_;
+    boost::atomic<boost::uint64_t> sum_;
+    boost::atomic<boost::uint64_t> max_;
+  };
+
+  // Summary of one timer, in seconds
+  struct TimerStats
+  {
+    std::string name;
+    boost::uint64_t count;
+    // samples since the start, when count only covers an interval
+    boost::uint64_t total_count;
+    double mean;
+    double p50;
+    double p99;
+    double max;
+  };
+
+  struct CounterStats
+  {
+    std::string name;
+    boost::int64_t value;
+  };
+
+  // Timers and counters for the phases of the soup pipeline
+  //
+  // Timers and counters are created by name, and named hierarchically with
+  // slashes (e.g. "check/broad_phase"). Recording is lock-free and doesn't
+  // allocate, and when profiling is disabled, timers don't read the clock.
+  //
+  // Use the ASSEMBLY_PROFILE* macros below instead of calling this directly.
+  class Profiler
+  {
+  public:
+    static const size_t MAX_TIMERS = 128;
+    static const size_t MAX_COUNTERS = 64;
+
+    static Profiler &instance();
+
+    // Timing is disabled until this is called
+    // Detailed timing also times each mate, which reads the clock twice per
+    // mate per tick.
+    void setEnabled(bool enabled, bool detailed = false);
+    bool isEnabled() const { return enabled_.load(boost::memory_order_relaxed); }
+    bool isDetailed() const { return detailed_.load(boost::memory_order_relaxed); }
+
+    // Get the id of the timer or counter with the given name, creating it if
+    // it doesn't exist
+    // If there are too many, the last one is shared by the rest.
+    size_t getTimer(const std::string &name);
+    size_t getCounter(const std::string &name);
+
+    void record(size_t timer, boost::uint64_t ns) { timers_[timer].histogram->record(ns); }
+    void add(size_t counter, boost::int64_t value) { counters_[counter].value.fetch_add(value, boost::memory_order_relaxed); }
+    void set(size_t counter, boost::int64_t value) { counters_[counter].value.store(value, boost::memory_order_relaxed); }
+
+    // Get the stats of every timer which has samples, and every counter,
+    // accumulated since the start
+    void getStats(
+        std::vector<TimerStats> &timer_stats,
+        std::vector<CounterStats> &counter_stats) const;
+
+    // Get the stats of every timer over the samples recorded since the last
+    // call, and every counter
+    // The max is approximate like the percentiles, since only the buckets
+    // of the samples are known.
+    void getIntervalStats(
+        std::vector<TimerStats> &timer_stats,
+        std::vector<CounterStats> &counter_stats);
+
+  private:
+    Profiler();
+
+    struct Timer
+    {
+      Timer() : last_count(0), last_sum(0) { }
+      std::string name;
+      boost::scoped_ptr<LatencyHistogram> histogram;
+      // The histogram at the last getIntervalStats()
+      std::vector<boost::uint64_t> last_buckets;
+      boost::uint64_t last_count;
+      boost::uint64_t last_sum;
+    };
+
+    struct Counter
+    {
+      Counter() : value(0) { }
+      std::string name;
+      boost::atomic<boost::int64_t> value;
+    };
+
+    boost::atomic<bool> enabled_;
+    boost::atomic<bool> detailed_;
+
+    // Timers and counters are only added, and never move once they are
+    boost::mutex names_mutex_;
+    Timer timers_[MAX_TIMERS];
+    boost::atomic<size_t> n_timers_;
+    Counter counters_[MAX_COUNTERS];
+    boost::atomic<size_t> n_counters_;
+
+    // Serializes getIntervalStats()
+    boost::mutex interval_mutex_;
+    std::vector<boost::uint64_t> interval_buckets_;
+  };
+
+  // Records the time from construction to destruction
+  class ScopedTimer
+  {
+  public:
+    ScopedTimer(size_t timer, bool detailed = false) :
+      timer_(timer),
+      start_(0)
+    {
+      Profiler &profiler = Profiler::instance();
+      if(detailed ? profiler.isDetailed() : profiler.isEnabled()) {
+        start_ = get_profile_time();
+      }
+    }
+
+    ~ScopedTimer()
+    {
+      if(start_ != 0) {
+        Profiler::instance().record(timer_, get_profile_time() - start_);
+      }
+    }
+
+  private:
+    size_t timer_;
+    boost::uint64_t start_;
+  };
+}
+
+// Set this to 0 to compile out all timers and counters
+#ifndef ASSEMBLY_SIM_PROFILE
+#define ASSEMBLY_SIM_PROFILE 1
+#endif
+
+#define ASSEMBLY_PROFILE_CONCAT_(a, b) a##b
+#define ASSEMBLY_PROFILE_CONCAT(a, b) ASSEMBLY_PROFILE_CONCAT_(a, b)
+
+#if ASSEMBLY_SIM_PROFILE
+
+// Time the rest of the enclosing scope with the named timer
+#define ASSEMBLY_PROFILE(name) \
+  static const size_t ASSEMBLY_PROFILE_CONCAT(assembly_profile_timer_, __LINE__) = \
+    ::assembly_sim::Profiler::instance().getTimer(name); \
+  ::assembly_sim::ScopedTimer ASSEMBLY_PROFILE_CONCAT(assembly_scoped_timer_, __LINE__)( \
+      ASSEMBLY_PROFILE_CONCAT(assembly_profile_timer_, __LINE__))
+
+// Time the rest of the enclosing scope with a timer id, only if detailed
+// profiling is enabled
+#define ASSEMBLY_PROFILE_DETAILED(timer) \
+  ::assembly_sim::ScopedTimer ASSEMBLY_PROFILE_CONCAT(assembly_scoped_timer_, __LINE__)(timer, true)
+
+// Add to the named counter if profiling is enabled
+#define ASSEMBLY_PROFILE_COUNT(name, value) \
+  do { \
+    static const size_t assembly_profile_counter_ = ::assembly_sim::Profiler::instance().getCounter(name); \
+    if(::assembly_sim::Profiler::instance().isEnabled()) { \
+      ::assembly_sim::Profiler::instance().add(assembly_profile_counter_, value); \
+    } \
+  } while(0)
+
+// Set the named counter
+#define ASSEMBLY_PROFILE_SET(name, value) \
+  do { \
+    static const size_t assembly_profile_counter_ = ::assembly_sim::Profiler::instance().getCounter(name); \
+    ::assembly_sim::Profiler::instance().set(assembly_profile_counter_, value); \
+  } while(0)
+
+#else
+
+#define ASSEMBLY_PROFILE(name) do { } while(0)
+#define ASSEMBLY_PROFILE_DETAILED(timer) do { } while(0)
+#define ASSEMBLY_PROFILE_COUNT(name, value) do { } while(0)
+#define ASSEMBLY_PROFILE_SET(name, value) do { } while(0)
+
+#endif
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_PROFILER_H__
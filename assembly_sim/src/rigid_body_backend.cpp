@@ -0,0 +1,545 @@
+#include <cmath>
+#include <algorithm>
+
+#include <boost/make_shared.hpp>
+#include <boost/format.hpp>
+
+#include "rigid_body_backend.h"
+
+namespace assembly_sim {
+
+  static void to_eigen(const KDL::Rotation &rotation, Eigen::Matrix3d &matrix)
+  {
+    for(int i=0; i < 3; i++) {
+      for(int j=0; j < 3; j++) {
+        matrix(i,j) = rotation(i,j);
+      }
+    }
+  }
+
+  static void to_kdl(const Eigen::Vector3d &vector3d, KDL::Vector &vector)
+  {
+    vector = KDL::Vector(vector3d.x(), vector3d.y(), vector3d.z());
+  }
+
+  // Get the inertia of a body about its center of mass in the world frame
+  static Eigen::Matrix3d get_world_inertia(const Eigen::Matrix3d &inertia, const KDL::Rotation &rotation)
+  {
+    Eigen::Matrix3d R;
+    to_eigen(rotation, R);
+    return R * inertia * R.transpose();
+  }
+
+  RigidBodyParams::RigidBodyParams() :
+    mass(1.0),
+    cog(KDL::Vector::Zero()),
+    inertia(Eigen::Matrix3d::Identity()),
+    contact_radius(0.0),
+    gravity(true),
+    fixed(false)
+  {
+  }
+
+  RigidBodyConstraint::RigidBodyConstraint(RigidBodyBackend *backend, const Mate &mate) :
+    backend_(backend),
+    female_id_(mate.female->id),
+    male_id_(mate.male->id),
+    name_(boost::str(boost::format("%s_m%0d_to_%s_m%0d")
+                     % mate.female->name
+                     % mate.female_mate_point->id
+                     % mate.male->name
+                     % mate.male_mate_point->id)),
+    anchor_(KDL::Vector::Zero()),
+    attached_(false)
+  {
+  }
+
+  void RigidBodyConstraint::attach(const KDL::Frame &anchor_frame)
+  {
+    // The atoms are welded in whatever pose they're in, so re-attaching
+    // only moves the anchor
+    if(not attached_) {
+      backend_->weld(female_id_, male_id_);
+      attached_ = true;
+    }
+
+    anchor_ = anchor_frame.p;
+  }
+
+  void RigidBodyConstraint::detach()
+  {
+    if(attached_) {
+      backend_->unweld(female_id_, male_id_);
+      attached_ = false;
+    }
+  }
+
+  KDL::Wrench RigidBodyConstraint::getWrench()
+  {
+    if(not attached_) {
+      return KDL::Wrench::Zero();
+    }
+
+    // The welds aren't resolved individually, so this is the net wrench
+    // which all welds apply to the male atom, which is usually held by a
+    // single mate. Like Gazebo, this is reported for the first (female) body.
+    return -backend_->bodies_[male_id_].constraint_wrench;
+  }
+
+  RigidBodyBackend::RigidBodyBackend() :
+    clusters_dirty_(true),
+    max_radius_(0.0),
+    gravity_(0.0, 0.0, -9.81),
+    ground_(true),
+    contact_stiffness_(2000.0),
+    contact_damping_(10.0),
+    contact_scale_(0.5),
+    friction_(0.5),
+    linear_damping_(0.0),
+    angular_damping_(0.0)
+  {
+  }
+
+  void RigidBodyBackend::load(sdf::ElementPtr sdf)
+  {
+    if(not sdf) {
+      return;
+    }
+
+    if(sdf->HasElement("gravity")) {
+      sdf::Vector3 gravity;
+      sdf->GetElement("gravity")->GetValue()->Get(gravity);
+      assembly_sim::to_kdl(gravity, gravity_);
+    }
+    if(sdf->HasElement("ground")) {
+      sdf->GetElement("ground")->GetValue()->Get(ground_);
+    }
+    if(sdf->HasElement("contact_stiffness")) {
+      sdf->GetElement("contact_stiffness")->GetValue()->Get(contact_stiffness_);
+    }
+    if(sdf->HasElement("contact_damping")) {
+      sdf->GetElement("contact_damping")->GetValue()->Get(contact_damping_);
+    }
+    if(sdf->HasElement("contact_scale")) {
+      sdf->GetElement("contact_scale")->GetValue()->Get(contact_scale_);
+    }
+    if(sdf->HasElement("friction")) {
+      sdf->GetElement("friction")->GetValue()->Get(friction_);
+    }
+    if(sdf->HasElement("linear_damping")) {
+      sdf->GetElement("linear_damping")->GetValue()->Get(linear_damping_);
+    }
+    if(sdf->HasElement("angular_damping")) {
+      sdf->GetElement("angular_damping")->GetValue()->Get(angular_damping_);
+    }
+  }
+
+  void RigidBodyBackend::getBodyParams(sdf::ElementPtr link_elem, RigidBodyParams &params)
+  {
+    if(link_elem->HasElement("gravity")) {
+      link_elem->GetElement("gravity")->GetValue()->Get(params.gravity);
+    }
+
+    if(link_elem->HasElement("inertial")) {
+      sdf::ElementPtr inertial_elem = link_elem->GetElement("inertial");
+
+      if(inertial_elem->HasElement("mass")) {
+        inertial_elem->GetElement("mass")->GetValue()->Get(params.mass);
+      }
+
+      KDL::Frame inertial_frame = KDL::Frame::Identity();
+      if(inertial_elem->HasElement("pose")) {
+        assembly_sim::to_kdl(inertial_elem->GetElement("pose"), inertial_frame);
+      }
+      params.cog = inertial_frame.p;
+
+      if(inertial_elem->HasElement("inertia")) {
+        sdf::ElementPtr inertia_elem = inertial_elem->GetElement("inertia");
+        double ixx = 1.0, ixy = 0.0, ixz = 0.0, iyy = 1.0, iyz = 0.0, izz = 1.0;
+
+        if(inertia_elem->HasElement("ixx")) { inertia_elem->GetElement("ixx")->GetValue()->Get(ixx); }
+        if(inertia_elem->HasElement("ixy")) { inertia_elem->GetElement("ixy")->GetValue()->Get(ixy); }
+        if(inertia_elem->HasElement("ixz")) { inertia_elem->GetElement("ixz")->GetValue()->Get(ixz); }
+        if(inertia_elem->HasElement("iyy")) { inertia_elem->GetElement("iyy")->GetValue()->Get(iyy); }
+        if(inertia_elem->HasElement("iyz")) { inertia_elem->GetElement("iyz")->GetValue()->Get(iyz); }
+        if(inertia_elem->HasElement("izz")) { inertia_elem->GetElement("izz")->GetValue()->Get(izz); }
+
+        Eigen::Matrix3d inertia;
+        inertia <<
+          ixx, ixy, ixz,
+          ixy, iyy, iyz,
+          ixz, iyz, izz;
+
+        // The inertia is given in the inertial frame
+        params.inertia = get_world_inertia(inertia, inertial_frame.M);
+      }
+    }
+
+    // Use the first sphere collision, if any, for contacts
+    if(link_elem->HasElement("collision")) {
+      sdf::ElementPtr collision_elem = link_elem->GetElement("collision");
+      while(collision_elem && collision_elem->GetName() == "collision")
+      {
+        if(collision_elem->HasElement("geometry") and
+           collision_elem->GetElement("geometry")->HasElement("sphere"))
+        {
+          sdf::ElementPtr sphere_elem = collision_elem->GetElement("geometry")->GetElement("sphere");
+          if(sphere_elem->HasElement("radius")) {
+            sphere_elem->GetElement("radius")->GetValue()->Get(params.contact_radius);
+            break;
+          }
+        }
+
+        collision_elem = collision_elem->GetNextElement(collision_elem->GetName());
+      }
+    }
+  }
+
+  void RigidBodyBackend::addBody(const Atom &atom, const RigidBodyParams &params, const KDL::Frame &pose)
+  {
+    if(atom.id >= bodies_.size()) {
+      bodies_.resize(atom.id + 1);
+    }
+
+    Body &body = bodies_[atom.id];
+    body.params = params;
+    body.pose = pose;
+    body.vel = KDL::Vector::Zero();
+    body.rot = KDL::Vector::Zero();
+    body.wrench = KDL::Wrench::Zero();
+    body.constraint_wrench = KDL::Wrench::Zero();
+
+    // Without a collision sphere, use the radius of a solid sphere with the
+    // same mass and average moment of inertia
+    body.radius = params.contact_radius;
+    if(body.radius <= 0.0 and params.mass > 0.0) {
+      body.radius = std::sqrt(2.5 * params.inertia.trace() / 3.0 / params.mass);
+    }
+    body.radius *= contact_scale_;
+    max_radius_ = std::max(max_radius_, body.radius);
+
+    clusters_dirty_ = true;
+  }
+
+  void RigidBodyBackend::getAtomState(const Atom &atom, AtomState &atom_state)
+  {
+    const Body &body = bodies_[atom.id];
+
+    atom_state.pose = body.pose;
+    atom_state.cog = body.pose * body.params.cog;
+
+    // The twist is reported at the body frame origin, like Gazebo
+    atom_state.twist.vel = body.vel + body.rot * (body.pose.p - atom_state.cog);
+    atom_state.twist.rot = body.rot;
+  }
+
+  void RigidBodyBackend::applyWrench(const Atom &atom, const KDL::Wrench &wrench)
+  {
+    bodies_[atom.id].wrench += wrench;
+  }
+
+  ConstraintPtr RigidBodyBackend::createConstraint(const Mate &mate)
+  {
+    return boost::make_shared<RigidBodyConstraint>(this, mate);
+  }
+
+  void RigidBodyBackend::releaseConstraint(const Mate &mate, const ConstraintPtr &constraint)
+  {
+    // Welds are cheap to create, so they aren't reused
+  }
+
+  size_t RigidBodyBackend::getClusterCount()
+  {
+    if(clusters_dirty_) {
+      this->buildClusters();
+    }
+
+    return clusters_.size();
+  }
+
+  void RigidBodyBackend::weld(size_t female_id, size_t male_id)
+  {
+    welds_.push_back(std::make_pair(female_id, male_id));
+    clusters_dirty_ = true;
+  }
+
+  void RigidBodyBackend::unweld(size_t female_id, size_t male_id)
+  {
+    std::vector<std::pair<size_t, size_t> >::iterator it =
+      std::find(welds_.begin(), welds_.end(), std::make_pair(female_id, male_id));
+
+    if(it != welds_.end()) {
+      *it = welds_.back();
+      welds_.pop_back();
+      clusters_dirty_ = true;
+    }
+  }
+
+  size_t RigidBodyBackend::findRoot(size_t id)
+  {
+    while(roots_[id] != id) {
+      roots_[id] = roots_[roots_[id]];
+      id = roots_[id];
+    }
+    return id;
+  }
+
+  void RigidBodyBackend::buildClusters()
+  {
+    // Join the welded bodies
+    roots_.resize(bodies_.size());
+    for(size_t i=0; i < roots_.size(); i++) {
+      roots_[i] = i;
+    }
+
+    for(std::vector<std::pair<size_t, size_t> >::iterator it = welds_.begin();
+        it != welds_.end();
+        ++it)
+    {
+      roots_[this->findRoot(it->first)] = this->findRoot(it->second);
+    }
+
+    // Group the bodies by cluster in id order
+    clusters_.clear();
+    std::vector<size_t> cluster_index(bodies_.size(), bodies_.size());
+    for(size_t i=0; i < bodies_.size(); i++) {
+      size_t root = this->findRoot(i);
+      if(cluster_index[root] == bodies_.size()) {
+        cluster_index[root] = clusters_.size();
+        clusters_.push_back(std::vector<size_t>());
+      }
+      bodies_[i].cluster = cluster_index[root];
+      clusters_[cluster_index[root]].push_back(i);
+    }
+
+    clusters_dirty_ = false;
+  }
+
+  void RigidBodyBackend::step(double timestep)
+  {
+    if(clusters_dirty_) {
+      this->buildClusters();
+    }
+
+    this->addContactWrenches();
+
+    for(std::vector<std::vector<size_t> >::iterator it = clusters_.begin();
+        it != clusters_.end();
+        ++it)
+    {
+      this->integrateCluster(*it, timestep);
+    }
+  }
+
+  void RigidBodyBackend::addContactWrench(
+      Body &body,
+      Body *other,
+      const KDL::Vector &point,
+      const KDL::Vector &normal,
+      double penetration)
+  {
+    // Relative velocity of the bodies at the contact point
+    KDL::Vector vel = body.vel + body.rot * (point - body.pose * body.params.cog);
+    if(other) {
+      vel = vel - (other->vel + other->rot * (point - other->pose * other->params.cog));
+    }
+
+    // Spring-damper along the normal, which can only push
+    const double normal_vel = KDL::dot(vel, normal);
+    const double normal_force = std::max(0.0, contact_stiffness_ * penetration - contact_damping_ * normal_vel);
+
+    // Damped sliding, limited by Coulomb friction
+    KDL::Vector force = normal_force * normal;
+    const KDL::Vector tangent_vel = vel - normal_vel * normal;
+    const double tangent_speed = tangent_vel.Norm();
+    if(tangent_speed > 1E-9) {
+      const double friction_force = std::min(friction_ * normal_force, contact_damping_ * tangent_speed);
+      force = force - (friction_force / tangent_speed) * tangent_vel;
+    }
+
+    body.wrench += KDL::Wrench(force, (point - body.pose * body.params.cog) * force);
+    if(other) {
+      other->wrench += KDL::Wrench(-force, (point - other->pose * other->params.cog) * -force);
+    }
+  }
+
+  void RigidBodyBackend::addContactWrenches()
+  {
+    // Hash the contact spheres
+    contact_hash_.setCellSize(std::max(2.0 * max_radius_, 1E-3));
+    contact_hash_.clear();
+    for(size_t i=0; i < bodies_.size(); i++) {
+      contact_hash_.insert(bodies_[i].pose * bodies_[i].params.cog, i);
+    }
+    contact_hash_.build();
+
+    for(size_t i=0; i < bodies_.size(); i++)
+    {
+      Body &body = bodies_[i];
+      const KDL::Vector cog = body.pose * body.params.cog;
+
+      // Contacts with the ground plane at z=0
+      if(ground_ and cog.z() < body.radius) {
+        this->addContactWrench(
+            body,
+            NULL,
+            KDL::Vector(cog.x(), cog.y(), 0.0),
+            KDL::Vector(0.0, 0.0, 1.0),
+            body.radius - cog.z());
+      }
+
+      // Contacts with other bodies, each pair once
+      contact_query_.clear();
+      contact_hash_.query(cog, body.radius + max_radius_, contact_query_);
+      for(std::vector<size_t>::iterator it = contact_query_.begin();
+          it != contact_query_.end();
+          ++it)
+      {
+        if(*it <= i) { continue; }
+
+        Body &other = bodies_[*it];
+
+        // Welded bodies don't collide
+        if(other.cluster == body.cluster) { continue; }
+
+        const KDL::Vector offset = cog - other.pose * other.params.cog;
+        const double distance = offset.Norm();
+        const double penetration = body.radius + other.radius - distance;
+        if(penetration <= 0.0 or distance < 1E-9) { continue; }
+
+        const KDL::Vector normal = offset / distance;
+        this->addContactWrench(
+            body,
+            &other,
+            cog - normal * (body.radius - 0.5 * penetration),
+            normal,
+            penetration);
+      }
+    }
+  }
+
+  void RigidBodyBackend::integrateCluster(const std::vector<size_t> &members, double timestep)
+  {
+    // Add gravity
+    for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+      Body &body = bodies_[*it];
+      if(body.params.gravity) {
+        body.wrench.force += body.params.mass * gravity_;
+      }
+    }
+
+    bool fixed = false;
+    for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+      fixed = fixed or bodies_[*it].params.fixed;
+    }
+
+    // Clusters which are fixed to the world don't move
+    if(fixed) {
+      for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+        Body &body = bodies_[*it];
+        body.vel = KDL::Vector::Zero();
+        body.rot = KDL::Vector::Zero();
+        body.constraint_wrench = -body.wrench;
+        body.wrench = KDL::Wrench::Zero();
+      }
+      return;
+    }
+
+    // Get the center of mass of the cluster
+    double mass = 0.0;
+    KDL::Vector cog = KDL::Vector::Zero();
+    for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+      const Body &body = bodies_[*it];
+      mass += body.params.mass;
+      cog += body.params.mass * (body.pose * body.params.cog);
+    }
+    if(mass <= 0.0) {
+      return;
+    }
+    cog = cog / mass;
+
+    // Get the inertia, momentum and net wrench of the cluster about its
+    // center of mass
+    // The momentum of newly welded bodies is conserved, like an inelastic
+    // collision
+    Eigen::Matrix3d inertia = Eigen::Matrix3d::Zero();
+    KDL::Vector linear_momentum = KDL::Vector::Zero();
+    KDL::Vector angular_momentum = KDL::Vector::Zero();
+    KDL::Wrench wrench = KDL::Wrench::Zero();
+
+    for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+      const Body &body = bodies_[*it];
+      const KDL::Vector offset = body.pose * body.params.cog - cog;
+      const Eigen::Matrix3d body_inertia = get_world_inertia(body.params.inertia, body.pose.M);
+
+      Eigen::Vector3d r, w;
+      to_eigen(offset, r);
+      to_eigen(body.rot, w);
+
+      inertia += body_inertia + body.params.mass * (r.dot(r) * Eigen::Matrix3d::Identity() - r * r.transpose());
+
+      KDL::Vector body_angular_momentum;
+      to_kdl(Eigen::Vector3d(body_inertia * w), body_angular_momentum);
+
+      linear_momentum += body.params.mass * body.vel;
+      angular_momentum += body_angular_momentum + offset * (body.params.mass * body.vel);
+
+      wrench.force += body.wrench.force;
+      wrench.torque += body.wrench.torque + offset * body.wrench.force;
+    }
+
+    const Eigen::Matrix3d inertia_inv = inertia.inverse();
+
+    // Semi-implicit Euler: update the velocities, then the pose
+    Eigen::Vector3d L, T;
+    to_eigen(angular_momentum, L);
+    to_eigen(wrench.torque, T);
+
+    KDL::Vector vel = linear_momentum / mass + (timestep / mass) * wrench.force;
+
+    Eigen::Vector3d W = inertia_inv * L;
+    W += timestep * inertia_inv * (T - W.cross(inertia * W));
+
+    KDL::Vector rot;
+    to_kdl(W, rot);
+
+    vel = vel / (1.0 + timestep * linear_damping_);
+    rot = rot / (1.0 + timestep * angular_damping_);
+
+    const double angle = rot.Norm() * timestep;
+    const KDL::Rotation delta_rot = angle > 1E-12
+      ? KDL::Rotation::Rot2(rot / rot.Norm(), angle)
+      : KDL::Rotation::Identity();
+    const KDL::Vector next_cog = cog + timestep * vel;
+
+    // Move all bodies with the cluster
+    for(std::vector<size_t>::const_iterator it = members.begin(); it != members.end(); ++it) {
+      Body &body = bodies_[*it];
+      const KDL::Vector body_cog = body.pose * body.params.cog;
+      const KDL::Vector next_body_cog = next_cog + delta_rot * (body_cog - cog);
+
+      // Keep the rotation orthonormal
+      double x, y, z, w;
+      (delta_rot * body.pose.M).GetQuaternion(x, y, z, w);
+      body.pose.M = KDL::Rotation::Quaternion(x, y, z, w);
+      body.pose.p = next_body_cog - body.pose.M * body.params.cog;
+
+      const KDL::Vector next_vel = vel + rot * (next_body_cog - next_cog);
+
+      // The welds supply whatever the applied wrench doesn't to move the
+      // body with the cluster
+      Eigen::Vector3d dw;
+      to_eigen(rot - body.rot, dw);
+      KDL::Vector inertial_torque;
+      to_kdl(Eigen::Vector3d(get_world_inertia(body.params.inertia, body.pose.M) * dw / timestep), inertial_torque);
+
+      body.constraint_wrench.force = body.params.mass * (next_vel - body.vel) / timestep - body.wrench.force;
+      body.constraint_wrench.torque = inertial_torque - body.wrench.torque;
+
+      body.vel = next_vel;
+      body.rot = rot;
+      body.wrench = KDL::Wrench::Zero();
+    }
+  }
+
+}
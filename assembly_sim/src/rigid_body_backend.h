@@ -0,0 +1,176 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_RIGID_BODY_BACKEND_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_RIGID_BODY_BACKEND_H__
+
+#include <string>
+#include <vector>
+
+#include <sdf/sdf.hh>
+
+#include <Eigen/Dense>
+
+#include <kdl/frames.hpp>
+
+#include "backend.h"
+#include "models.h"
+#include "spatial_hash.h"
+
+namespace assembly_sim {
+
+  class RigidBodyBackend;
+
+  // Mass properties and contact sphere of a rigid body
+  struct RigidBodyParams
+  {
+    RigidBodyParams();
+
+    double mass;
+    // Position of the center of mass in the body frame
+    KDL::Vector cog;
+    // Inertia about the center of mass in the body frame
+    Eigen::Matrix3d inertia;
+    // Radius of the contact sphere around the center of mass
+    // If this is zero, it's estimated from the mass and inertia
+    double contact_radius;
+    // Whether the body is affected by gravity
+    bool gravity;
+    // Whether the body is fixed to the world
+    bool fixed;
+  };
+
+  // Welds the atoms of a mate together
+  class RigidBodyConstraint : public Constraint
+  {
+  public:
+    RigidBodyConstraint(RigidBodyBackend *backend, const Mate &mate);
+
+    virtual void attach(const KDL::Frame &anchor_frame);
+    virtual void detach();
+    virtual KDL::Wrench getWrench();
+    virtual KDL::Vector getAnchor() { return anchor_; }
+    virtual const std::string &getName() const { return name_; }
+
+  private:
+    RigidBodyBackend *backend_;
+    size_t female_id_;
+    size_t male_id_;
+    std::string name_;
+    KDL::Vector anchor_;
+    bool attached_;
+  };
+
+  // A minimal rigid-body simulator for running soups without Gazebo
+  //
+  // Bodies are integrated with semi-implicit Euler. Atoms which are attached
+  // by mates are welded together and simulated as a single composite body,
+  // so constraints never drift. Collisions are approximated by spring-damper
+  // contacts between one sphere per body and an optional ground plane.
+  //
+  // This is meant for quickly screening assembly behavior with many atoms,
+  // not for accurate contact dynamics.
+  class RigidBodyBackend : public Backend
+  {
+  public:
+    RigidBodyBackend();
+
+    // Load the simulation parameters
+    // All of these are optional:
+    //   <gravity>0 0 -9.81</gravity>
+    //   <ground>true</ground>
+    //   <contact_stiffness>2000</contact_stiffness>
+    //   <contact_damping>10</contact_damping>
+    //   <contact_scale>0.5</contact_scale>
+    //   <friction>0.5</friction>
+    //   <linear_damping>0</linear_damping>
+    //   <angular_damping>0</angular_damping>
+    void load(sdf::ElementPtr sdf);
+
+    // Simulate an atom with a body at the given pose in the world frame
+    void addBody(const Atom &atom, const RigidBodyParams &params, const KDL::Frame &pose);
+
+    // Get the body parameters from the inertial and collision elements of
+    // an SDF link
+    static void getBodyParams(sdf::ElementPtr link_elem, RigidBodyParams &params);
+
+    // Advance the simulation by one step, applying the wrenches which were
+    // added since the last step
+    void step(double timestep);
+
+    // Get the number of welded bodies
+    size_t getClusterCount();
+
+    virtual void getAtomState(const Atom &atom, AtomState &atom_state);
+    virtual void applyWrench(const Atom &atom, const KDL::Wrench &wrench);
+    virtual ConstraintPtr createConstraint(const Mate &mate);
+    virtual void releaseConstraint(const Mate &mate, const ConstraintPtr &constraint);
+
+  private:
+    friend class RigidBodyConstraint;
+
+    struct Body
+    {
+      RigidBodyParams params;
+      // Pose of the body frame in the world frame
+      KDL::Frame pose;
+      // Velocity of the center of mass and angular velocity in the world frame
+      KDL::Vector vel;
+      KDL::Vector rot;
+      // Wrench about the center of mass to be applied on the next step
+      KDL::Wrench wrench;
+      // Wrench applied by the welds on the last step
+      KDL::Wrench constraint_wrench;
+      // Contact sphere radius
+      double radius;
+      // Index of the welded cluster this body belongs to
+      size_t cluster;
+    };
+
+    // Weld two bodies together or release a weld
+    void weld(size_t female_id, size_t male_id);
+    void unweld(size_t female_id, size_t male_id);
+
+    // Recompute the welded clusters after the welds change
+    void buildClusters();
+    size_t findRoot(size_t id);
+
+    // Add the contact wrenches to the bodies
+    void addContactWrenches();
+    // Add the wrenches from one contact, where the normal points from the
+    // other body (or the ground, if it's NULL) towards the body
+    void addContactWrench(
+        Body &body,
+        Body *other,
+        const KDL::Vector &point,
+        const KDL::Vector &normal,
+        double penetration);
+
+    // Integrate one cluster of welded bodies
+    void integrateCluster(const std::vector<size_t> &members, double timestep);
+
+    // Bodies indexed by atom id
+    std::vector<Body> bodies_;
+
+    // Pairs of welded body ids, one for each attached constraint
+    std::vector<std::pair<size_t, size_t> > welds_;
+    bool clusters_dirty_;
+    std::vector<size_t> roots_;
+    std::vector<std::vector<size_t> > clusters_;
+
+    // Broad phase for the contact spheres
+    SpatialHash contact_hash_;
+    std::vector<size_t> contact_query_;
+    double max_radius_;
+
+    // Simulation parameters
+    KDL::Vector gravity_;
+    bool ground_;
+    double contact_stiffness_;
+    double contact_damping_;
+    double contact_scale_;
+    double friction_;
+    double linear_damping_;
+    double angular_damping_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_RIGID_BODY_BACKEND_H__
@@ -0,0 +1,1261 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include <boost/make_shared.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
+
+#include <kdl/frames_io.hpp>
+
+#include "soup.h"
+
+namespace assembly_sim
+{
+
+  Soup::Soup() :
+    mate_id_counter_(0),
+    atom_id_counter_(0),
+    initialized_(false),
+    activation_margin_(0.01),
+    activation_radius_(0.0),
+    broad_phase_radius_(0.0),
+    mate_queue_capacity_(0),
+    dropped_mate_events_(0),
+    load_threads_(std::max(boost::thread::hardware_concurrency(), 1U)),
+    check_threads_(1),
+    worker_threads_(1),
+    deterministic_(false)
+  {
+  }
+
+  Soup::~Soup()
+  {
+    update_workers_.stop();
+    check_workers_.stop();
+  }
+
+  bool Soup::load(sdf::ElementPtr sdf, BackendPtr backend)
+  {
+    ASSEMBLY_PROFILE("load/models");
+
+    backend_ = backend;
+
+    // Set up the log filters first so they apply to everything below
+    if(sdf->HasElement("logging")) {
+      Logger::instance().configure(sdf->GetElement("logging"));
+    }
+
+    // number of threads used to compute mate interactions each tick
+    if(sdf->HasElement("worker_threads")) {
+      sdf::ElementPtr worker_threads_elem = sdf->GetElement("worker_threads");
+      worker_threads_elem->GetValue()->Get(worker_threads_);
+      worker_threads_ = std::max(worker_threads_, 1);
+    }
+
+    // number of threads used to check the candidate mates for state changes
+    if(sdf->HasElement("check_threads")) {
+      sdf::ElementPtr check_threads_elem = sdf->GetElement("check_threads");
+      check_threads_elem->GetValue()->Get(check_threads_);
+      check_threads_ = std::max(check_threads_, 1);
+    }
+
+    // distance beyond their interaction radius at which mates stop being
+    // updated every tick
+    if(sdf->HasElement("activation_margin")) {
+      sdf::ElementPtr activation_margin_elem = sdf->GetElement("activation_margin");
+      activation_margin_elem->GetValue()->Get(activation_margin_);
+      activation_margin_ = std::max(activation_margin_, 0.0);
+    }
+
+    // number of threads used to create the mates
+    if(sdf->HasElement("load_threads")) {
+      sdf::ElementPtr load_threads_elem = sdf->GetElement("load_threads");
+      load_threads_elem->GetValue()->Get(load_threads_);
+      load_threads_ = std::max(load_threads_, 1);
+    }
+
+    // process the mates reproducibly
+    if(sdf->HasElement("deterministic")) {
+      sdf::ElementPtr deterministic_elem = sdf->GetElement("deterministic");
+      deterministic_elem->GetValue()->Get(deterministic_);
+    }
+
+    ASSEMBLY_INFO(LOG_LOAD, "Getting mate types...");
+    // Get the description of the mates in this soup
+    sdf::ElementPtr mate_elem = sdf->GetElement("mate_model");
+
+    while(mate_elem && mate_elem->GetName() == "mate_model")
+    {
+      // Create a new mate model
+      std::string model;
+      if(mate_elem->HasAttribute("model")) {
+        mate_elem->GetAttribute("model")->Get(model);
+      } else {
+        ASSEMBLY_ERROR(LOG_LOAD, "No mate model type for mate model");
+        return false;
+      }
+
+      // Get the model name
+      std::string mate_model_type;
+      if(mate_elem->HasAttribute("type")) {
+        mate_elem->GetAttribute("type")->Get(mate_model_type);
+      } else {
+        ASSEMBLY_ERROR(LOG_LOAD, "No mate type for mate model");
+        return false;
+      }
+
+      if(mate_models_.find(mate_model_type) == mate_models_.end()) {
+        // Determine the type of mate model
+        ASSEMBLY_DEBUG(LOG_LOAD, "Adding mate model for "<<mate_model_type);
+
+        // Store this mate model
+        MateModelPtr mate_model = boost::make_shared<MateModel>(mate_model_type, mate_elem, backend_);
+        mate_model->id = mate_factories_.size();
+        mate_models_[mate_model->type] = mate_model;
+
+        // Create a mate factory
+        MateFactoryBasePtr mate_factory;
+        if(model == "proximity") {
+          mate_factory = boost::make_shared<MateFactory<ProximityMate> >(mate_model);
+        } else if(model == "dipole") {
+          mate_factory = boost::make_shared<MateFactory<DipoleMate> >(mate_model);
+        } else {
+          ASSEMBLY_ERROR(LOG_LOAD, "\""<<model<<"\" is not a valid model type");
+          return false;
+        }
+        if(not mate_model->params->isValid()) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Invalid parameters for mate model "<<mate_model_type);
+          return false;
+        }
+        mate_factories_.push_back(mate_factory);
+      }
+
+      // Get the next atom element
+      mate_elem = mate_elem->GetNextElement(mate_elem->GetName());
+    }
+
+    ASSEMBLY_INFO(LOG_LOAD, "Getting atom models...");
+    // Get the description of the atoms in this soup
+    sdf::ElementPtr atom_elem = sdf->GetElement("atom_model");
+
+    while(atom_elem && atom_elem->GetName() == "atom_model")
+    {
+      // Create a new atom
+      AtomModelPtr atom_model = boost::make_shared<AtomModel>();
+      atom_elem->GetAttribute("type")->Get(atom_model->type);
+
+      // Get the atom mate points
+      sdf::ElementPtr mate_elem = atom_elem->GetElement("mate_point");
+      while(mate_elem)
+      {
+        std::string type;
+        std::string gender;
+        KDL::Frame base_pose;
+
+        mate_elem->GetAttribute("type")->Get(type);
+        mate_elem->GetAttribute("gender")->Get(gender);
+        to_kdl(mate_elem->GetElement("pose"), base_pose);
+
+        ASSEMBLY_DEBUG(LOG_LOAD, "Adding mate point type: "<<type<<" gender: "<<gender<<" at: "<<base_pose);
+
+        MateModelPtr mate_model = mate_models_[type];
+
+        if(not mate_model) {
+          ASSEMBLY_ERROR(LOG_LOAD, "No mate model for type: "<<type);
+          break;
+        }
+
+        MatePoint mate_point;
+        mate_point.model = mate_model;
+        mate_point.id =
+          atom_model->female_mate_points.size()
+          + atom_model->male_mate_points.size();
+
+        if(mate_point.id >= MAX_MATE_POINTS) {
+          ASSEMBLY_ERROR(LOG_LOAD, "Atom model "<<atom_model->type<<" has more than "<<MAX_MATE_POINTS<<" mate points");
+          return false;
+        }
+
+        if(boost::iequals(gender, "female")) {
+#if 0
+          for(std::vector<KDL::Frame>::iterator pose_it = mate_model->symmetries.begin();
+              pose_it != mate_model->symmetries.end();
+              ++pose_it)
+          {
+            mate_point.pose = base_pose * (*pose_it);
+            mate_point.id =
+              atom_model->female_mate_points.size()
+              + atom_model->male_mate_points.size();
+
+            ASSEMBLY_DEBUG(LOG_LOAD, "Adding female mate point "<<atom_model->type<<"#"<<mate_point.id<<" pose: "<<mate_point.pose);
+
+            atom_model->female_mate_points.push_back(mate_point_arena_.push_back(mate_point));
+          }
+#else
+          mate_point.pose = base_pose;
+
+          ASSEMBLY_DEBUG(LOG_LOAD, "Adding female mate point "<<atom_model->type<<"#"<<mate_point.id<<" pose: "<<mate_point.pose);
+
+          atom_model->female_mate_points.push_back(mate_point_arena_.push_back(mate_point));
+#endif
+        } else if(boost::iequals(gender, "male")) {
+          mate_point.pose = base_pose;
+
+          ASSEMBLY_DEBUG(LOG_LOAD, "Adding male mate point "<<atom_model->type<<"#"<<mate_point.id<<" pose: "<<mate_point.pose);
+
+          atom_model->male_mate_points.push_back(mate_point_arena_.push_back(mate_point));
+        } else {
+          ASSEMBLY_ERROR(LOG_LOAD, "Unknown gender: "<<gender);
+        }
+
+        // Get the next mate point element
+        mate_elem = mate_elem->GetNextElement(mate_elem->GetName());
+      }
+
+      // Store this atom
+      atom_models_[atom_model->type] = atom_model;
+
+      // Get the next atom element
+      atom_elem = atom_elem->GetNextElement(atom_elem->GetName());
+    }
+
+    return true;
+  }
+
+  AtomModelPtr Soup::getAtomModel(const std::string &name) const
+  {
+    // Scoped names (model::link) are typed by the link name
+    const std::string::size_type scope = name.rfind("::");
+    const std::string link_name = (scope == std::string::npos) ? name : name.substr(scope + 2);
+
+    // Determine the atom type from the name
+    for(std::map<std::string, AtomModelPtr>::const_iterator model_it=atom_models_.begin();
+        model_it != atom_models_.end();
+        ++model_it)
+    {
+      if(link_name.find(model_it->second->type) == 0) {
+        return model_it->second;
+      }
+    }
+
+    return AtomModelPtr();
+  }
+
+  AtomPtr Soup::getAtom(const std::string &name) const
+  {
+    boost::unordered_map<std::string, AtomPtr>::const_iterator it = atom_names_.find(name);
+    return (it == atom_names_.end()) ? NULL : it->second;
+  }
+
+  AtomPtr Soup::addAtom(const std::string &name)
+  {
+    ASSEMBLY_DEBUG(LOG_LOAD, "Creating atom for link: "<<name);
+
+    // Create new atom
+    Atom atom;
+    atom.name = name;
+    atom.active = true;
+    atom.model = this->getAtomModel(name);
+
+    // Skip this atom if it doesn't have a model
+    if(not atom.model) {
+      ASSEMBLY_WARN(LOG_LOAD, "Atom "<<atom.name<<" doesn't have a model type!");
+      return NULL;
+    }
+
+    if(atom_names_.count(name)) {
+      ASSEMBLY_WARN(LOG_LOAD, "Atom "<<atom.name<<" is already in the soup!");
+      return NULL;
+    }
+
+    ASSEMBLY_DEBUG(LOG_LOAD, "Atom "<<atom.name<<" is a "<<atom.model->type);
+
+    // Reuse the slot of a removed atom of the same model, so that the ids
+    // stay dense and its mates can be revived
+    AtomPtr new_atom;
+    std::vector<AtomPtr> &free_atoms = free_atoms_[atom.model->type];
+    if(not free_atoms.empty()) {
+      new_atom = free_atoms.back();
+      free_atoms.pop_back();
+      new_atom->name = atom.name;
+      new_atom->active = true;
+    } else {
+      if(atom_id_counter_ >= MAX_ATOMS) {
+        ASSEMBLY_ERROR(LOG_LOAD, "Can't add atom "<<atom.name<<", the soup can't have more than "<<MAX_ATOMS<<" atoms");
+        return NULL;
+      }
+
+      atom.id = atom_id_counter_++;
+      atoms_.push_back(atom_arena_.push_back(atom));
+      new_atom = atoms_.back();
+
+      if(initialized_) {
+        atom_mates_.push_back(std::vector<boost::uint32_t>());
+        atom_wrenches_.push_back(KDL::Wrench::Zero());
+        for(size_t i=0; i < update_worker_data_.size(); i++) {
+          update_worker_data_[i].atom_wrenches.push_back(KDL::Wrench::Zero());
+        }
+      }
+    }
+
+    atom_names_[atom.name] = new_atom;
+
+    // Only create the mates which involve this atom
+    if(initialized_) {
+      this->addAtomMates(new_atom);
+    }
+
+    return new_atom;
+  }
+
+  bool Soup::removeAtom(const AtomPtr &atom, double time)
+  {
+    ASSEMBLY_PROFILE("spawn/remove");
+
+    if(not atom->active) {
+      return false;
+    }
+
+    ASSEMBLY_DEBUG(LOG_LOAD, "Removing atom "<<atom->name);
+
+    atom->active = false;
+    atom_names_.erase(atom->name);
+    free_atoms_[atom->model->type].push_back(atom);
+
+    size_t n_retired = 0;
+    const std::vector<boost::uint32_t> &atom_mates = atom_mates_[atom->id];
+    for(size_t i=0; i < atom_mates.size(); i++)
+    {
+      const boost::uint32_t id = atom_mates[i];
+      if(mate_columns_.lists[id] == RETIRED_MATES) {
+        continue;
+      }
+
+      // This also cancels any update queued by the check thread, which is
+      // skipped when it's popped
+      const MatePtr mate = mates_[id];
+      const Mate::State old_state = mate->state;
+      mate->reset();
+      this->initMateColumns(*mate);
+      this->moveMate(id, RETIRED_MATES);
+      tracked_mates_.erase(mate);
+      n_retired++;
+
+      if(old_state != Mate::MATED) {
+        continue;
+      }
+
+      ASSEMBLY_PROFILE_COUNT("detaches", 1);
+
+      MateEvent event;
+      event.mate_id = mate->id;
+      event.female = mate->female->name;
+      event.male = mate->male->name;
+      event.state = mate->state;
+      event.cause = Mate::REMOVAL;
+      event.mate_error = KDL::Twist::Zero();
+      event.time = time;
+      if(mate_events_ and not mate_events_->push(event)) {
+        dropped_mate_events_++;
+        ASSEMBLY_WARN_THROTTLE(1.0, LOG_MATE, "Mate event queue is full, "<<dropped_mate_events_<<" events dropped");
+      }
+    }
+
+    ASSEMBLY_INFO(LOG_LOAD, "Removed atom "<<atom->name<<" and retired "<<n_retired<<" mates");
+
+    return true;
+  }
+
+  void Soup::init()
+  {
+    ASSEMBLY_PROFILE("load/init");
+
+    const size_t n_models = mate_factories_.size();
+    const boost::uint64_t count_start = get_profile_time();
+
+    WorkerPool load_workers;
+    load_workers.start(load_threads_);
+    const size_t n_load_workers = load_workers.size();
+
+    MateLayout layout;
+    layout.counts.assign(atoms_.size() * n_models, 0);
+    layout.attach_radii.assign(n_load_workers, 0.0);
+    layout.activation_radii.assign(n_load_workers, 0.0);
+
+    // Count the mates of each female atom
+    {
+      ASSEMBLY_PROFILE("load/init/count");
+      load_workers.parallelFor(
+          atoms_.size(),
+          LOAD_GRAIN_SIZE,
+          boost::bind(&Soup::countMates, this, _1, _2, _3, boost::ref(layout)));
+    }
+
+    // Give the mates of each female atom consecutive ids, and consecutive
+    // places in the arena of each factory
+    layout.factory_offsets.resize(layout.counts.size());
+    layout.id_offsets.resize(atoms_.size());
+    std::vector<size_t> factory_counts(n_models, 0);
+    size_t n_mates = 0;
+    for(size_t i=0; i < atoms_.size(); i++) {
+      layout.id_offsets[i] = n_mates;
+      for(size_t j=0; j < n_models; j++) {
+        layout.factory_offsets[i*n_models + j] = factory_counts[j];
+        factory_counts[j] += layout.counts[i*n_models + j];
+        n_mates += layout.counts[i*n_models + j];
+      }
+    }
+    assert(n_mates <= std::numeric_limits<boost::uint32_t>::max());
+
+    for(size_t j=0; j < n_models; j++) {
+      mate_factories_[j]->reserveMates(factory_counts[j]);
+    }
+    mates_.resize(n_mates);
+    mate_columns_.lists.resize(n_mates);
+    mate_columns_.list_positions.resize(n_mates);
+    mate_columns_.female_atoms.resize(n_mates);
+    mate_columns_.male_atoms.resize(n_mates);
+    mate_columns_.female_points.resize(n_mates);
+    mate_columns_.male_anchor_points.resize(n_mates);
+    mate_columns_.interaction_radii.resize(n_mates);
+    mate_lists_[DORMANT_MATES].resize(n_mates);
+
+    // Create the mates of each female atom
+    const boost::uint64_t create_start = get_profile_time();
+    {
+      ASSEMBLY_PROFILE("load/init/create");
+      load_workers.parallelFor(
+          atoms_.size(),
+          LOAD_GRAIN_SIZE,
+          boost::bind(&Soup::createMates, this, _1, _2, _3, boost::ref(layout)));
+    }
+    load_workers.stop();
+
+    for(size_t j=0; j < n_models; j++) {
+      mate_factories_[j]->commitMates(factory_counts[j]);
+    }
+    mate_id_counter_ = n_mates;
+
+    // The broad phase needs to find every mate which could be attached or
+    // could start interacting
+    for(size_t i=0; i < layout.attach_radii.size(); i++) {
+      broad_phase_radius_ = std::max(broad_phase_radius_, layout.attach_radii[i]);
+      activation_radius_ = std::max(activation_radius_, layout.activation_radii[i]);
+    }
+
+    // Index the mates by their atoms and mate points
+    const boost::uint64_t index_start = get_profile_time();
+    {
+      ASSEMBLY_PROFILE("load/init/index");
+      mate_index_.rehash(static_cast<size_t>(n_mates / mate_index_.max_load_factor()) + 1);
+      for(std::vector<MatePtr>::const_iterator it = mates_.begin();
+          it != mates_.end();
+          ++it)
+      {
+        const MatePtr &mate = *it;
+        mate_index_[getMateKey(mate->female, mate->female_mate_point, mate->male, mate->male_mate_point)] = mate;
+      }
+
+      atom_mates_.resize(atoms_.size());
+      for(std::vector<MatePtr>::const_iterator it = mates_.begin();
+          it != mates_.end();
+          ++it)
+      {
+        atom_mates_[(*it)->female->id].push_back((*it)->id);
+        atom_mates_[(*it)->male->id].push_back((*it)->id);
+      }
+    }
+    const boost::uint64_t index_end = get_profile_time();
+
+    ASSEMBLY_INFO(LOG_LOAD, "Created "<<mates_.size()<<" mates between "<<atoms_.size()<<" atoms"
+                  <<" with "<<n_load_workers<<" threads in "<<(index_end - count_start)*1E-9<<"s"
+                  <<" (count: "<<(create_start - count_start)*1E-9<<"s"
+                  <<", create: "<<(index_start - create_start)*1E-9<<"s"
+                  <<", index: "<<(index_end - index_start)*1E-9<<"s)");
+
+    // Estimate the memory held for each mate, including its entries in the
+    // mate list, columns and indices
+    const size_t column_bytes =
+      sizeof(boost::uint8_t) +
+      3 * sizeof(boost::uint32_t) +
+      2 * sizeof(KDL::Vector) +
+      sizeof(double);
+    size_t mate_bytes = 0;
+    for(std::vector<MatePtr>::const_iterator it = mates_.begin();
+        it != mates_.end();
+        ++it)
+    {
+      mate_bytes +=
+        mate_factories_[(*it)->model->id]->getMateSize() +
+        sizeof(MatePtr) + sizeof(boost::uint32_t) +
+        column_bytes +
+        sizeof(std::pair<const boost::uint64_t, MatePtr>) + sizeof(void*) +
+        2 * sizeof(boost::uint32_t);
+    }
+    ASSEMBLY_PROFILE_SET("bytes_per_mate", mates_.empty() ? 0 : mate_bytes / mates_.size());
+    ASSEMBLY_INFO(LOG_LOAD, "Broad phase radius: "<<broad_phase_radius_<<" activation radius: "<<activation_radius_);
+    ASSEMBLY_INFO(LOG_LOAD, "Dipole kernel: "<<getDipoleKernelName());
+    male_mate_point_hash_.setCellSize(std::max(std::max(broad_phase_radius_, activation_radius_), 1E-3));
+    atom_wrenches_.assign(atoms_.size(), KDL::Wrench::Zero());
+
+    ASSEMBLY_INFO(LOG_LOAD, "Updating mates with "<<worker_threads_<<" worker threads");
+    update_workers_.start(worker_threads_);
+    update_worker_data_.resize(update_workers_.size());
+    for(size_t i=0; i < update_worker_data_.size(); i++) {
+      update_worker_data_[i].atom_wrenches.assign(atoms_.size(), KDL::Wrench::Zero());
+    }
+
+    ASSEMBLY_INFO(LOG_LOAD, "Checking mates with "<<check_threads_<<" check threads");
+    check_workers_.start(check_threads_);
+    check_worker_data_.resize(check_workers_.size());
+
+    mate_queue_capacity_ = std::max(mates_.size(), size_t(1));
+    mate_update_queue_.reset(new MateUpdateQueue(mate_queue_capacity_));
+    mate_activation_queue_.reset(new MateActivationQueue(mate_queue_capacity_));
+
+    initialized_ = true;
+  }
+
+  void Soup::captureAtomStates(AtomStateVector &atom_states)
+  {
+    ASSEMBLY_PROFILE("physics/capture");
+
+    for(std::vector<AtomPtr>::iterator it = atoms_.begin();
+        it != atoms_.end();
+        ++it)
+    {
+      if((*it)->active) {
+        backend_->getAtomState(**it, atom_states[(*it)->id]);
+      }
+    }
+  }
+
+  void Soup::queueUpdates(const AtomStateVector &atom_states)
+  {
+    ASSEMBLY_PROFILE("check");
+
+    // Get the mates which are close enough to change state
+    {
+      ASSEMBLY_PROFILE("check/broad_phase");
+      this->getMateCandidates(atom_states, mate_candidates_);
+    }
+    ASSEMBLY_PROFILE_COUNT("broad_phase_candidates", mate_candidates_.size());
+
+    // Hand the mates which could start interacting to the physics thread
+    // If the queue is full, they're found again by the next pass
+    for(std::vector<MatePtr>::iterator it_mate = activated_mates_.begin();
+        it_mate != activated_mates_.end();
+        ++it_mate)
+    {
+      if(not mate_activation_queue_->push((*it_mate)->id)) {
+        break;
+      }
+    }
+
+    // The tracked mates come out of a hash set in arbitrary order
+    if(deterministic_) {
+      std::sort(mate_candidates_.begin(), mate_candidates_.end(), mateIdLess);
+    }
+
+    // Check the candidates in parallel, in chunks which idle workers can
+    // steal from busy ones since the cost of a check varies a lot per mate
+    {
+      ASSEMBLY_PROFILE("check/mates");
+      check_workers_.parallelFor(
+          mate_candidates_.size(),
+          CHECK_GRAIN_SIZE,
+          boost::bind(&Soup::checkMates, this, _1, _2, _3, boost::cref(atom_states)));
+    }
+
+    // Collect the results from all workers
+    updated_mates_.clear();
+    for(std::vector<CheckWorkerData>::iterator it = check_worker_data_.begin();
+        it != check_worker_data_.end();
+        ++it)
+    {
+      updated_mates_.insert(updated_mates_.end(), it->updated_mates.begin(), it->updated_mates.end());
+
+      // These mates will only be checked again once the broad phase finds them
+      for(std::vector<MatePtr>::iterator it_mate = it->untracked_mates.begin();
+          it_mate != it->untracked_mates.end();
+          ++it_mate)
+      {
+        tracked_mates_.erase(*it_mate);
+      }
+
+      it->updated_mates.clear();
+      it->untracked_mates.clear();
+    }
+
+    // Which worker checked which mate depends on thread timing
+    if(deterministic_) {
+      std::sort(updated_mates_.begin(), updated_mates_.end(), mateIdLess);
+    }
+
+    // Schedule mates to detach / attach etc
+    for(std::vector<MatePtr>::iterator it_mate = updated_mates_.begin();
+        it_mate != updated_mates_.end();
+        ++it_mate)
+    {
+      // Keep checking this mate until it's detached
+      // This has to be read before the mate is handed to the OnUpdate thread
+      if((*it_mate)->getUpdate() == Mate::MATED) {
+        tracked_mates_.insert(*it_mate);
+      }
+
+      if(not mate_update_queue_->push((*it_mate)->id)) {
+        // This can't happen unless a mate was pushed twice, but if it
+        // does, drop the request so that the mate is checked again
+        ASSEMBLY_ERROR_THROTTLE(1.0, LOG_CHECK, "Mate update queue is full, dropping update for "<<(*it_mate)->getDescription());
+        (*it_mate)->serviceUpdate();
+      }
+    }
+  }
+
+  void Soup::updateConstraints(const AtomStateVector &atom_states, double time)
+  {
+    ASSEMBLY_PROFILE("physics/update_constraints");
+
+    // The check thread doesn't touch mates with pending updates, so their
+    // constraints can be acquired and released here without locking
+    boost::uint32_t id;
+    while(mate_update_queue_->pop(id)) {
+      const MatePtr mate = mates_[id];
+
+      // Skip the updates which were cancelled when an atom was removed
+      if(not mate->needsUpdate()) {
+        continue;
+      }
+
+      // The cause belongs to the check thread again once the update has
+      // been serviced
+      MateEvent event;
+      event.mate_id = mate->id;
+      event.cause = mate->update_cause;
+      event.mate_error = mate->update_error;
+      event.time = time;
+
+      const Mate::State old_state = mate->state;
+      mate->updateConstraints(atom_states);
+      this->updateMateColumns(*mate);
+      event.state = mate->state;
+
+      if(event.state != old_state) {
+        if(event.state == Mate::MATED) {
+          ASSEMBLY_PROFILE_COUNT("attaches", 1);
+        } else if(old_state == Mate::MATED) {
+          ASSEMBLY_PROFILE_COUNT("detaches", 1);
+        }
+      }
+
+      // Remates keep the mate attached, but they still move the constraint
+      if(not mate_events_ or (event.state == old_state and event.cause != Mate::REMATE)) {
+        continue;
+      }
+
+      event.female = mate->female->name;
+      event.male = mate->male->name;
+      if(not mate_events_->push(event)) {
+        dropped_mate_events_++;
+        ASSEMBLY_WARN_THROTTLE(1.0, LOG_MATE, "Mate event queue is full, "<<dropped_mate_events_<<" events dropped");
+      }
+    }
+  }
+
+  void Soup::enableMateEvents(size_t capacity)
+  {
+    mate_events_.reset(new MateEventQueue(std::max(capacity, size_t(1))));
+  }
+
+  bool Soup::popMateEvent(MateEvent &event)
+  {
+    return mate_events_ and mate_events_->pop(event);
+  }
+
+  void Soup::update(double timestep, const AtomStateVector &atom_states)
+  {
+    ASSEMBLY_PROFILE("physics/update");
+
+    // Find the mates which need to be updated
+    {
+      ASSEMBLY_PROFILE("physics/update/active");
+      this->updateActiveMates(atom_states);
+    }
+    ASSEMBLY_PROFILE_SET("active_mates", mate_lists_[ACTIVE_MATES].size());
+    ASSEMBLY_PROFILE_COUNT("interacting_mates", interacting_mates_.size());
+
+    // Compute the mate interactions on all workers
+    update_workers_.run(boost::bind(&Soup::updateMates, this, _1, timestep, boost::cref(atom_states)));
+
+    // Sum the wrenches from each worker in a fixed order so the result
+    // doesn't depend on which worker finished first
+    for(std::vector<UpdateWorkerData>::iterator it = update_worker_data_.begin();
+        it != update_worker_data_.end();
+        ++it)
+    {
+      for(size_t i=0; i < atom_wrenches_.size(); i++) {
+        atom_wrenches_[i] += it->atom_wrenches[i];
+        it->atom_wrenches[i] = KDL::Wrench::Zero();
+      }
+    }
+
+    // Apply one net wrench to each atom
+    this->applyAtomWrenches(atom_wrenches_);
+  }
+
+  template <class Visitor>
+    void Soup::visitMatePairs(const AtomPtr &female_atom, Visitor &visitor) const
+  {
+    // Removed atoms don't get any mates
+    if(not female_atom->active) { return; }
+
+    // Iterate over all female mate points of female link
+    for(std::vector<MatePointPtr>::const_iterator it_fmp = female_atom->model->female_mate_points.begin();
+        it_fmp != female_atom->model->female_mate_points.end();
+        ++it_fmp)
+    {
+      const MatePointPtr &female_mate_point = *it_fmp;
+
+      // Iterate over all other atoms
+      for(std::vector<AtomPtr>::const_iterator it_ma = atoms_.begin();
+          it_ma != atoms_.end();
+          ++it_ma)
+      {
+        const AtomPtr &male_atom = *it_ma;
+
+        // You can't mate with yourself
+        if(male_atom == female_atom or not male_atom->active) { continue; }
+
+        // Iterate over all male mate points of male link
+        for(std::vector<MatePointPtr>::const_iterator it_mmp = male_atom->model->male_mate_points.begin();
+            it_mmp != male_atom->model->male_mate_points.end();
+            ++it_mmp)
+        {
+          const MatePointPtr &male_mate_point = *it_mmp;
+
+          // Skip if the mates are incompatible
+          if(female_mate_point->model != male_mate_point->model) { continue; }
+
+          visitor(female_mate_point, male_atom, male_mate_point);
+        }
+      }
+    }
+  }
+
+  template <class Visitor>
+    void Soup::visitMatePairs(const AtomPtr &female_atom, const AtomPtr &male_atom, Visitor &visitor) const
+  {
+    if(male_atom == female_atom or not female_atom->active or not male_atom->active) { return; }
+
+    for(std::vector<MatePointPtr>::const_iterator it_fmp = female_atom->model->female_mate_points.begin();
+        it_fmp != female_atom->model->female_mate_points.end();
+        ++it_fmp)
+    {
+      for(std::vector<MatePointPtr>::const_iterator it_mmp = male_atom->model->male_mate_points.begin();
+          it_mmp != male_atom->model->male_mate_points.end();
+          ++it_mmp)
+      {
+        // Skip if the mates are incompatible
+        if((*it_fmp)->model != (*it_mmp)->model) { continue; }
+
+        visitor(*it_fmp, male_atom, *it_mmp);
+      }
+    }
+  }
+
+  // Counts the mates of one female atom for each mate model
+  struct Soup::MatePairCounter
+  {
+    size_t *counts;
+
+    void operator()(
+        const MatePointPtr &female_mate_point,
+        const AtomPtr &male_atom,
+        const MatePointPtr &male_mate_point)
+    {
+      counts[female_mate_point->model->id]++;
+    }
+  };
+
+  // Creates the mates of one female atom at their places in the layout
+  struct Soup::MatePairCreator
+  {
+    Soup *soup;
+    AtomPtr female_atom;
+    // the next index in the arena of each factory
+    size_t *factory_indices;
+    boost::uint32_t next_id;
+    double attach_radius;
+    double activation_radius;
+
+    void operator()(
+        const MatePointPtr &female_mate_point,
+        const AtomPtr &male_atom,
+        const MatePointPtr &male_mate_point)
+    {
+      // Construct the mate between these two mate points
+      const size_t model_id = female_mate_point->model->id;
+      MatePtr mate = soup->mate_factories_[model_id]->createMateAt(
+          factory_indices[model_id]++,
+          female_mate_point,
+          male_mate_point,
+          female_atom,
+          male_atom);
+
+      mate->id = next_id++;
+      soup->mates_[mate->id] = mate;
+      soup->initMateColumns(*mate);
+
+      // All mates start dormant until the proximity pass finds them
+      soup->mate_columns_.lists[mate->id] = DORMANT_MATES;
+      soup->mate_columns_.list_positions[mate->id] = mate->id;
+      soup->mate_lists_[DORMANT_MATES][mate->id] = mate->id;
+
+      attach_radius = std::max(attach_radius, mate->getAttachRadius());
+      if(mate->getInteractionRadius() > 0.0) {
+        activation_radius = std::max(activation_radius, mate->getInteractionRadius() + soup->activation_margin_);
+      }
+    }
+  };
+
+  void Soup::countMates(
+      size_t worker,
+      size_t begin,
+      size_t end,
+      MateLayout &layout)
+  {
+    const size_t n_models = mate_factories_.size();
+    if(n_models == 0) {
+      return;
+    }
+
+    for(size_t i=begin; i < end; i++) {
+      MatePairCounter counter;
+      counter.counts = &layout.counts[i*n_models];
+      this->visitMatePairs(atoms_[i], counter);
+    }
+  }
+
+  void Soup::createMates(
+      size_t worker,
+      size_t begin,
+      size_t end,
+      MateLayout &layout)
+  {
+    const size_t n_models = mate_factories_.size();
+    if(n_models == 0) {
+      return;
+    }
+
+    for(size_t i=begin; i < end; i++) {
+      ASSEMBLY_DEBUG(LOG_LOAD, "Inspecting female atom: "<<atoms_[i]->name);
+
+      MatePairCreator creator;
+      creator.soup = this;
+      creator.female_atom = atoms_[i];
+      creator.factory_indices = &layout.factory_offsets[i*n_models];
+      creator.next_id = layout.id_offsets[i];
+      creator.attach_radius = layout.attach_radii[worker];
+      creator.activation_radius = layout.activation_radii[worker];
+
+      this->visitMatePairs(atoms_[i], creator);
+
+      layout.attach_radii[worker] = creator.attach_radius;
+      layout.activation_radii[worker] = creator.activation_radius;
+    }
+  }
+
+  // Adds the mates of one female atom which are missing
+  struct Soup::MatePairAdder
+  {
+    Soup *soup;
+    AtomPtr female_atom;
+
+    void operator()(
+        const MatePointPtr &female_mate_point,
+        const AtomPtr &male_atom,
+        const MatePointPtr &male_mate_point)
+    {
+      soup->addMate(female_atom, female_mate_point, male_atom, male_mate_point);
+    }
+  };
+
+  // Move the mates in a queue to a new queue with the given capacity
+  static void grow_mate_queue(
+      boost::scoped_ptr<boost::lockfree::spsc_queue<boost::uint32_t> > &queue,
+      size_t capacity)
+  {
+    boost::scoped_ptr<boost::lockfree::spsc_queue<boost::uint32_t> > new_queue(
+        new boost::lockfree::spsc_queue<boost::uint32_t>(capacity));
+
+    boost::uint32_t id;
+    while(queue->pop(id)) {
+      new_queue->push(id);
+    }
+
+    queue.swap(new_queue);
+  }
+
+  void Soup::addAtomMates(const AtomPtr &atom)
+  {
+    ASSEMBLY_PROFILE("spawn/mates");
+
+    const size_t n_mates = mates_.size();
+
+    // Mates with this atom as the female
+    MatePairAdder adder;
+    adder.soup = this;
+    adder.female_atom = atom;
+    this->visitMatePairs(atom, adder);
+
+    // Mates with this atom as the male
+    for(std::vector<AtomPtr>::const_iterator it_fa = atoms_.begin();
+        it_fa != atoms_.end();
+        ++it_fa)
+    {
+      adder.female_atom = *it_fa;
+      this->visitMatePairs(*it_fa, atom, adder);
+    }
+
+    ASSEMBLY_INFO(LOG_LOAD, "Added atom "<<atom->name<<" with "<<mates_.size() - n_mates<<" new mates");
+
+    // The broad phase radius only changes if this is the first atom with
+    // some type of mate
+    male_mate_point_hash_.setCellSize(std::max(std::max(broad_phase_radius_, activation_radius_), 1E-3));
+
+    // The queues need room for every mate
+    if(mates_.size() > mate_queue_capacity_) {
+      mate_queue_capacity_ = std::max(mates_.size(), 2 * mate_queue_capacity_);
+      grow_mate_queue(mate_update_queue_, mate_queue_capacity_);
+      grow_mate_queue(mate_activation_queue_, mate_queue_capacity_);
+    }
+  }
+
+  void Soup::addMate(
+      const AtomPtr &female_atom,
+      const MatePointPtr &female_mate_point,
+      const AtomPtr &male_atom,
+      const MatePointPtr &male_mate_point)
+  {
+    const boost::uint64_t key = getMateKey(female_atom, female_mate_point, male_atom, male_mate_point);
+
+    // Revive the mate from when both of these slots were last in use
+    boost::unordered_map<boost::uint64_t, MatePtr>::iterator it_mate = mate_index_.find(key);
+    if(it_mate != mate_index_.end()) {
+      if(mate_columns_.lists[it_mate->second->id] == RETIRED_MATES) {
+        this->moveMate(it_mate->second->id, DORMANT_MATES);
+      }
+      return;
+    }
+
+    MatePtr mate = mate_factories_[female_mate_point->model->id]->createMate(
+        female_mate_point,
+        male_mate_point,
+        female_atom,
+        male_atom);
+
+    mate->id = mate_id_counter_++;
+    mates_.push_back(mate);
+    mate_index_[key] = mate;
+    atom_mates_[female_atom->id].push_back(mate->id);
+    atom_mates_[male_atom->id].push_back(mate->id);
+
+    const size_t n_mates = mates_.size();
+    mate_columns_.lists.resize(n_mates);
+    mate_columns_.list_positions.resize(n_mates);
+    mate_columns_.female_atoms.resize(n_mates);
+    mate_columns_.male_atoms.resize(n_mates);
+    mate_columns_.female_points.resize(n_mates);
+    mate_columns_.male_anchor_points.resize(n_mates);
+    mate_columns_.interaction_radii.resize(n_mates);
+    this->initMateColumns(*mate);
+
+    // New mates start dormant like the ones created by init()
+    mate_columns_.lists[mate->id] = DORMANT_MATES;
+    mate_columns_.list_positions[mate->id] = mate_lists_[DORMANT_MATES].size();
+    mate_lists_[DORMANT_MATES].push_back(mate->id);
+
+    broad_phase_radius_ = std::max(broad_phase_radius_, mate->getAttachRadius());
+    if(mate->getInteractionRadius() > 0.0) {
+      activation_radius_ = std::max(activation_radius_, mate->getInteractionRadius() + activation_margin_);
+    }
+  }
+
+  void Soup::initMateColumns(const Mate &mate)
+  {
+    mate_columns_.female_atoms[mate.id] = mate.female->id;
+    mate_columns_.male_atoms[mate.id] = mate.male->id;
+    mate_columns_.female_points[mate.id] = mate.female_mate_point->pose.p;
+    mate_columns_.male_anchor_points[mate.id] = (mate.male_mate_point->pose * mate.anchor_offset).p;
+    mate_columns_.interaction_radii[mate.id] = mate.getInteractionRadius();
+  }
+
+  void Soup::updateMateColumns(const Mate &mate)
+  {
+    mate_columns_.male_anchor_points[mate.id] = (mate.male_mate_point->pose * mate.anchor_offset).p;
+
+    // Detached mates are still close, so they're active until the next
+    // tick finds out otherwise
+    const MateList list = static_cast<MateList>(mate_columns_.lists[mate.id]);
+    if(mate.state == Mate::MATED) {
+      if(list != MATED_MATES) {
+        this->moveMate(mate.id, MATED_MATES);
+      }
+    } else if(list == MATED_MATES) {
+      this->moveMate(mate.id, mate_columns_.interaction_radii[mate.id] > 0.0 ? ACTIVE_MATES : DORMANT_MATES);
+    }
+  }
+
+  void Soup::moveMate(boost::uint32_t id, MateList list)
+  {
+    // Fill the mate's slot in its current list with the last mate in it
+    std::vector<boost::uint32_t> &old_list = mate_lists_[mate_columns_.lists[id]];
+    const boost::uint32_t position = mate_columns_.list_positions[id];
+    old_list[position] = old_list.back();
+    mate_columns_.list_positions[old_list[position]] = position;
+    old_list.pop_back();
+
+    mate_columns_.lists[id] = list;
+    mate_columns_.list_positions[id] = mate_lists_[list].size();
+    mate_lists_[list].push_back(id);
+  }
+
+  void Soup::updateActiveMates(const AtomStateVector &atom_states)
+  {
+    const MateColumns &columns = mate_columns_;
+
+    // Activate the dormant mates found by the proximity pass
+    boost::uint32_t activated_id;
+    while(mate_activation_queue_->pop(activated_id)) {
+      if(columns.lists[activated_id] == DORMANT_MATES) {
+        this->moveMate(activated_id, ACTIVE_MATES);
+      }
+    }
+
+    // Find the active mates which are interacting, and make the ones which
+    // have moved apart dormant
+    interacting_mates_.clear();
+    std::vector<boost::uint32_t> &active_mates = mate_lists_[ACTIVE_MATES];
+    for(size_t i=0; i < active_mates.size(); )
+    {
+      const boost::uint32_t id = active_mates[i];
+      const KDL::Vector female_point = atom_states[columns.female_atoms[id]].pose * columns.female_points[id];
+      const KDL::Vector male_point = atom_states[columns.male_atoms[id]].pose * columns.male_anchor_points[id];
+      const double distance = (male_point - female_point).Norm();
+
+      if(distance > columns.interaction_radii[id] + activation_margin_) {
+        // This moves another mate into slot i
+        this->moveMate(id, DORMANT_MATES);
+        continue;
+      }
+
+      if(distance <= columns.interaction_radii[id]) {
+        interacting_mates_.push_back(id);
+      }
+      i++;
+    }
+
+    // The active list is in the order the mates were activated and moved
+    if(deterministic_) {
+      std::sort(interacting_mates_.begin(), interacting_mates_.end());
+    }
+  }
+
+  boost::uint64_t Soup::getMateKey(
+      const AtomPtr &female_atom,
+      const MatePointPtr &female_mate_point,
+      const AtomPtr &male_atom,
+      const MatePointPtr &male_mate_point)
+  {
+    // 24 bits for each atom id and 8 bits for each mate point id, which
+    // load() and addAtom() enforce
+    assert(female_atom->id < MAX_ATOMS and male_atom->id < MAX_ATOMS);
+    assert(female_mate_point->id < MAX_MATE_POINTS and male_mate_point->id < MAX_MATE_POINTS);
+
+    return
+      (static_cast<boost::uint64_t>(female_atom->id) << 40) |
+      (static_cast<boost::uint64_t>(female_mate_point->id) << 32) |
+      (static_cast<boost::uint64_t>(male_atom->id) << 8) |
+      (static_cast<boost::uint64_t>(male_mate_point->id));
+  }
+
+  void Soup::getMateCandidates(
+      const AtomStateVector &atom_states,
+      std::vector<MatePtr> &candidates)
+  {
+    // Mates which are (or are about to be) mated are always checked so that
+    // they can be detached no matter how far apart their atoms are pulled
+    candidates.assign(tracked_mates_.begin(), tracked_mates_.end());
+
+    activated_mates_.clear();
+
+    // Hash the world positions of all male mate points
+    male_mate_point_hash_.clear();
+    hashed_mate_points_.clear();
+
+    for(std::vector<AtomPtr>::iterator it_ma = atoms_.begin();
+        it_ma != atoms_.end();
+        ++it_ma)
+    {
+      const AtomPtr &male_atom = *it_ma;
+      if(not male_atom->active) { continue; }
+      const KDL::Frame &male_atom_frame = atom_states[male_atom->id].pose;
+
+      const std::vector<MatePointPtr> &male_mate_points = male_atom->model->male_mate_points;
+      for(size_t i=0; i < male_mate_points.size(); i++) {
+        HashedMatePoint hashed_mate_point;
+        hashed_mate_point.atom_id = male_atom->id;
+        hashed_mate_point.index = i;
+        hashed_mate_point.position = male_atom_frame * male_mate_points[i]->pose.p;
+
+        male_mate_point_hash_.insert(hashed_mate_point.position, hashed_mate_points_.size());
+        hashed_mate_points_.push_back(hashed_mate_point);
+      }
+    }
+
+    male_mate_point_hash_.build();
+
+    // Find the male mate points near each female mate point
+    const double query_radius = std::max(broad_phase_radius_, activation_radius_);
+    for(std::vector<AtomPtr>::iterator it_fa = atoms_.begin();
+        it_fa != atoms_.end();
+        ++it_fa)
+    {
+      const AtomPtr &female_atom = *it_fa;
+      if(not female_atom->active) { continue; }
+      const KDL::Frame &female_atom_frame = atom_states[female_atom->id].pose;
+
+      for(std::vector<MatePointPtr>::iterator it_fmp = female_atom->model->female_mate_points.begin();
+          it_fmp != female_atom->model->female_mate_points.end();
+          ++it_fmp)
+      {
+        const MatePointPtr &female_mate_point = *it_fmp;
+
+        // Symmetries only rotate the mate frame, so the distance between the
+        // mate point origins bounds the linear mate error
+        const KDL::Vector female_position = female_atom_frame * female_mate_point->pose.p;
+        hash_query_.clear();
+        male_mate_point_hash_.query(
+            female_position,
+            query_radius,
+            hash_query_);
+
+        for(std::vector<size_t>::iterator it_q = hash_query_.begin();
+            it_q != hash_query_.end();
+            ++it_q)
+        {
+          const HashedMatePoint &hashed_mate_point = hashed_mate_points_[*it_q];
+          const AtomPtr &male_atom = atoms_[hashed_mate_point.atom_id];
+          const MatePointPtr &male_mate_point = male_atom->model->male_mate_points[hashed_mate_point.index];
+
+          // You can't mate with yourself
+          if(male_atom == female_atom) { continue; }
+
+          // Skip if the mates are incompatible
+          if(female_mate_point->model != male_mate_point->model) { continue; }
+
+          boost::unordered_map<boost::uint64_t, MatePtr>::iterator it_mate =
+            mate_index_.find(getMateKey(female_atom, female_mate_point, male_atom, male_mate_point));
+
+          // Skip mates which are already being checked
+          if(it_mate == mate_index_.end() or tracked_mates_.count(it_mate->second)) { continue; }
+
+          const MatePtr &mate = it_mate->second;
+          const double distance = (hashed_mate_point.position - female_position).Norm();
+
+          if(distance <= broad_phase_radius_) {
+            candidates.push_back(mate);
+          }
+
+          const double interaction_radius = mate_columns_.interaction_radii[mate->id];
+          if(interaction_radius > 0.0 and distance <= interaction_radius + activation_margin_) {
+            activated_mates_.push_back(mate);
+          }
+        }
+      }
+    }
+  }
+
+  void Soup::updateMates(
+      size_t worker,
+      double timestep,
+      const AtomStateVector &atom_states)
+  {
+    UpdateWorkerData &data = update_worker_data_[worker];
+    data.dipole_batch.clear();
+
+    // Update this worker's share of the interacting mates
+    size_t begin, end;
+    update_workers_.getRange(worker, interacting_mates_.size(), begin, end);
+    {
+      ASSEMBLY_PROFILE("physics/update/mates");
+      for(size_t i=begin; i < end; i++) {
+        const MatePtr mate = mates_[interacting_mates_[i]];
+        ASSEMBLY_PROFILE_DETAILED(mate->model->update_timer);
+        mate->update(timestep, atom_states, data.dipole_batch);
+      }
+    }
+
+    // Compute the dipole interactions for all of these mates at once
+    ASSEMBLY_PROFILE("physics/update/dipole_kernel");
+    computeDipoleWrenches(data.dipole_batch);
+    accumulateDipoleWrenches(data.dipole_batch, atom_states, data.atom_wrenches);
+  }
+
+  void Soup::checkMates(
+      size_t worker,
+      size_t begin,
+      size_t end,
+      const AtomStateVector &atom_states)
+  {
+    CheckWorkerData &data = check_worker_data_[worker];
+    size_t n_checked = 0;
+
+    for(size_t i=begin; i < end; i++)
+    {
+      const MatePtr &mate = mate_candidates_[i];
+
+      // Check if this mate is already scheduled to be updated
+      if(mate->needsUpdate()) {
+        continue;
+      }
+
+      // Queue any updates
+      {
+        ASSEMBLY_PROFILE_DETAILED(mate->model->check_timer);
+        mate->queueUpdate(atom_states);
+      }
+      n_checked++;
+
+      if(mate->needsUpdate()) {
+        data.updated_mates.push_back(mate);
+      } else if(mate->state == Mate::UNMATED) {
+        data.untracked_mates.push_back(mate);
+      }
+    }
+
+    ASSEMBLY_PROFILE_COUNT("mates_checked", n_checked);
+  }
+
+  void Soup::applyAtomWrenches(AtomWrenchVector &atom_wrenches)
+  {
+    for(std::vector<AtomPtr>::iterator it = atoms_.begin();
+        it != atoms_.end();
+        ++it)
+    {
+      KDL::Wrench &wrench = atom_wrenches[(*it)->id];
+
+      // Skip atoms which aren't interacting with anything
+      // Removed atoms have no interacting mates, so they're skipped too
+      if(wrench.force == KDL::Vector::Zero() and wrench.torque == KDL::Vector::Zero()) {
+        continue;
+      }
+
+      // Forces are applied at the center of mass
+      backend_->applyWrench(**it, wrench);
+
+      wrench = KDL::Wrench::Zero();
+    }
+  }
+}
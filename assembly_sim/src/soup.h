@@ -0,0 +1,349 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_SOUP_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_SOUP_H__
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <boost/scoped_ptr.hpp>
+
+#include <sdf/sdf.hh>
+
+#include "arena.h"
+#include "models.h"
+#include "backend.h"
+#include "atom_state.h"
+#include "spatial_hash.h"
+#include "worker_pool.h"
+
+namespace assembly_sim {
+
+  // A change in the attachment state of a mate
+  struct MateEvent
+  {
+    boost::uint32_t mate_id;
+    // Names of the atoms when the change was made, since the mate can be
+    // reused by other atoms before the event is read
+    std::string female;
+    std::string male;
+    // The state of the mate after the change
+    Mate::State state;
+    Mate::Cause cause;
+    // The mate error when the change was requested
+    KDL::Twist mate_error;
+    // Sim time at which the change was made
+    double time;
+  };
+
+  // A soup of atoms and all of the potential mates between them, along with
+  // the pipeline which checks the mates for state changes and computes their
+  // interactions. The physics engine is only reached through a Backend, so
+  // this doesn't depend on Gazebo.
+  //
+  // queueUpdates() is meant to be called from a check thread, and the other
+  // per-tick functions from the physics thread. Atoms can be added and
+  // removed after init() from the physics thread, but not while
+  // queueUpdates() is running.
+  class Soup
+  {
+  public:
+    Soup();
+    ~Soup();
+
+    // Load the soup parameters and the mate and atom models
+    bool load(sdf::ElementPtr sdf, BackendPtr backend);
+
+    // Add an atom for the backend body with the given name
+    // The atom type is the atom model whose type prefixes the name. If there
+    // is no such model, or there's already an atom with this name, no atom
+    // is added and NULL is returned.
+    //
+    // After init(), only the mates between this atom and the others are
+    // created, and the slot of a removed atom of the same model is reused
+    // along with its mates if there is one.
+    AtomPtr addAtom(const std::string &name);
+
+    // Remove an atom from the soup
+    // Its mates are detached at the given sim time and no longer checked or
+    // updated. Returns false if the atom was already removed.
+    bool removeAtom(const AtomPtr &atom, double time);
+
+    // Get the atom with the given name, or NULL if it isn't in the soup
+    AtomPtr getAtom(const std::string &name) const;
+
+    // Get the model of the atom for the body with the given name, or NULL
+    // The models don't change after load(), so this can be called from any
+    // thread.
+    AtomModelPtr getAtomModel(const std::string &name) const;
+
+    // Create the potential mates between all atoms and start the workers
+    // The mates are created in parallel over the female atoms.
+    void init();
+
+    // Read the state of all atoms from the backend
+    void captureAtomStates(AtomStateVector &atom_states);
+
+    // Check the mates which are close enough to change state and queue
+    // attach/detach requests for the physics thread
+    void queueUpdates(const AtomStateVector &atom_states);
+
+    // Attach and detach the mates with queued requests at the given sim time
+    void updateConstraints(const AtomStateVector &atom_states, double time);
+
+    // Compute the mate interactions and apply them to the atoms
+    void update(double timestep, const AtomStateVector &atom_states);
+
+    // All atoms and mates, indexed by id, including the removed ones
+    const std::vector<AtomPtr> &getAtoms() const { return atoms_; }
+    const std::vector<MatePtr> &getMates() const { return mates_; }
+
+    // Mates which were checked by the last call to queueUpdates()
+    const std::vector<MatePtr> &getMateCandidates() const { return mate_candidates_; }
+
+    // Ids of the mates which are attached, and of the mates which were
+    // updated by the last call to update()
+    // These belong to the physics thread.
+    const std::vector<boost::uint32_t> &getMatedMates() const { return mate_lists_[MATED_MATES]; }
+    const std::vector<boost::uint32_t> &getInteractingMates() const { return interacting_mates_; }
+
+    // Record the attachment state changes made by updateConstraints() so
+    // that another thread can read them with popMateEvent()
+    // Events are dropped and counted if more than capacity are waiting.
+    void enableMateEvents(size_t capacity);
+
+    // Get the oldest recorded mate event
+    // Returns false if there are none.
+    bool popMateEvent(MateEvent &event);
+
+    // Whether the mates should be checked at fixed steps in the physics
+    // thread and processed in index order
+    bool isDeterministic() const { return deterministic_; }
+
+  private:
+    BackendPtr backend_;
+
+    boost::uint32_t mate_id_counter_;
+    boost::uint32_t atom_id_counter_;
+
+    std::map<std::string, MateModelPtr> mate_models_;
+    // indexed by mate model id
+    std::vector<MateFactoryBasePtr> mate_factories_;
+    std::map<std::string, AtomModelPtr> atom_models_;
+
+    // storage for all atoms and mate points
+    // the mates are stored by their factories
+    Arena<Atom> atom_arena_;
+    Arena<MatePoint> mate_point_arena_;
+
+    std::vector<AtomPtr> atoms_;
+
+    // atoms which are in the soup, by name
+    boost::unordered_map<std::string, AtomPtr> atom_names_;
+    // removed atoms whose slots can be reused, by atom model type
+    std::map<std::string, std::vector<AtomPtr> > free_atoms_;
+    // whether the mates have been created
+    bool initialized_;
+
+    // all mates, indexed by id
+    std::vector<MatePtr> mates_;
+
+    // the parts of each mate which are read every tick, in columns indexed
+    // by mate id so that a pass over all mates doesn't touch the mates
+    // themselves unless they need to be updated
+    struct MateColumns
+    {
+      // the list which holds each mate, and its index in that list
+      std::vector<boost::uint8_t> lists;
+      std::vector<boost::uint32_t> list_positions;
+      std::vector<boost::uint32_t> female_atoms;
+      std::vector<boost::uint32_t> male_atoms;
+      // the female mate point and the male anchor point (the male mate point
+      // moved by the anchor offset) in their atom frames
+      std::vector<KDL::Vector> female_points;
+      std::vector<KDL::Vector> male_anchor_points;
+      std::vector<double> interaction_radii;
+    };
+    MateColumns mate_columns_;
+    void initMateColumns(const Mate &mate);
+    // copy the state and anchor offset of a mate after they've changed
+    void updateMateColumns(const Mate &mate);
+
+    // mates partitioned by what they do each tick, so that a tick only
+    // touches the mates which are interacting:
+    //  - active mates are unmated and close enough to interact, or nearly
+    //  - mated mates are attached
+    //  - retired mates have an atom which has been removed
+    //  - dormant mates are all others
+    // these belong to the physics thread
+    enum MateList {
+      DORMANT_MATES = 0,
+      ACTIVE_MATES = 1,
+      MATED_MATES = 2,
+      RETIRED_MATES = 3,
+      N_MATE_LISTS = 4
+    };
+    // The lists hold mate ids, which are half the size of pointers
+    std::vector<boost::uint32_t> mate_lists_[N_MATE_LISTS];
+    void moveMate(boost::uint32_t id, MateList list);
+
+    // active mates are only made dormant once they're this much farther
+    // apart than their interaction radius, so that the proximity pass in the
+    // check thread can find them before they're close enough to interact
+    double activation_margin_;
+    double activation_radius_;
+
+    // unmated mates which the proximity pass found within the activation
+    // radius, pushed by the check thread and popped by the physics thread
+    // mates which are already active are ignored when they're popped
+    std::vector<MatePtr> activated_mates_;
+    typedef boost::lockfree::spsc_queue<boost::uint32_t> MateActivationQueue;
+    boost::scoped_ptr<MateActivationQueue> mate_activation_queue_;
+
+    // activate the mates found by the proximity pass, make the mates which
+    // have moved apart dormant, and find the ones which are interacting
+    std::vector<boost::uint32_t> interacting_mates_;
+    void updateActiveMates(const AtomStateVector &atom_states);
+
+    // all mates keyed by their atom and mate point ids
+    // The keys have room for 24-bit atom ids and 8-bit mate point ids, so
+    // atoms and mate points beyond these limits are refused.
+    static const boost::uint32_t MAX_ATOMS = 1 << 24;
+    static const boost::uint32_t MAX_MATE_POINTS = 1 << 8;
+    boost::unordered_map<boost::uint64_t, MatePtr> mate_index_;
+
+    // ids of the mates of each atom, as female or male, indexed by atom id
+    // These are only used to retire the mates of removed atoms.
+    std::vector<std::vector<boost::uint32_t> > atom_mates_;
+    static boost::uint64_t getMateKey(
+        const AtomPtr &female_atom,
+        const MatePointPtr &female_mate_point,
+        const AtomPtr &male_atom,
+        const MatePointPtr &male_mate_point);
+
+    // mates which are mated or have been requested to mate
+    // these are checked every cycle regardless of the broad phase
+    boost::unordered_set<MatePtr> tracked_mates_;
+
+    // broad phase over the world positions of all male mate points
+    SpatialHash male_mate_point_hash_;
+    double broad_phase_radius_;
+    struct HashedMatePoint
+    {
+      boost::uint32_t atom_id;
+      // index in the atom's male mate points
+      boost::uint32_t index;
+      KDL::Vector position;
+    };
+    std::vector<HashedMatePoint> hashed_mate_points_;
+    std::vector<size_t> hash_query_;
+    std::vector<MatePtr> mate_candidates_;
+
+    // find mates whose mate points are within the attach radius, and the
+    // unmated ones within the activation radius
+    void getMateCandidates(
+        const AtomStateVector &atom_states,
+        std::vector<MatePtr> &candidates);
+
+    // mates to attach/detach in the physics thread
+    // this is only pushed by the check thread and only popped by the
+    // physics thread, and it has room for every mate since a mate isn't
+    // pushed again until its pending update has been serviced
+    typedef boost::lockfree::spsc_queue<boost::uint32_t> MateUpdateQueue;
+    boost::scoped_ptr<MateUpdateQueue> mate_update_queue_;
+    // the capacity of the update and activation queues, which are grown
+    // when atoms are added
+    size_t mate_queue_capacity_;
+
+    // state changes, pushed by the physics thread and popped by one reader
+    typedef boost::lockfree::spsc_queue<MateEvent> MateEventQueue;
+    boost::scoped_ptr<MateEventQueue> mate_events_;
+    size_t dropped_mate_events_;
+
+    // number of threads used to create the mates in init()
+    int load_threads_;
+    // number of female atoms which a load worker takes at a time
+    static const size_t LOAD_GRAIN_SIZE = 4;
+
+    // how the mates of each female atom are laid out, so that they can be
+    // created in parallel with the same ids as if they were created in order
+    struct MateLayout
+    {
+      // indexed by female atom id * number of mate models + mate model id
+      std::vector<size_t> counts;
+      std::vector<size_t> factory_offsets;
+      // indexed by female atom id
+      std::vector<size_t> id_offsets;
+      // the largest radii of the mates created by each worker
+      std::vector<double> attach_radii;
+      std::vector<double> activation_radii;
+    };
+    template <class Visitor>
+      void visitMatePairs(const AtomPtr &female_atom, Visitor &visitor) const;
+    struct MatePairCounter;
+    struct MatePairCreator;
+    void countMates(size_t worker, size_t begin, size_t end, MateLayout &layout);
+    void createMates(size_t worker, size_t begin, size_t end, MateLayout &layout);
+
+    // create or revive the mates between an atom added after init() and
+    // the other atoms, one at a time
+    template <class Visitor>
+      void visitMatePairs(const AtomPtr &female_atom, const AtomPtr &male_atom, Visitor &visitor) const;
+    struct MatePairAdder;
+    void addAtomMates(const AtomPtr &atom);
+    void addMate(
+        const AtomPtr &female_atom,
+        const MatePointPtr &female_mate_point,
+        const AtomPtr &male_atom,
+        const MatePointPtr &male_mate_point);
+
+    // workers which check the candidate mates in the check thread
+    WorkerPool check_workers_;
+    int check_threads_;
+    // number of mates which a check worker takes at a time
+    static const size_t CHECK_GRAIN_SIZE = 64;
+
+    // mates whose state changes were found by one check worker
+    struct CheckWorkerData
+    {
+      std::vector<MatePtr> updated_mates;
+      std::vector<MatePtr> untracked_mates;
+    };
+    std::vector<CheckWorkerData> check_worker_data_;
+    std::vector<MatePtr> updated_mates_;
+    void checkMates(
+        size_t worker,
+        size_t begin,
+        size_t end,
+        const AtomStateVector &atom_states);
+
+    // workers which update the mates each tick
+    WorkerPool update_workers_;
+    int worker_threads_;
+
+    // dipole pairs and the resulting atom wrenches for one worker's mates
+    struct UpdateWorkerData
+    {
+      DipoleBatch dipole_batch;
+      AtomWrenchVector atom_wrenches;
+    };
+    std::vector<UpdateWorkerData> update_worker_data_;
+    void updateMates(
+        size_t worker,
+        double timestep,
+        const AtomStateVector &atom_states);
+
+    // net wrench on each atom, applied once at the end of each tick
+    AtomWrenchVector atom_wrenches_;
+    void applyAtomWrenches(AtomWrenchVector &atom_wrenches);
+
+    // process the mates in index order
+    bool deterministic_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_SOUP_H__
@@ -0,0 +1,455 @@
+// Benchmark for the mate pipeline on synthetic soups
+//
+// This loads the soup parameters and atom models from the assembly soup
+// plugin in an SDF file (e.g. gbeam_soup.sdf.xacro run through xacro),
+// generates soups of gbeam_link, gbeam_node and hog atoms with seeded
+// random poses, and times:
+//
+//  - construct: loading the soup and creating all of its mates
+//  - dipole: computing the mate interactions for one tick
+//  - proximity: checking the mates for state changes and servicing them
+//
+// The results are printed to stdout as JSON, one entry per soup size.
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/random/mersenne_twister.hpp>
+#include <boost/random/uniform_real_distribution.hpp>
+#include <boost/random/uniform_int_distribution.hpp>
+#include <boost/random/normal_distribution.hpp>
+
+#include <sdf/sdf.hh>
+
+#include <kdl/frames.hpp>
+
+#include "soup.h"
+
+namespace assembly_sim {
+
+  // A constraint which doesn't constrain anything
+  class BenchmarkConstraint : public Constraint
+  {
+  public:
+    BenchmarkConstraint(const std::string &name) : name_(name) { }
+
+    virtual void attach(const KDL::Frame &anchor_frame) { anchor_ = anchor_frame.p; }
+    virtual void detach() { }
+    virtual KDL::Wrench getWrench() { return KDL::Wrench::Zero(); }
+    virtual KDL::Vector getAnchor() { return anchor_; }
+    virtual const std::string &getName() const { return name_; }
+
+  private:
+    std::string name_;
+    KDL::Vector anchor_;
+  };
+
+  // A backend whose atoms stay where they're put
+  class BenchmarkBackend : public Backend
+  {
+  public:
+    virtual void getAtomState(const Atom &atom, AtomState &atom_state)
+    {
+      atom_state = atom_states[atom.id];
+    }
+
+    virtual void applyWrench(const Atom &atom, const KDL::Wrench &wrench)
+    {
+      atom_wrenches[atom.id] += wrench;
+    }
+
+    virtual ConstraintPtr createConstraint(const Mate &mate)
+    {
+      return boost::make_shared<BenchmarkConstraint>(mate.getDescription());
+    }
+
+    virtual void releaseConstraint(const Mate &mate, const ConstraintPtr &constraint) { }
+
+    AtomStateVector atom_states;
+    AtomWrenchVector atom_wrenches;
+  };
+
+  struct BenchmarkOptions
+  {
+    BenchmarkOptions() :
+      layout("clustered"),
+      iterations(20),
+      seed(0),
+      timestep(0.001),
+      spacing(0.1),
+      jitter(0.02)
+    {
+      atoms.push_back(16);
+      atoms.push_back(32);
+      atoms.push_back(64);
+      atoms.push_back(128);
+    }
+
+    std::string sdf_path;
+    // soup sizes
+    std::vector<size_t> atoms;
+    // "random" or "clustered"
+    std::string layout;
+    // timed passes per soup size
+    int iterations;
+    unsigned int seed;
+    double timestep;
+    // average distance between random atoms
+    double spacing;
+    // maximum position error of clustered mates along each axis
+    double jitter;
+  };
+
+  // Timing statistics over the passes for one soup size, in nanoseconds
+  struct PassStats
+  {
+    double median;
+    double min;
+    // mates checked by each pass
+    size_t candidates;
+  };
+
+  struct BenchmarkResult
+  {
+    size_t atoms;
+    size_t mates;
+    double construct;
+    PassStats dipole;
+    PassStats proximity;
+  };
+
+  static double now_ns()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1E9 + ts.tv_nsec;
+  }
+
+  static PassStats get_stats(std::vector<double> &samples, size_t candidates)
+  {
+    PassStats stats;
+    std::sort(samples.begin(), samples.end());
+    stats.median = samples[samples.size()/2];
+    stats.min = samples.front();
+    stats.candidates = candidates;
+    return stats;
+  }
+
+  // Find the assembly soup plugin element in a world or model
+  static sdf::ElementPtr get_soup_elem(sdf::ElementPtr elem)
+  {
+    if(elem->HasElement("world")) {
+      elem = elem->GetElement("world");
+    }
+    if(elem->HasElement("model")) {
+      elem = elem->GetElement("model");
+    }
+    if(elem->HasElement("plugin")) {
+      return elem->GetElement("plugin");
+    }
+    return sdf::ElementPtr();
+  }
+
+  // Get a uniformly distributed random rotation
+  static KDL::Rotation random_rotation(boost::random::mt19937 &rng)
+  {
+    boost::random::normal_distribution<double> normal;
+    double x = normal(rng), y = normal(rng), z = normal(rng), w = normal(rng);
+    const double norm = std::sqrt(x*x + y*y + z*z + w*w);
+    return KDL::Rotation::Quaternion(x/norm, y/norm, z/norm, w/norm);
+  }
+
+  // Place atoms uniformly in a cube whose size grows with the soup so that
+  // the density of atoms stays the same
+  static void random_layout(
+      const BenchmarkOptions &options,
+      const std::vector<AtomPtr> &atoms,
+      boost::random::mt19937 &rng,
+      AtomStateVector &atom_states)
+  {
+    const double side = options.spacing * std::pow(double(atoms.size()), 1.0/3.0);
+    boost::random::uniform_real_distribution<double> position(0.0, side);
+
+    for(size_t i=0; i < atoms.size(); i++) {
+      atom_states[atoms[i]->id].pose = KDL::Frame(
+          random_rotation(rng),
+          KDL::Vector(position(rng), position(rng), position(rng)));
+    }
+  }
+
+  // Place the atoms with female mate points randomly and put each other
+  // atom next to one of their female mate points, a bit out of alignment,
+  // like a structure which is being assembled
+  static void clustered_layout(
+      const BenchmarkOptions &options,
+      const std::vector<AtomPtr> &atoms,
+      boost::random::mt19937 &rng,
+      AtomStateVector &atom_states)
+  {
+    std::vector<AtomPtr> female_atoms, male_atoms;
+    for(size_t i=0; i < atoms.size(); i++) {
+      if(atoms[i]->model->female_mate_points.size() > 0) {
+        female_atoms.push_back(atoms[i]);
+      } else {
+        male_atoms.push_back(atoms[i]);
+      }
+    }
+
+    random_layout(options, female_atoms, rng, atom_states);
+
+    if(female_atoms.empty()) {
+      random_layout(options, male_atoms, rng, atom_states);
+      return;
+    }
+
+    boost::random::uniform_int_distribution<size_t> female_atom_index(0, female_atoms.size()-1);
+    boost::random::uniform_real_distribution<double> jitter(-options.jitter, options.jitter);
+
+    for(size_t i=0; i < male_atoms.size(); i++) {
+      const AtomPtr &female_atom = female_atoms[female_atom_index(rng)];
+      const AtomPtr &male_atom = male_atoms[i];
+
+      const std::vector<MatePointPtr> &female_mate_points = female_atom->model->female_mate_points;
+      const std::vector<MatePointPtr> &male_mate_points = male_atom->model->male_mate_points;
+      if(male_mate_points.empty()) {
+        continue;
+      }
+
+      boost::random::uniform_int_distribution<size_t> female_mate_point_index(0, female_mate_points.size()-1);
+      boost::random::uniform_int_distribution<size_t> male_mate_point_index(0, male_mate_points.size()-1);
+
+      // Align the mate points, then perturb the male atom
+      const KDL::Frame mated_frame =
+        atom_states[female_atom->id].pose *
+        female_mate_points[female_mate_point_index(rng)]->pose *
+        male_mate_points[male_mate_point_index(rng)]->pose.Inverse();
+
+      atom_states[male_atom->id].pose = KDL::Frame(
+          KDL::Rotation::RPY(jitter(rng), jitter(rng), jitter(rng)),
+          KDL::Vector(jitter(rng), jitter(rng), jitter(rng))) * mated_frame;
+    }
+  }
+
+  static bool run_benchmark(
+      const BenchmarkOptions &options,
+      sdf::ElementPtr soup_elem,
+      size_t n_atoms,
+      BenchmarkResult &result)
+  {
+    // Use the same poses for the same seed and soup size
+    boost::random::mt19937 rng(options.seed + n_atoms);
+
+    boost::shared_ptr<BenchmarkBackend> backend = boost::make_shared<BenchmarkBackend>();
+    boost::scoped_ptr<Soup> soup(new Soup());
+
+    // Build the soup like the plugin does when it's loaded
+    const double construct_start = now_ns();
+
+    if(not soup->load(soup_elem, backend)) {
+      return false;
+    }
+
+    // One hog, then one node for every two links
+    std::vector<std::string> names;
+    names.push_back("hog");
+    for(size_t i=1; i < n_atoms; i++) {
+      if(i % 3 == 0) {
+        names.push_back(boost::str(boost::format("gbeam_node_%d") % i));
+      } else {
+        names.push_back(boost::str(boost::format("gbeam_link_%d") % i));
+      }
+    }
+
+    for(size_t i=0; i < names.size(); i++) {
+      if(not soup->addAtom(names[i])) {
+        fprintf(stderr, "No atom model for %s\n", names[i].c_str());
+        return false;
+      }
+    }
+
+    soup->init();
+
+    result.construct = now_ns() - construct_start;
+    result.atoms = soup->getAtoms().size();
+    result.mates = soup->getMates().size();
+
+    // Generate the atom poses
+    backend->atom_states.resize(result.atoms);
+    backend->atom_wrenches.assign(result.atoms, KDL::Wrench::Zero());
+    if(options.layout == "random") {
+      random_layout(options, soup->getAtoms(), rng, backend->atom_states);
+    } else {
+      clustered_layout(options, soup->getAtoms(), rng, backend->atom_states);
+    }
+
+    AtomStateVector atom_states(result.atoms);
+    soup->captureAtomStates(atom_states);
+
+    std::vector<double> samples;
+
+    // The first pass finds the mates which are close enough to interact,
+    // and queues the ones within reach to be attached
+    soup->queueUpdates(atom_states);
+
+    // Time the mate interactions before anything is attached, since mated
+    // atoms don't interact
+    samples.clear();
+    for(int i=0; i < options.iterations; i++) {
+      const double start = now_ns();
+      soup->update(options.timestep, atom_states);
+      samples.push_back(now_ns() - start);
+    }
+    result.dipole = get_stats(samples, soup->getInteractingMates().size());
+
+    // Attach the mates which are within reach, and later passes keep
+    // checking them
+    soup->updateConstraints(atom_states, 0.0);
+
+    samples.clear();
+    for(int i=0; i < options.iterations; i++) {
+      const double start = now_ns();
+      soup->queueUpdates(atom_states);
+      soup->updateConstraints(atom_states, 0.0);
+      samples.push_back(now_ns() - start);
+    }
+    result.proximity = get_stats(samples, soup->getMateCandidates().size());
+
+    return true;
+  }
+
+  static void print_stats(const char *name, const PassStats &stats, size_t mates, bool last)
+  {
+    printf("      \"%s\": {\"median_ns\": %.0f, \"min_ns\": %.0f, \"candidates\": %lu, "
+           "\"ns_per_mate\": %.3f, \"mates_per_s\": %.0f}%s\n",
+           name,
+           stats.median,
+           stats.min,
+           (unsigned long)stats.candidates,
+           mates > 0 ? stats.median / mates : 0.0,
+           stats.median > 0 ? mates / stats.median * 1E9 : 0.0,
+           last ? "" : ",");
+  }
+
+  static void print_results(
+      const BenchmarkOptions &options,
+      const std::vector<BenchmarkResult> &results)
+  {
+    printf("{\n");
+    printf("  \"sdf\": \"%s\",\n", options.sdf_path.c_str());
+    printf("  \"layout\": \"%s\",\n", options.layout.c_str());
+    printf("  \"seed\": %u,\n", options.seed);
+    printf("  \"iterations\": %d,\n", options.iterations);
+    printf("  \"dipole_kernel\": \"%s\",\n", getDipoleKernelName());
+    printf("  \"results\": [\n");
+    for(size_t i=0; i < results.size(); i++) {
+      const BenchmarkResult &result = results[i];
+      printf("    {\n");
+      printf("      \"atoms\": %lu,\n", (unsigned long)result.atoms);
+      printf("      \"mates\": %lu,\n", (unsigned long)result.mates);
+      printf("      \"construct\": {\"ns\": %.0f, \"ns_per_mate\": %.3f},\n",
+             result.construct,
+             result.mates > 0 ? result.construct / result.mates : 0.0);
+      print_stats("dipole", result.dipole, result.mates, false);
+      print_stats("proximity", result.proximity, result.mates, true);
+      printf("    }%s\n", i+1 < results.size() ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [options] SOUP_SDF\n"
+          "\n"
+          "  --atoms N[,N...]      soup sizes (default: 16,32,64,128)\n"
+          "  --layout LAYOUT       \"random\" or \"clustered\" (default: clustered)\n"
+          "  --iterations K        timed passes per soup size (default: 20)\n"
+          "  --seed S              random seed (default: 0)\n"
+          "  --timestep DT         tick length in seconds (default: 0.001)\n",
+          name);
+}
+
+int main(int argc, char **argv)
+{
+  using namespace assembly_sim;
+
+  BenchmarkOptions options;
+
+  try {
+    for(int i=1; i < argc; i++) {
+      std::string arg = argv[i];
+      bool has_value = i+1 < argc;
+
+      if(arg == "--atoms" and has_value) {
+        std::vector<std::string> sizes;
+        boost::split(sizes, argv[++i], boost::is_any_of(","));
+        options.atoms.clear();
+        for(size_t j=0; j < sizes.size(); j++) {
+          options.atoms.push_back(boost::lexical_cast<size_t>(sizes[j]));
+        }
+      } else if(arg == "--layout" and has_value) {
+        options.layout = argv[++i];
+      } else if(arg == "--iterations" and has_value) {
+        options.iterations = std::max(boost::lexical_cast<int>(argv[++i]), 1);
+      } else if(arg == "--seed" and has_value) {
+        options.seed = boost::lexical_cast<unsigned int>(argv[++i]);
+      } else if(arg == "--timestep" and has_value) {
+        options.timestep = boost::lexical_cast<double>(argv[++i]);
+      } else if(arg.find("--") != 0 and options.sdf_path.empty()) {
+        options.sdf_path = arg;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+  } catch(boost::bad_lexical_cast &ex) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(options.sdf_path.empty() or (options.layout != "random" and options.layout != "clustered")) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // Load the soup description
+  sdf::SDFPtr sdf(new sdf::SDF());
+  sdf::init(sdf);
+  if(not sdf::readFile(options.sdf_path, sdf)) {
+    fprintf(stderr, "Could not read %s\n", options.sdf_path.c_str());
+    return 1;
+  }
+
+  sdf::ElementPtr soup_elem = get_soup_elem(sdf->root);
+  if(not soup_elem) {
+    fprintf(stderr, "No soup plugin in %s\n", options.sdf_path.c_str());
+    return 1;
+  }
+
+  std::vector<BenchmarkResult> results;
+  for(size_t i=0; i < options.atoms.size(); i++) {
+    BenchmarkResult result;
+    if(not run_benchmark(options, soup_elem, options.atoms[i], result)) {
+      return 1;
+    }
+    results.push_back(result);
+  }
+
+  print_results(options, results);
+
+  return 0;
+}
@@ -0,0 +1,282 @@
+// Offline soup simulation without Gazebo
+//
+// This loads a soup model from an SDF file (e.g. gbeam_soup.sdf.xacro run
+// through xacro), simulates its links with the built-in rigid-body backend,
+// and runs the same mate pipeline as the assembly soup plugin. A summary is
+// printed to stdout as JSON when the simulation ends.
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <set>
+
+#include <boost/make_shared.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include <sdf/sdf.hh>
+
+#include <kdl/frames.hpp>
+
+#include "soup.h"
+#include "rigid_body_backend.h"
+#include "profiler.h"
+
+namespace assembly_sim {
+
+  struct SimOptions
+  {
+    SimOptions() :
+      duration(10.0),
+      timestep(0.001),
+      check_steps(10),
+      profile(false),
+      profile_mates(false)
+    { }
+
+    std::string sdf_path;
+    // simulated time in seconds
+    double duration;
+    double timestep;
+    // number of steps between mate checks
+    int check_steps;
+    // time the phases of the pipeline, and optionally each mate
+    bool profile;
+    bool profile_mates;
+  };
+
+  static double now_s()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+  }
+
+  static sdf::ElementPtr get_model_elem(sdf::ElementPtr elem)
+  {
+    if(elem->HasElement("world")) {
+      elem = elem->GetElement("world");
+    }
+    if(elem->HasElement("model")) {
+      return elem->GetElement("model");
+    }
+    return sdf::ElementPtr();
+  }
+
+  // Load the atoms of a soup model into a soup and a rigid-body backend
+  static bool load_soup(
+      sdf::ElementPtr model_elem,
+      Soup &soup,
+      boost::shared_ptr<RigidBodyBackend> backend)
+  {
+    if(not model_elem->HasElement("plugin")) {
+      fprintf(stderr, "No soup plugin in the model\n");
+      return false;
+    }
+
+    sdf::ElementPtr soup_elem = model_elem->GetElement("plugin");
+    if(soup_elem->HasElement("rigid_body")) {
+      backend->load(soup_elem->GetElement("rigid_body"));
+    }
+
+    if(not soup.load(soup_elem, backend)) {
+      return false;
+    }
+
+    KDL::Frame model_frame = KDL::Frame::Identity();
+    if(model_elem->HasElement("pose")) {
+      to_kdl(model_elem->GetElement("pose"), model_frame);
+    }
+
+    // Links which are jointed to the world are fixed
+    std::set<std::string> fixed_links;
+    if(model_elem->HasElement("joint")) {
+      sdf::ElementPtr joint_elem = model_elem->GetElement("joint");
+      while(joint_elem && joint_elem->GetName() == "joint")
+      {
+        std::string parent, child;
+        joint_elem->GetElement("parent")->GetValue()->Get(parent);
+        joint_elem->GetElement("child")->GetValue()->Get(child);
+        if(parent == "world") {
+          fixed_links.insert(child);
+        }
+
+        joint_elem = joint_elem->GetNextElement(joint_elem->GetName());
+      }
+    }
+
+    // Create an atom and a body for each link
+    if(model_elem->HasElement("link")) {
+      sdf::ElementPtr link_elem = model_elem->GetElement("link");
+      while(link_elem && link_elem->GetName() == "link")
+      {
+        std::string name;
+        link_elem->GetAttribute("name")->Get(name);
+
+        AtomPtr atom = soup.addAtom(name);
+        if(atom) {
+          KDL::Frame link_frame = KDL::Frame::Identity();
+          if(link_elem->HasElement("pose")) {
+            to_kdl(link_elem->GetElement("pose"), link_frame);
+          }
+
+          RigidBodyParams params;
+          RigidBodyBackend::getBodyParams(link_elem, params);
+          params.fixed = fixed_links.count(name) > 0;
+
+          backend->addBody(*atom, params, model_frame * link_frame);
+        }
+
+        link_elem = link_elem->GetNextElement(link_elem->GetName());
+      }
+    }
+
+    soup.init();
+
+    return true;
+  }
+}
+
+static void usage(const char *name)
+{
+  fprintf(stderr,
+          "Usage: %s [options] SOUP_SDF\n"
+          "\n"
+          "  --duration T          simulated time in seconds (default: 10)\n"
+          "  --timestep DT         step length in seconds (default: 0.001)\n"
+          "  --check-steps N       steps between mate checks (default: 10)\n"
+          "  --profile             report the timing of each phase\n"
+          "  --profile-mates       also time each mate type\n",
+          name);
+}
+
+int main(int argc, char **argv)
+{
+  using namespace assembly_sim;
+
+  SimOptions options;
+
+  try {
+    for(int i=1; i < argc; i++) {
+      std::string arg = argv[i];
+      bool has_value = i+1 < argc;
+
+      if(arg == "--duration" and has_value) {
+        options.duration = boost::lexical_cast<double>(argv[++i]);
+      } else if(arg == "--timestep" and has_value) {
+        options.timestep = boost::lexical_cast<double>(argv[++i]);
+      } else if(arg == "--check-steps" and has_value) {
+        options.check_steps = std::max(boost::lexical_cast<int>(argv[++i]), 1);
+      } else if(arg == "--profile") {
+        options.profile = true;
+      } else if(arg == "--profile-mates") {
+        options.profile = options.profile_mates = true;
+      } else if(arg.find("--") != 0 and options.sdf_path.empty()) {
+        options.sdf_path = arg;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    }
+  } catch(boost::bad_lexical_cast &ex) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if(options.sdf_path.empty() or options.timestep <= 0.0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  Profiler::instance().setEnabled(options.profile, options.profile_mates);
+
+  // Load the soup
+  sdf::SDFPtr sdf(new sdf::SDF());
+  sdf::init(sdf);
+  if(not sdf::readFile(options.sdf_path, sdf)) {
+    fprintf(stderr, "Could not read %s\n", options.sdf_path.c_str());
+    return 1;
+  }
+
+  sdf::ElementPtr model_elem = get_model_elem(sdf->root);
+  if(not model_elem) {
+    fprintf(stderr, "No model in %s\n", options.sdf_path.c_str());
+    return 1;
+  }
+
+  Soup soup;
+  boost::shared_ptr<RigidBodyBackend> backend = boost::make_shared<RigidBodyBackend>();
+  if(not load_soup(model_elem, soup, backend)) {
+    return 1;
+  }
+
+  AtomStateVector atom_states(soup.getAtoms().size());
+
+  // Run the same pipeline as the plugin, checking the mates in the
+  // simulation thread at fixed steps
+  const long n_steps = static_cast<long>(options.duration / options.timestep + 0.5);
+  const double start = now_s();
+
+  for(long step=0; step < n_steps; step++) {
+    soup.captureAtomStates(atom_states);
+
+    if(step % options.check_steps == 0) {
+      soup.queueUpdates(atom_states);
+    }
+
+    soup.updateConstraints(atom_states, step * options.timestep);
+    soup.update(options.timestep, atom_states);
+
+    ASSEMBLY_PROFILE("physics/step");
+    backend->step(options.timestep);
+  }
+
+  const double wall_time = now_s() - start;
+  const double sim_time = n_steps * options.timestep;
+
+  const size_t n_mated = soup.getMatedMates().size();
+
+  printf("{\n");
+  printf("  \"sdf\": \"%s\",\n", options.sdf_path.c_str());
+  printf("  \"atoms\": %lu,\n", (unsigned long)soup.getAtoms().size());
+  printf("  \"mates\": %lu,\n", (unsigned long)soup.getMates().size());
+  printf("  \"mated\": %lu,\n", (unsigned long)n_mated);
+  printf("  \"clusters\": %lu,\n", (unsigned long)backend->getClusterCount());
+  printf("  \"steps\": %ld,\n", n_steps);
+  printf("  \"sim_time\": %.3f,\n", sim_time);
+  printf("  \"wall_time\": %.3f,\n", wall_time);
+  printf("  \"real_time_factor\": %.2f%s\n", wall_time > 0.0 ? sim_time / wall_time : 0.0, options.profile ? "," : "");
+
+  if(options.profile) {
+    std::vector<TimerStats> timer_stats;
+    std::vector<CounterStats> counter_stats;
+    Profiler::instance().getStats(timer_stats, counter_stats);
+
+    printf("  \"timers\": {\n");
+    for(size_t i=0; i < timer_stats.size(); i++) {
+      const TimerStats &stats = timer_stats[i];
+      printf("    \"%s\": {\"count\": %llu, \"mean\": %.9f, \"p50\": %.9f, \"p99\": %.9f, \"max\": %.9f}%s\n",
+             stats.name.c_str(),
+             (unsigned long long)stats.count,
+             stats.mean, stats.p50, stats.p99, stats.max,
+             i+1 < timer_stats.size() ? "," : "");
+    }
+    printf("  },\n");
+
+    printf("  \"counters\": {\n");
+    for(size_t i=0; i < counter_stats.size(); i++) {
+      printf("    \"%s\": %lld%s\n",
+             counter_stats[i].name.c_str(),
+             (long long)counter_stats[i].value,
+             i+1 < counter_stats.size() ? "," : "");
+    }
+    printf("  }\n");
+  }
+
+  printf("}\n");
+
+  return 0;
+}
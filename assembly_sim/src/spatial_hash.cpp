@@ -0,0 +1,130 @@
+#include <cmath>
+#include <algorithm>
+
+#include "spatial_hash.h"
+
+namespace assembly_sim {
+
+  SpatialHash::SpatialHash() :
+    cell_size_(0.05),
+    entries_(),
+    sorted_entries_(),
+    bucket_offsets_(2, 0),
+    bucket_mask_(0)
+  {
+  }
+
+  void SpatialHash::setCellSize(double cell_size)
+  {
+    cell_size_ = cell_size;
+    this->clear();
+  }
+
+  void SpatialHash::clear()
+  {
+    entries_.clear();
+    sorted_entries_.clear();
+    std::fill(bucket_offsets_.begin(), bucket_offsets_.end(), 0);
+  }
+
+  void SpatialHash::insert(const KDL::Vector &position, size_t value)
+  {
+    Entry entry;
+    entry.position = position;
+    entry.value = value;
+    this->getCell(position, entry.cell);
+    entries_.push_back(entry);
+  }
+
+  void SpatialHash::build()
+  {
+    // Use at least twice as many buckets as entries to keep chains short
+    size_t n_buckets = 64;
+    while(n_buckets < 2*entries_.size()) {
+      n_buckets *= 2;
+    }
+    bucket_mask_ = n_buckets - 1;
+
+    // Count the entries in each bucket
+    bucket_offsets_.assign(n_buckets + 1, 0);
+    for(std::vector<Entry>::const_iterator it = entries_.begin();
+        it != entries_.end();
+        ++it)
+    {
+      bucket_offsets_[this->getBucket(it->cell)]++;
+    }
+
+    // Compute the end offset of each bucket
+    for(size_t b = 1; b <= n_buckets; b++) {
+      bucket_offsets_[b] += bucket_offsets_[b-1];
+    }
+
+    // Fill each bucket from the back so that its offset ends at its start
+    sorted_entries_.resize(entries_.size());
+    for(std::vector<Entry>::const_reverse_iterator it = entries_.rbegin();
+        it != entries_.rend();
+        ++it)
+    {
+      sorted_entries_[--bucket_offsets_[this->getBucket(it->cell)]] = *it;
+    }
+  }
+
+  void SpatialHash::query(
+      const KDL::Vector &position,
+      double radius,
+      std::vector<size_t> &values) const
+  {
+    if(sorted_entries_.empty()) {
+      return;
+    }
+
+    boost::int64_t cell_min[3], cell_max[3], cell[3];
+    this->getCell(position - KDL::Vector(radius, radius, radius), cell_min);
+    this->getCell(position + KDL::Vector(radius, radius, radius), cell_max);
+
+    const double radius_sq = radius*radius;
+
+    for(cell[0] = cell_min[0]; cell[0] <= cell_max[0]; cell[0]++) {
+      for(cell[1] = cell_min[1]; cell[1] <= cell_max[1]; cell[1]++) {
+        for(cell[2] = cell_min[2]; cell[2] <= cell_max[2]; cell[2]++) {
+          const size_t bucket = this->getBucket(cell);
+
+          for(size_t i = bucket_offsets_[bucket]; i < bucket_offsets_[bucket+1]; i++)
+          {
+            const Entry &entry = sorted_entries_[i];
+
+            // Skip entries from other cells which hash to the same bucket
+            if(entry.cell[0] != cell[0] or entry.cell[1] != cell[1] or entry.cell[2] != cell[2]) {
+              continue;
+            }
+
+            const KDL::Vector offset = entry.position - position;
+            if(KDL::dot(offset, offset) <= radius_sq) {
+              values.push_back(entry.value);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  void SpatialHash::getCell(const KDL::Vector &position, boost::int64_t cell[3]) const
+  {
+    for(int i=0; i<3; i++) {
+      cell[i] = static_cast<boost::int64_t>(std::floor(position.data[i] / cell_size_));
+    }
+  }
+
+  size_t SpatialHash::getBucket(const boost::int64_t cell[3]) const
+  {
+    // Large primes from Teschner et al. "Optimized Spatial Hashing for
+    // Collision Detection of Deformable Objects"
+    const boost::uint64_t hash =
+      static_cast<boost::uint64_t>(cell[0]) * 73856093ULL ^
+      static_cast<boost::uint64_t>(cell[1]) * 19349663ULL ^
+      static_cast<boost::uint64_t>(cell[2]) * 83492791ULL;
+
+    return static_cast<size_t>(hash) & bucket_mask_;
+  }
+
+}
@@ -0,0 +1,69 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_SPATIAL_HASH_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_SPATIAL_HASH_H__
+
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include <kdl/frames.hpp>
+
+namespace assembly_sim {
+
+  // A uniform grid of points in space, hashed into a power-of-two number of
+  // buckets. Entries are inserted, sorted into buckets with build(), and then
+  // queried for all entries within a radius of a point. The storage is reused
+  // across rebuilds so that it can be refilled every update cycle without
+  // allocating.
+  class SpatialHash
+  {
+  public:
+    SpatialHash();
+
+    // Set the edge length of each grid cell
+    // Queries are cheapest when the query radius is close to the cell size
+    void setCellSize(double cell_size);
+    double getCellSize() const { return cell_size_; }
+
+    // Remove all entries
+    void clear();
+
+    // Add an entry at a given position
+    // The entry is not visible to queries until build() is called
+    void insert(const KDL::Vector &position, size_t value);
+
+    // Sort all inserted entries into their buckets
+    void build();
+
+    // Append the value of every entry within radius of position
+    void query(
+        const KDL::Vector &position,
+        double radius,
+        std::vector<size_t> &values) const;
+
+    size_t size() const { return entries_.size(); }
+
+  private:
+    struct Entry
+    {
+      KDL::Vector position;
+      boost::int64_t cell[3];
+      size_t value;
+    };
+
+    void getCell(const KDL::Vector &position, boost::int64_t cell[3]) const;
+    size_t getBucket(const boost::int64_t cell[3]) const;
+
+    double cell_size_;
+
+    // Entries in insertion order
+    std::vector<Entry> entries_;
+    // Entries sorted by bucket
+    std::vector<Entry> sorted_entries_;
+    // Offset of each bucket in sorted_entries_ (one more than the bucket count)
+    std::vector<size_t> bucket_offsets_;
+    size_t bucket_mask_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_SPATIAL_HASH_H__
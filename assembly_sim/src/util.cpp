@@ -29,53 +29,21 @@ namespace assembly_sim {
     //gzwarn<<"string of joint pose: "<<pose_str<<std::endl<<frame<<std::endl;
   }
 
-  void to_kdl(const gazebo::math::Pose &pose, KDL::Frame &frame)
-  {
-    frame = KDL::Frame(
-        KDL::Rotation::Quaternion(pose.rot.x, pose.rot.y, pose.rot.z, pose.rot.w),
-        KDL::Vector(pose.pos.x, pose.pos.y, pose.pos.z));
-  }
-
-  void to_kdl(const gazebo::math::Vector3 &vector3, KDL::Vector &vector)
+  void to_kdl(const sdf::Vector3 &vector3, KDL::Vector &vector)
   {
     vector.data[0] = vector3.x;
     vector.data[1] = vector3.y;
     vector.data[2] = vector3.z;
   }
 
-  void to_tf(const gazebo::math::Pose &pose, tf::Transform &frame)
+  void to_eigen(const sdf::Vector3 &vector3, Eigen::Vector3d &vector3d)
   {
-    frame.setRotation( tf::Quaternion(
-            pose.rot.x,
-            pose.rot.y,
-            pose.rot.z,
-            pose.rot.w));
-    frame.setOrigin( tf::Vector3(pose.pos.x, pose.pos.y, pose.pos.z) );
+    vector3d << vector3.x, vector3.y, vector3.z;
   }
 
-  void to_gazebo(const KDL::Frame &frame, gazebo::math::Pose &pose)
+  void to_eigen(const KDL::Vector &vector, Eigen::Vector3d &vector3d)
   {
-    pose = gazebo::math::Pose(
-        gazebo::math::Vector3(frame.p.data[0], frame.p.data[1], frame.p.data[2]),
-        gazebo::math::Quaternion());
-    frame.M.GetQuaternion(pose.rot.x, pose.rot.y, pose.rot.z, pose.rot.w);
-  }
-
-  void to_gazebo(const KDL::Wrench &wrench, gazebo::math::Vector3 &force, gazebo::math::Vector3 &torque)
-  {
-    force.x = wrench.force.x();
-    force.y = wrench.force.y();
-    force.z = wrench.force.z();
-
-    torque.x = wrench.torque.x();
-    torque.y = wrench.torque.y();
-    torque.z = wrench.torque.z();
-  }
-
-  void to_eigen(const gazebo::math::Vector3 &vector3, Eigen::Vector3d &vector3d) {
-    for(int i=0; i<3; i++) {
-      vector3d[i] = vector3[i];
-    }
+    vector3d << vector.x(), vector.y(), vector.z();
   }
 
   // Complete an SDF xml snippet into a model
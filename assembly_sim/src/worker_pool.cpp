@@ -0,0 +1,198 @@
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/ref.hpp>
+
+#include "worker_pool.h"
+
+namespace assembly_sim {
+
+  WorkerPool::WorkerPool() :
+    generation_(0),
+    n_pending_(0),
+    running_(false)
+  {
+  }
+
+  WorkerPool::~WorkerPool()
+  {
+    this->stop();
+  }
+
+  void WorkerPool::start(size_t n_workers)
+  {
+    this->stop();
+
+    boost::mutex::scoped_lock lock(mutex_);
+    running_ = true;
+    work_ranges_.reset(new WorkRange[n_workers]);
+    for(size_t worker = 1; worker < n_workers; worker++) {
+      threads_.push_back(
+          new boost::thread(boost::bind(&WorkerPool::workerLoop, this, worker, generation_)));
+    }
+  }
+
+  void WorkerPool::stop()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if(not running_) {
+        return;
+      }
+      running_ = false;
+      generation_++;
+    }
+    job_cond_.notify_all();
+
+    for(std::vector<boost::thread*>::iterator it = threads_.begin();
+        it != threads_.end();
+        ++it)
+    {
+      (*it)->join();
+      delete *it;
+    }
+    threads_.clear();
+  }
+
+  void WorkerPool::run(const Job &job)
+  {
+    if(threads_.empty()) {
+      job(0);
+      return;
+    }
+
+    // Hand the job to the worker threads
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      job_ = job;
+      n_pending_ = threads_.size();
+      generation_++;
+    }
+    job_cond_.notify_all();
+
+    // Do this thread's share of the work
+    job(0);
+
+    // Wait for the other workers to finish
+    boost::mutex::scoped_lock lock(mutex_);
+    while(n_pending_ > 0) {
+      done_cond_.wait(lock);
+    }
+    job_.clear();
+  }
+
+  void WorkerPool::parallelFor(size_t n_items, size_t grain_size, const RangeJob &job)
+  {
+    if(threads_.empty()) {
+      if(n_items > 0) {
+        job(0, 0, n_items);
+      }
+      return;
+    }
+
+    // Give each worker its own share of the items
+    for(size_t worker = 0; worker < this->size(); worker++) {
+      boost::mutex::scoped_lock lock(work_ranges_[worker].mutex);
+      this->getRange(worker, n_items, work_ranges_[worker].begin, work_ranges_[worker].end);
+    }
+
+    this->run(boost::bind(&WorkerPool::stealingLoop, this, _1, std::max(grain_size, size_t(1)), boost::cref(job)));
+  }
+
+  void WorkerPool::stealingLoop(size_t worker, size_t grain_size, const RangeJob &job)
+  {
+    size_t begin, end;
+
+    while(true)
+    {
+      // Process this worker's own items first
+      if(this->takeChunk(worker, grain_size, begin, end)) {
+        job(worker, begin, end);
+        continue;
+      }
+
+      // Once every worker is out of items, there won't be any more
+      if(not this->stealWork(worker)) {
+        return;
+      }
+    }
+  }
+
+  bool WorkerPool::takeChunk(size_t worker, size_t grain_size, size_t &begin, size_t &end)
+  {
+    WorkRange &range = work_ranges_[worker];
+    boost::mutex::scoped_lock lock(range.mutex);
+
+    if(range.begin == range.end) {
+      return false;
+    }
+
+    begin = range.begin;
+    end = std::min(range.begin + grain_size, range.end);
+    range.begin = end;
+
+    return true;
+  }
+
+  bool WorkerPool::stealWork(size_t worker)
+  {
+    // Look for a victim, starting with the next worker
+    for(size_t offset = 1; offset < this->size(); offset++)
+    {
+      WorkRange &victim_range = work_ranges_[(worker + offset) % this->size()];
+      size_t begin, end;
+
+      {
+        boost::mutex::scoped_lock lock(victim_range.mutex);
+        if(victim_range.begin == victim_range.end) {
+          continue;
+        }
+
+        // Take the back half of the victim's remaining items
+        begin = victim_range.begin + (victim_range.end - victim_range.begin) / 2;
+        end = victim_range.end;
+        victim_range.end = begin;
+      }
+
+      WorkRange &range = work_ranges_[worker];
+      boost::mutex::scoped_lock lock(range.mutex);
+      range.begin = begin;
+      range.end = end;
+
+      return true;
+    }
+
+    return false;
+  }
+
+  void WorkerPool::workerLoop(size_t worker, size_t last_generation)
+  {
+    while(true)
+    {
+      Job job;
+
+      // Wait for a new job
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while(running_ and generation_ == last_generation) {
+          job_cond_.wait(lock);
+        }
+        if(not running_) {
+          return;
+        }
+        last_generation = generation_;
+        job = job_;
+      }
+
+      job(worker);
+
+      // Report that this worker is done
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        n_pending_--;
+      }
+      done_cond_.notify_one();
+    }
+  }
+
+}
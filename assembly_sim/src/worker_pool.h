@@ -0,0 +1,85 @@
+#ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_WORKER_POOL_H__
+#define __LCSR_ASSEMBLY_ASSEMBLY_SIM_WORKER_POOL_H__
+
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace assembly_sim {
+
+  // A fixed set of persistent threads which all run the same job and then
+  // wait for the next one. The thread which calls run() takes part as worker
+  // 0, so a pool with one worker doesn't start any threads at all.
+  class WorkerPool
+  {
+  public:
+    // The job is called once on each worker with the worker's index
+    typedef boost::function<void (size_t)> Job;
+
+    // The job is called with the worker's index and a range [begin, end) of
+    // items to process
+    typedef boost::function<void (size_t, size_t, size_t)> RangeJob;
+
+    WorkerPool();
+    ~WorkerPool();
+
+    // Start the pool with the given number of workers (including the caller)
+    void start(size_t n_workers);
+
+    // Stop and join all worker threads
+    void stop();
+
+    // Number of workers, including the calling thread
+    size_t size() const { return threads_.size() + 1; }
+
+    // Run the job on every worker and wait for all of them to finish
+    void run(const Job &job);
+
+    // Process items [0, n_items) in chunks of at most grain_size items on
+    // all workers and wait for all of them to be processed. Each worker
+    // starts with its own contiguous share of the items, and once it runs
+    // out it steals the back half of the remaining items of another worker.
+    void parallelFor(size_t n_items, size_t grain_size, const RangeJob &job);
+
+    // Split n items into one contiguous range per worker
+    void getRange(size_t worker, size_t n_items, size_t &begin, size_t &end) const
+    {
+      begin = worker * n_items / this->size();
+      end = (worker + 1) * n_items / this->size();
+    }
+
+  private:
+    void workerLoop(size_t worker, size_t generation);
+
+    // Items which are left for a worker to process in parallelFor()
+    struct WorkRange
+    {
+      boost::mutex mutex;
+      size_t begin, end;
+    };
+    boost::scoped_array<WorkRange> work_ranges_;
+
+    void stealingLoop(size_t worker, size_t grain_size, const RangeJob &job);
+    bool takeChunk(size_t worker, size_t grain_size, size_t &begin, size_t &end);
+    bool stealWork(size_t worker);
+
+    std::vector<boost::thread*> threads_;
+
+    boost::mutex mutex_;
+    boost::condition_variable job_cond_;
+    boost::condition_variable done_cond_;
+
+    // The current job and the number of workers that haven't finished it
+    Job job_;
+    size_t generation_;
+    size_t n_pending_;
+    bool running_;
+  };
+
+}
+
+#endif // ifndef __LCSR_ASSEMBLY_ASSEMBLY_SIM_WORKER_POOL_H__
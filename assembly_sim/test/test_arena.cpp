@@ -0,0 +1,84 @@
+#include <new>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "arena.h"
+
+using namespace assembly_sim;
+
+// Counts how many instances are alive
+struct Counted
+{
+  explicit Counted(int value) : value(value) { n_alive++; }
+  Counted(const Counted &other) : value(other.value) { n_alive++; }
+  ~Counted() { n_alive--; }
+
+  int value;
+  static int n_alive;
+};
+
+int Counted::n_alive = 0;
+
+TEST(Arena, GrowsWithoutMovingObjects)
+{
+  Arena<Counted> arena(4);
+
+  // Pointers to the first objects stay valid as more blocks are added
+  std::vector<Counted*> objects;
+  for(int i=0; i < 37; i++) {
+    objects.push_back(arena.push_back(Counted(i)));
+  }
+
+  ASSERT_EQ(37u, arena.size());
+  for(int i=0; i < 37; i++) {
+    EXPECT_EQ(i, objects[i]->value);
+    EXPECT_EQ(objects[i], &arena[i]);
+  }
+}
+
+TEST(Arena, ConstructsInGrownStorage)
+{
+  Arena<Counted> arena(8);
+  arena.push_back(Counted(-1));
+
+  // Construct a range of objects in place, as the parallel loaders do
+  const size_t n = 20;
+  arena.grow(n);
+  for(size_t i=0; i < n; i++) {
+    new (arena.getStorage(arena.size() + i)) Counted(static_cast<int>(i));
+  }
+  arena.commit(n);
+
+  ASSERT_EQ(n + 1, arena.size());
+  EXPECT_EQ(-1, arena[0].value);
+  for(size_t i=0; i < n; i++) {
+    EXPECT_EQ(static_cast<int>(i), arena[i + 1].value);
+  }
+
+  // Reserving one more object still works after the bulk commit
+  new (arena.reserve()) Counted(100);
+  EXPECT_EQ(100, arena.commit()->value);
+  EXPECT_EQ(n + 2, arena.size());
+}
+
+TEST(Arena, DestroysObjects)
+{
+  {
+    Arena<Counted> arena(3);
+    for(int i=0; i < 10; i++) {
+      arena.push_back(Counted(i));
+    }
+    EXPECT_EQ(10, Counted::n_alive);
+
+    arena.clear();
+    EXPECT_EQ(0, Counted::n_alive);
+    EXPECT_EQ(0u, arena.size());
+
+    // The arena can be refilled after it's cleared
+    arena.push_back(Counted(1));
+    EXPECT_EQ(1, Counted::n_alive);
+  }
+
+  EXPECT_EQ(0, Counted::n_alive);
+}
@@ -0,0 +1,110 @@
+#include <cmath>
+#include <cstdlib>
+
+#include <gtest/gtest.h>
+
+#include "dipole_kernel.h"
+
+using namespace assembly_sim;
+
+static double uniform(double lo, double hi)
+{
+  return lo + (hi - lo) * (std::rand() / (double)RAND_MAX);
+}
+
+static KDL::Vector random_vector(double extent)
+{
+  return KDL::Vector(
+      uniform(-extent, extent),
+      uniform(-extent, extent),
+      uniform(-extent, extent));
+}
+
+static void expect_vectors_near(const Vector3Array &expected, const Vector3Array &actual, size_t n)
+{
+  for(size_t i=0; i < n; i++) {
+    const KDL::Vector e = expected[i];
+    const double tolerance = 1E-12 * (e.Norm() + 1.0);
+    EXPECT_NEAR(e.x(), actual.x[i], tolerance) << "pair " << i;
+    EXPECT_NEAR(e.y(), actual.y[i], tolerance) << "pair " << i;
+    EXPECT_NEAR(e.z(), actual.z[i], tolerance) << "pair " << i;
+  }
+}
+
+TEST(DipoleKernel, MatchesScalarKernel)
+{
+  std::srand(0);
+
+  // A batch size which doesn't fill a whole number of packs of any width,
+  // with some pairs closer than their minimum distance
+  DipoleBatch batch;
+  for(size_t i=0; i < 1003; i++) {
+    const KDL::Vector female_position = random_vector(0.1);
+    batch.add(
+        i % 7, i % 5,
+        female_position,
+        female_position + random_vector(0.02),
+        random_vector(0.05),
+        random_vector(0.05),
+        uniform(0.0, 0.01));
+  }
+
+  DipoleBatch scalar_batch = batch;
+  computeDipoleWrenchesScalar(scalar_batch);
+  computeDipoleWrenches(batch);
+
+  SCOPED_TRACE(getDipoleKernelName());
+  ASSERT_EQ(scalar_batch.size(), batch.force.x.size());
+  expect_vectors_near(scalar_batch.force, batch.force, batch.size());
+  expect_vectors_near(scalar_batch.female_torque, batch.female_torque, batch.size());
+  expect_vectors_near(scalar_batch.male_torque, batch.male_torque, batch.size());
+}
+
+TEST(DipoleKernel, CoaxialDipolesAttract)
+{
+  // Two aligned dipoles on their common axis attract each other with
+  // F = 6 (mu0 / 4 pi) m^2 / d^4 and no torque
+  const double m = 0.02, d = 0.01;
+
+  DipoleBatch batch;
+  for(size_t i=0; i < 9; i++) {
+    batch.add(0, 1,
+              KDL::Vector(0.0, 0.0, 0.0),
+              KDL::Vector(0.0, 0.0, d),
+              KDL::Vector(0.0, 0.0, m),
+              KDL::Vector(0.0, 0.0, m),
+              0.001);
+  }
+  computeDipoleWrenches(batch);
+
+  const double expected = 6.0 * 1E-7 * m * m / std::pow(d, 4);
+  for(size_t i=0; i < batch.size(); i++) {
+    EXPECT_NEAR(0.0, batch.force.x[i], 1E-12);
+    EXPECT_NEAR(0.0, batch.force.y[i], 1E-12);
+    EXPECT_NEAR(expected, batch.force.z[i], 1E-9 * expected);
+    EXPECT_NEAR(0.0, batch.female_torque[i].Norm(), 1E-12);
+    EXPECT_NEAR(0.0, batch.male_torque[i].Norm(), 1E-12);
+  }
+}
+
+TEST(DipoleKernel, AccumulatesOppositeForces)
+{
+  DipoleBatch batch;
+  batch.add(0, 1,
+            KDL::Vector(0.0, 0.0, 0.0),
+            KDL::Vector(0.003, 0.001, 0.01),
+            KDL::Vector(0.0, 0.01, 0.02),
+            KDL::Vector(0.01, 0.0, 0.02),
+            0.001);
+  computeDipoleWrenches(batch);
+
+  AtomStateVector atom_states(2);
+  atom_states[0].cog = KDL::Vector(0.0, 0.0, -0.02);
+  atom_states[1].cog = KDL::Vector(0.0, 0.0, 0.03);
+  AtomWrenchVector atom_wrenches(2, KDL::Wrench::Zero());
+  accumulateDipoleWrenches(batch, atom_states, atom_wrenches);
+
+  const KDL::Vector net_force = atom_wrenches[0].force + atom_wrenches[1].force;
+  EXPECT_NEAR(0.0, net_force.Norm(), 1E-12);
+  EXPECT_GT(atom_wrenches[0].force.Norm(), 0.0);
+}
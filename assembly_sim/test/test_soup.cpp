@@ -0,0 +1,351 @@
+#include <cmath>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/make_shared.hpp>
+
+#include <gtest/gtest.h>
+
+#include <sdf/sdf.hh>
+
+#include "soup.h"
+#include "rigid_body_backend.h"
+
+using namespace assembly_sim;
+
+// A synthetic soup of blocks which are stacked into columns by dipole mates
+// between the top of each block and the bottom of the next one
+struct SoupOptions
+{
+  SoupOptions() :
+    n_atoms(8),
+    n_columns(2),
+    spacing(0.0415),
+    worker_threads(1),
+    check_threads(1),
+    deterministic(false)
+  { }
+
+  size_t n_atoms;
+  size_t n_columns;
+  // vertical distance between the blocks, which mate 0.04 apart
+  double spacing;
+  size_t worker_threads;
+  size_t check_threads;
+  bool deterministic;
+};
+
+static std::string make_soup_sdf(const SoupOptions &options)
+{
+  std::ostringstream sdf;
+  sdf<<"<sdf version='1.4'><model name='soup'>"
+    <<"<plugin name='soup' filename='libassembly_soup_plugin.so'>"
+    <<"<worker_threads>"<<options.worker_threads<<"</worker_threads>"
+    <<"<check_threads>"<<options.check_threads<<"</check_threads>"
+    <<"<deterministic>"<<(options.deterministic ? "true" : "false")<<"</deterministic>"
+    <<"<rigid_body>"
+    <<"<gravity>0 0 0</gravity><ground>false</ground>"
+    <<"<linear_damping>0.5</linear_damping><angular_damping>0.5</angular_damping>"
+    <<"</rigid_body>"
+    <<"<mate_model type='peg' model='dipole'>"
+    <<"<symmetry><rot>1 1 4</rot></symmetry>"
+    <<"<dipole><position>0 0 0</position><moment>0 0 0.02</moment><min_distance>0.003</min_distance></dipole>"
+    <<"<attach_threshold><linear>0.0005</linear><angular>0.05</angular></attach_threshold>"
+    <<"<detach_threshold><linear>0.005</linear><angular>0.05</angular></detach_threshold>"
+    <<"<interaction_radius>0.03</interaction_radius>"
+    <<"<joint type='fixed' name='peg'><pose>0 0 0 0 0 0</pose><parent>block</parent><child>block</child></joint>"
+    <<"</mate_model>"
+    <<"<atom_model type='block'>"
+    <<"<mate_point type='peg' gender='female'><pose>0 0 -0.02 0 0 0</pose></mate_point>"
+    <<"<mate_point type='peg' gender='male'><pose>0 0 0.02 0 0 0</pose></mate_point>"
+    <<"</atom_model>"
+    <<"</plugin>";
+
+  for(size_t i=0; i < options.n_atoms; i++) {
+    // Offset each block a little from the top of the one below it
+    const size_t column = i % options.n_columns, row = i / options.n_columns;
+    const double jitter_x = 0.0004 * std::sin(1.3 * i);
+    const double jitter_y = 0.0004 * std::cos(2.1 * i);
+    const double yaw = 0.01 * std::sin(0.7 * i);
+
+    sdf<<"<link name='block_"<<i<<"'>"
+      <<"<pose>"<<(0.2 * column + jitter_x)<<" "<<jitter_y<<" "<<(0.1 + options.spacing * row)<<" 0 0 "<<yaw<<"</pose>"
+      <<"<gravity>false</gravity>"
+      <<"<collision name='collision'><geometry><sphere><radius>0.03</radius></sphere></geometry></collision>"
+      <<"<inertial><mass>0.1</mass><inertia><ixx>0.0001</ixx><iyy>0.0001</iyy><izz>0.0001</izz></inertia></inertial>"
+      <<"</link>";
+  }
+
+  sdf<<"</model></sdf>";
+
+  return sdf.str();
+}
+
+class SoupTest : public ::testing::Test
+{
+protected:
+  // Load the soup with an atom and a rigid body for each link
+  void load(const SoupOptions &options)
+  {
+    sdf_.reset(new sdf::SDF());
+    sdf::init(sdf_);
+    ASSERT_TRUE(sdf::readString(make_soup_sdf(options), sdf_));
+
+    sdf::ElementPtr model_elem = sdf_->root->GetElement("model");
+    sdf::ElementPtr soup_elem = model_elem->GetElement("plugin");
+
+    backend_ = boost::make_shared<RigidBodyBackend>();
+    backend_->load(soup_elem->GetElement("rigid_body"));
+
+    soup_.reset(new Soup());
+    ASSERT_TRUE(soup_->load(soup_elem, backend_));
+
+    sdf::ElementPtr link_elem = model_elem->GetElement("link");
+    while(link_elem && link_elem->GetName() == "link")
+    {
+      std::string name;
+      link_elem->GetAttribute("name")->Get(name);
+      this->addBody(soup_->addAtom(name), link_elem);
+      link_elem = link_elem->GetNextElement(link_elem->GetName());
+    }
+
+    soup_->init();
+    atom_states_.resize(soup_->getAtoms().size());
+  }
+
+  void addBody(const AtomPtr &atom, sdf::ElementPtr link_elem)
+  {
+    ASSERT_TRUE(atom);
+
+    KDL::Frame pose;
+    to_kdl(link_elem->GetElement("pose"), pose);
+
+    RigidBodyParams params;
+    RigidBodyBackend::getBodyParams(link_elem, params);
+    backend_->addBody(*atom, params, pose);
+  }
+
+  // Run the same pipeline as soup_sim
+  void simulate(double duration)
+  {
+    const double timestep = 0.001;
+    const long n_steps = static_cast<long>(duration / timestep + 0.5);
+
+    for(long step=0; step < n_steps; step++) {
+      soup_->captureAtomStates(atom_states_);
+      if(step % 10 == 0) {
+        soup_->queueUpdates(atom_states_);
+      }
+      soup_->updateConstraints(atom_states_, step * timestep);
+      soup_->update(timestep, atom_states_);
+      backend_->step(timestep);
+    }
+
+    soup_->captureAtomStates(atom_states_);
+  }
+
+  MatePtr getMate(const std::string &female, const std::string &male) const
+  {
+    const std::vector<MatePtr> &mates = soup_->getMates();
+    for(size_t i=0; i < mates.size(); i++) {
+      if(mates[i]->female->name == female and mates[i]->male->name == male) {
+        return mates[i];
+      }
+    }
+    return NULL;
+  }
+
+  sdf::SDFPtr sdf_;
+  boost::shared_ptr<RigidBodyBackend> backend_;
+  boost::scoped_ptr<Soup> soup_;
+  AtomStateVector atom_states_;
+};
+
+TEST_F(SoupTest, CreatesMatesBetweenAllAtoms)
+{
+  SoupOptions options;
+  options.n_atoms = 5;
+  this->load(options);
+
+  // Each female mate point can mate with the male mate point of every
+  // other atom
+  EXPECT_EQ(5u, soup_->getAtoms().size());
+  EXPECT_EQ(5u * 4u, soup_->getMates().size());
+  EXPECT_TRUE(soup_->getMatedMates().empty());
+
+  EXPECT_FALSE(soup_->addAtom("block_0"));
+  EXPECT_FALSE(soup_->addAtom("sphere_0"));
+}
+
+TEST_F(SoupTest, ReusesRemovedAtomSlots)
+{
+  SoupOptions options;
+  options.n_atoms = 3;
+  options.n_columns = 3;
+  this->load(options);
+  ASSERT_EQ(6u, soup_->getMates().size());
+
+  const AtomPtr removed = soup_->getAtom("block_1");
+  ASSERT_TRUE(removed);
+  EXPECT_TRUE(soup_->removeAtom(removed, 0.0));
+  EXPECT_FALSE(soup_->removeAtom(removed, 0.0));
+  EXPECT_FALSE(soup_->getAtom("block_1"));
+
+  // A new atom of the same model takes the removed atom's slot and mates
+  const AtomPtr added = soup_->addAtom("block_5");
+  EXPECT_EQ(removed, added);
+  EXPECT_EQ(1u, added->id);
+  EXPECT_EQ("block_5", added->name);
+  EXPECT_TRUE(added->active);
+  EXPECT_EQ(added, soup_->getAtom("block_5"));
+  EXPECT_EQ(3u, soup_->getAtoms().size());
+  EXPECT_EQ(6u, soup_->getMates().size());
+  EXPECT_TRUE(this->getMate("block_0", "block_5"));
+  EXPECT_TRUE(this->getMate("block_5", "block_2"));
+
+  // Without a free slot, the new atom gets new mates with every other atom
+  const AtomPtr extra = soup_->addAtom("block_6");
+  ASSERT_TRUE(extra);
+  EXPECT_EQ(3u, extra->id);
+  EXPECT_EQ(4u, soup_->getAtoms().size());
+  EXPECT_EQ(12u, soup_->getMates().size());
+}
+
+TEST_F(SoupTest, DetachesRemovedAtoms)
+{
+  SoupOptions options;
+  options.n_atoms = 3;
+  options.n_columns = 1;
+  this->load(options);
+  soup_->enableMateEvents(16);
+
+  this->simulate(1.0);
+  ASSERT_EQ(2u, soup_->getMatedMates().size());
+  ASSERT_EQ(1u, backend_->getClusterCount());
+
+  MateEvent event;
+  while(soup_->popMateEvent(event)) { }
+
+  // Removing the middle block detaches both of its mates
+  EXPECT_TRUE(soup_->removeAtom(soup_->getAtom("block_1"), 1.0));
+  EXPECT_TRUE(soup_->getMatedMates().empty());
+  EXPECT_EQ(3u, backend_->getClusterCount());
+
+  std::set<std::string> detached;
+  while(soup_->popMateEvent(event)) {
+    EXPECT_EQ(Mate::REMOVAL, event.cause);
+    EXPECT_EQ(1.0, event.time);
+    detached.insert(event.female + "/" + event.male);
+  }
+  EXPECT_EQ(2u, detached.size());
+  EXPECT_EQ(1u, detached.count("block_1/block_0"));
+  EXPECT_EQ(1u, detached.count("block_2/block_1"));
+}
+
+TEST_F(SoupTest, MatesStackedAtoms)
+{
+  SoupOptions options;
+  options.n_atoms = 16;
+  options.n_columns = 4;
+  this->load(options);
+  ASSERT_EQ(16u, backend_->getClusterCount());
+
+  this->simulate(1.0);
+
+  // Every block is welded to the one below it
+  EXPECT_EQ(12u, soup_->getMatedMates().size());
+  EXPECT_EQ(4u, backend_->getClusterCount());
+  for(size_t i=0; i + options.n_columns < options.n_atoms; i++) {
+    std::ostringstream upper, lower;
+    upper<<"block_"<<(i + options.n_columns);
+    lower<<"block_"<<i;
+
+    const MatePtr mate = this->getMate(upper.str(), lower.str());
+    ASSERT_TRUE(mate);
+    EXPECT_EQ(Mate::MATED, mate->state) << mate->getDescription();
+  }
+}
+
+TEST_F(SoupTest, DeterministicAcrossThreadCounts)
+{
+  SoupOptions options;
+  options.n_atoms = 32;
+  options.n_columns = 4;
+  options.deterministic = true;
+
+  // Simulate the same soup with one thread and with several
+  std::vector<AtomStateVector> atom_states;
+  std::vector<std::vector<boost::uint32_t> > mated_mates;
+  const size_t threads[][2] = {{1, 1}, {4, 3}};
+  for(size_t i=0; i < 2; i++) {
+    options.worker_threads = threads[i][0];
+    options.check_threads = threads[i][1];
+    this->load(options);
+    this->simulate(0.5);
+
+    atom_states.push_back(atom_states_);
+    mated_mates.push_back(soup_->getMatedMates());
+  }
+
+  EXPECT_FALSE(mated_mates[0].empty());
+  EXPECT_EQ(mated_mates[0], mated_mates[1]);
+
+  // The results are exactly the same, not just close
+  ASSERT_EQ(atom_states[0].size(), atom_states[1].size());
+  for(size_t i=0; i < atom_states[0].size(); i++) {
+    const KDL::Frame &a = atom_states[0][i].pose, &b = atom_states[1][i].pose;
+    for(int j=0; j < 3; j++) {
+      EXPECT_EQ(a.p(j), b.p(j)) << "atom " << i;
+      for(int k=0; k < 3; k++) {
+        EXPECT_EQ(a.M(j, k), b.M(j, k)) << "atom " << i;
+      }
+    }
+  }
+}
+
+TEST_F(SoupTest, WeldsClusters)
+{
+  SoupOptions options;
+  options.n_atoms = 3;
+  options.n_columns = 3;
+  this->load(options);
+  ASSERT_EQ(3u, backend_->getClusterCount());
+
+  const MatePtr mate_01 = this->getMate("block_0", "block_1");
+  const MatePtr mate_12 = this->getMate("block_1", "block_2");
+  ASSERT_TRUE(mate_01);
+  ASSERT_TRUE(mate_12);
+
+  // Welds join the clusters of both atoms
+  ConstraintPtr weld_01 = backend_->createConstraint(*mate_01);
+  ConstraintPtr weld_12 = backend_->createConstraint(*mate_12);
+  weld_01->attach(KDL::Frame::Identity());
+  EXPECT_EQ(2u, backend_->getClusterCount());
+  weld_12->attach(KDL::Frame::Identity());
+  EXPECT_EQ(1u, backend_->getClusterCount());
+
+  // Attaching again doesn't add another weld
+  weld_01->attach(KDL::Frame::Identity());
+  weld_01->detach();
+  EXPECT_EQ(2u, backend_->getClusterCount());
+  weld_01->attach(KDL::Frame::Identity());
+
+  // Welded atoms move together
+  weld_12->detach();
+  soup_->captureAtomStates(atom_states_);
+  const KDL::Frame relative_pose = atom_states_[0].pose.Inverse() * atom_states_[1].pose;
+  const KDL::Frame start_pose = atom_states_[0].pose;
+  const KDL::Frame free_pose = atom_states_[2].pose;
+
+  for(size_t step=0; step < 100; step++) {
+    backend_->applyWrench(*soup_->getAtom("block_0"), KDL::Wrench(KDL::Vector(0.1, 0.0, 0.05), KDL::Vector(0.0, 0.0, 0.001)));
+    backend_->step(0.001);
+  }
+  soup_->captureAtomStates(atom_states_);
+
+  EXPECT_GT((atom_states_[0].pose.p - start_pose.p).Norm(), 1E-4);
+  EXPECT_TRUE(KDL::Equal(relative_pose, atom_states_[0].pose.Inverse() * atom_states_[1].pose, 1E-9));
+  EXPECT_TRUE(KDL::Equal(free_pose, atom_states_[2].pose, 1E-12));
+}
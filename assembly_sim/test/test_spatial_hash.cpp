@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "spatial_hash.h"
+
+using namespace assembly_sim;
+
+static double uniform(double lo, double hi)
+{
+  return lo + (hi - lo) * (std::rand() / (double)RAND_MAX);
+}
+
+static KDL::Vector random_point(double extent)
+{
+  return KDL::Vector(
+      uniform(-extent, extent),
+      uniform(-extent, extent),
+      uniform(-extent, extent));
+}
+
+// Every entry within the radius, found the slow way
+static void brute_force_query(
+    const std::vector<KDL::Vector> &points,
+    const KDL::Vector &position,
+    double radius,
+    std::vector<size_t> &values)
+{
+  for(size_t i=0; i < points.size(); i++) {
+    const KDL::Vector offset = points[i] - position;
+    if(KDL::dot(offset, offset) <= radius*radius) {
+      values.push_back(i);
+    }
+  }
+}
+
+TEST(SpatialHash, MatchesBruteForce)
+{
+  std::srand(0);
+
+  // Points on both sides of the origin, with negative cell coordinates
+  std::vector<KDL::Vector> points;
+  for(size_t i=0; i < 2000; i++) {
+    points.push_back(random_point(1.0));
+  }
+
+  SpatialHash hash;
+  hash.setCellSize(0.1);
+  for(size_t i=0; i < points.size(); i++) {
+    hash.insert(points[i], i);
+  }
+  hash.build();
+  ASSERT_EQ(points.size(), hash.size());
+
+  // Radii smaller than, equal to and larger than the cell size
+  const double radii[] = {0.03, 0.1, 0.35};
+  for(size_t r=0; r < 3; r++) {
+    for(size_t q=0; q < 200; q++) {
+      const KDL::Vector position = random_point(1.2);
+
+      std::vector<size_t> found, expected;
+      hash.query(position, radii[r], found);
+      brute_force_query(points, position, radii[r], expected);
+
+      std::sort(found.begin(), found.end());
+      ASSERT_EQ(expected, found) << "radius " << radii[r] << " query " << q;
+    }
+  }
+}
+
+TEST(SpatialHash, QueriesExistingPoints)
+{
+  SpatialHash hash;
+  hash.setCellSize(0.05);
+
+  // Each point is within a zero radius of itself, including the ones on
+  // cell boundaries
+  std::vector<KDL::Vector> points;
+  points.push_back(KDL::Vector(0.0, 0.0, 0.0));
+  points.push_back(KDL::Vector(0.05, -0.05, 0.1));
+  points.push_back(KDL::Vector(-0.025, 0.0, 0.0));
+  for(size_t i=0; i < points.size(); i++) {
+    hash.insert(points[i], i);
+  }
+  hash.build();
+
+  for(size_t i=0; i < points.size(); i++) {
+    std::vector<size_t> found;
+    hash.query(points[i], 0.0, found);
+    ASSERT_EQ(1u, found.size());
+    EXPECT_EQ(i, found[0]);
+  }
+}
+
+TEST(SpatialHash, RebuildsAfterClear)
+{
+  SpatialHash hash;
+  hash.setCellSize(0.1);
+
+  hash.insert(KDL::Vector(0.0, 0.0, 0.0), 1);
+  hash.build();
+
+  hash.clear();
+  EXPECT_EQ(0u, hash.size());
+
+  std::vector<size_t> found;
+  hash.query(KDL::Vector(0.0, 0.0, 0.0), 1.0, found);
+  EXPECT_TRUE(found.empty());
+
+  hash.insert(KDL::Vector(0.5, 0.0, 0.0), 2);
+  hash.build();
+
+  hash.query(KDL::Vector(0.0, 0.0, 0.0), 1.0, found);
+  ASSERT_EQ(1u, found.size());
+  EXPECT_EQ(2u, found[0]);
+}
@@ -0,0 +1,170 @@
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <gtest/gtest.h>
+
+#include "worker_pool.h"
+
+using namespace assembly_sim;
+
+// Records which worker processed each item, and how many times
+struct ItemLog
+{
+  explicit ItemLog(size_t n_items, size_t slow_worker = size_t(-1)) :
+    counts(n_items, 0),
+    workers(n_items, size_t(-1)),
+    slow_worker(slow_worker),
+    n_chunks(0)
+  { }
+
+  void process(size_t worker, size_t begin, size_t end)
+  {
+    // Hold up one worker so that the others run out of items and steal
+    if(worker == slow_worker) {
+      boost::this_thread::sleep(boost::posix_time::milliseconds(2));
+    }
+
+    boost::mutex::scoped_lock lock(mutex);
+    n_chunks++;
+    for(size_t i=begin; i < end; i++) {
+      counts[i]++;
+      workers[i] = worker;
+    }
+  }
+
+  void count(size_t worker)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    counts[worker]++;
+  }
+
+  boost::mutex mutex;
+  std::vector<int> counts;
+  std::vector<size_t> workers;
+  size_t slow_worker;
+  size_t n_chunks;
+};
+
+TEST(WorkerPool, RunsJobOnEveryWorker)
+{
+  WorkerPool pool;
+  pool.start(4);
+  ASSERT_EQ(4u, pool.size());
+
+  for(size_t job=0; job < 10; job++) {
+    ItemLog log(pool.size());
+    pool.run(boost::bind(&ItemLog::count, &log, _1));
+    for(size_t worker=0; worker < pool.size(); worker++) {
+      EXPECT_EQ(1, log.counts[worker]) << "worker " << worker;
+    }
+  }
+}
+
+TEST(WorkerPool, SplitsItemsIntoRanges)
+{
+  WorkerPool pool;
+  pool.start(3);
+
+  // The ranges are contiguous and cover every item, even when there are
+  // fewer items than workers
+  const size_t n_items[] = {0, 1, 2, 3, 10, 1000};
+  for(size_t n=0; n < 6; n++) {
+    size_t next = 0;
+    for(size_t worker=0; worker < pool.size(); worker++) {
+      size_t begin, end;
+      pool.getRange(worker, n_items[n], begin, end);
+      EXPECT_EQ(next, begin);
+      EXPECT_LE(begin, end);
+      next = end;
+    }
+    EXPECT_EQ(n_items[n], next);
+  }
+}
+
+TEST(WorkerPool, ParallelForCoversEveryItemOnce)
+{
+  WorkerPool pool;
+  pool.start(4);
+
+  // Item counts which don't split evenly, including fewer items than
+  // workers and none at all
+  const size_t n_items[] = {0, 1, 3, 4, 17, 1000};
+  const size_t grain_sizes[] = {0, 1, 7, 64};
+
+  for(size_t n=0; n < 6; n++) {
+    for(size_t g=0; g < 4; g++) {
+      ItemLog log(n_items[n]);
+      pool.parallelFor(n_items[n], grain_sizes[g], boost::bind(&ItemLog::process, &log, _1, _2, _3));
+
+      for(size_t i=0; i < n_items[n]; i++) {
+        ASSERT_EQ(1, log.counts[i]) << "item " << i << " of " << n_items[n] << " grain " << grain_sizes[g];
+      }
+      if(n_items[n] == 0) {
+        EXPECT_EQ(0u, log.n_chunks);
+      }
+    }
+  }
+}
+
+TEST(WorkerPool, ParallelForWithoutThreads)
+{
+  WorkerPool pool;
+  pool.start(1);
+  ASSERT_EQ(1u, pool.size());
+
+  ItemLog log(100);
+  pool.parallelFor(100, 8, boost::bind(&ItemLog::process, &log, _1, _2, _3));
+
+  // The caller processes everything as worker 0
+  for(size_t i=0; i < 100; i++) {
+    ASSERT_EQ(1, log.counts[i]);
+    ASSERT_EQ(0u, log.workers[i]);
+  }
+}
+
+TEST(WorkerPool, IdleWorkersStealItems)
+{
+  WorkerPool pool;
+  pool.start(4);
+
+  // Worker 0 is slow, so the others finish their own shares first and then
+  // take items from its share
+  const size_t n_items = 200;
+  ItemLog log(n_items, 0);
+  pool.parallelFor(n_items, 1, boost::bind(&ItemLog::process, &log, _1, _2, _3));
+
+  size_t begin, end;
+  pool.getRange(0, n_items, begin, end);
+
+  size_t n_stolen = 0;
+  for(size_t i=0; i < n_items; i++) {
+    ASSERT_EQ(1, log.counts[i]) << "item " << i;
+    if(i >= begin and i < end and log.workers[i] != 0) {
+      n_stolen++;
+    }
+  }
+  EXPECT_GT(n_stolen, 0u);
+}
+
+TEST(WorkerPool, Restarts)
+{
+  WorkerPool pool;
+  pool.start(3);
+  pool.stop();
+  pool.start(2);
+  ASSERT_EQ(2u, pool.size());
+
+  ItemLog log(pool.size());
+  pool.run(boost::bind(&ItemLog::count, &log, _1));
+  EXPECT_EQ(1, log.counts[0]);
+  EXPECT_EQ(1, log.counts[1]);
+
+  ItemLog items(50);
+  pool.parallelFor(50, 4, boost::bind(&ItemLog::process, &items, _1, _2, _3));
+  for(size_t i=0; i < 50; i++) {
+    ASSERT_EQ(1, items.counts[i]);
+  }
+}